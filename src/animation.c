@@ -185,13 +185,13 @@ weston_view_animation_frame(struct weston_animation *base,
 	weston_view_geometry_dirty(animation->view);
 	weston_view_schedule_repaint(animation->view);
 
-	/* The view's output_mask will be zero if its position is
+	/* The view's output_mask will be empty if its position is
 	 * offscreen. Animations should always run but as they are also
 	 * run off the repaint cycle, if there's nothing to repaint
 	 * the animation stops running. Therefore if we catch this situation
 	 * and schedule a repaint on all outputs it will be avoided.
 	 */
-	if (animation->view->output_mask == 0)
+	if (weston_output_mask_is_empty(&animation->view->output_mask))
 		weston_compositor_schedule_repaint(compositor);
 }
 
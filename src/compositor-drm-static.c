@@ -44,6 +44,8 @@ weston_drm_backend_config_create() {
 	ths->seat_id = NULL;
 	ths->format = NULL;
 	ths->use_pixman = false;
+	ths->pixman_buffers = 2;
+	ths->pixman_shadow = true;
 
 	return ths;
 
@@ -100,6 +102,24 @@ void weston_drm_backend_config_set_use_pixman(
 	ths->use_pixman = x;
 }
 
+/** The number of dumb buffers each output cycles through with the pixman
+ * renderer, from 2 to 4. default: 2. */
+void
+weston_drm_backend_config_set_pixman_buffers(
+		struct weston_drm_backend_config * ths,
+		int buffers) {
+	ths->pixman_buffers = buffers;
+}
+
+/** If false the pixman renderer composites straight into the scanout
+ * buffers instead of into a shadow image. default: true. */
+void
+weston_drm_backend_config_set_pixman_shadow(
+		struct weston_drm_backend_config * ths,
+		bool x) {
+	ths->pixman_shadow = x;
+}
+
 /** The seat to be used for input and output. If NULL the default "seat0"
  * will be used.
  * The backend will take ownership of the seat_id pointer and will free
@@ -60,6 +60,12 @@ struct weston_drm_backend_config {
 	/** If true the pixman renderer will be used instead of the OpenGL ES
 	 * renderer. */
 	bool use_pixman;
+	/** The number of dumb buffers each output cycles through with the
+	 * pixman renderer, from 2 to 4. */
+	int pixman_buffers;
+	/** If false the pixman renderer composites straight into the
+	 * dumb buffers, instead of into a shadow image copied to them. */
+	bool pixman_shadow;
 
 	/** reuse the current output mode */
 	bool use_current_mode;
@@ -59,6 +59,8 @@
 #include "vaapi-recorder.h"
 #include "presentation_timing-server-protocol.h"
 #include "linux-dmabuf.h"
+#include "plane-policy.h"
+#include "timeline.h"
 
 #ifndef DRM_CAP_TIMESTAMP_MONOTONIC
 #define DRM_CAP_TIMESTAMP_MONOTONIC 0x6
@@ -78,6 +80,33 @@
 
 static int option_current_mode = 0;
 
+/* The KMS properties an atomic commit sets, looked up by name once. */
+enum drm_plane_prop {
+	DRM_PLANE_FB_ID = 0,
+	DRM_PLANE_CRTC_ID,
+	DRM_PLANE_SRC_X,
+	DRM_PLANE_SRC_Y,
+	DRM_PLANE_SRC_W,
+	DRM_PLANE_SRC_H,
+	DRM_PLANE_CRTC_X,
+	DRM_PLANE_CRTC_Y,
+	DRM_PLANE_CRTC_W,
+	DRM_PLANE_CRTC_H,
+	DRM_PLANE_TYPE,
+	DRM_PLANE__COUNT
+};
+
+enum drm_crtc_prop {
+	DRM_CRTC_MODE_ID = 0,
+	DRM_CRTC_ACTIVE,
+	DRM_CRTC__COUNT
+};
+
+enum drm_connector_prop {
+	DRM_CONNECTOR_CRTC_ID = 0,
+	DRM_CONNECTOR__COUNT
+};
+
 enum output_config {
 	OUTPUT_CONFIG_INVALID = 0,
 	OUTPUT_CONFIG_OFF,
@@ -122,9 +151,17 @@ struct drm_backend {
 	int sprites_are_broken;
 	int sprites_hidden;
 
+	/* Primary planes, only known with atomic modesetting */
+	struct wl_list primary_plane_list;
+	int atomic_modeset;
+
 	int cursors_are_broken;
 
 	int use_pixman;
+	/* Dumb buffers scanned out by each output with the pixman
+	 * renderer, and whether it composites into a shadow image */
+	int pixman_buffers;
+	int pixman_shadow;
 
 	uint32_t prev_state;
 
@@ -137,6 +174,8 @@ struct drm_backend {
 
 };
 
+#define DRM_PIXMAN_MAX_BUFFERS 4
+
 struct drm_mode {
 	struct weston_mode base;
 	drmModeModeInfo mode_info;
@@ -191,13 +230,30 @@ struct drm_output {
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
+	/* The pixman renderer draws into a ring of dumb buffers. The age
+	 * of a buffer is the number of frames since it was drawn, 0 when
+	 * its content is undefined, and damage_history holds the damage
+	 * of the last frames, newest first, to bring it up to date. */
+	struct drm_fb *dumb[DRM_PIXMAN_MAX_BUFFERS];
+	pixman_image_t *image[DRM_PIXMAN_MAX_BUFFERS];
+	int dumb_age[DRM_PIXMAN_MAX_BUFFERS];
+	int dumb_count;
 	int current_image;
-	pixman_region32_t previous_damage;
+	pixman_region32_t damage_history[DRM_PIXMAN_MAX_BUFFERS];
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
+
+	/* The primary plane of the crtc, when the output is updated with
+	 * atomic commits */
+	struct drm_sprite *scanout_plane;
+	uint32_t crtc_props[DRM_CRTC__COUNT];
+	uint32_t connector_props[DRM_CONNECTOR__COUNT];
+
+	/* Picks the views worth an overlay, policy_handles holds the
+	 * policy handle of each view in the view list for a repaint */
+	struct plane_policy *plane_policy;
+	struct wl_array policy_handles;
 };
 
 /*
@@ -215,6 +271,7 @@ struct drm_sprite {
 
 	uint32_t possible_crtcs;
 	uint32_t plane_id;
+	uint32_t props[DRM_PLANE__COUNT];
 	uint32_t count_formats;
 
 	int32_t src_x, src_y;
@@ -242,6 +299,11 @@ drm_output_set_cursor(struct drm_output *output);
 static void
 drm_output_update_msc(struct drm_output *output, unsigned int seq);
 
+#ifdef HAVE_DRM_ATOMIC
+static int
+drm_output_test_planes(struct drm_output *output);
+#endif
+
 static int
 drm_sprite_crtc_supported(struct drm_output *output, uint32_t supported)
 {
@@ -430,14 +492,25 @@ drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
+static int
+drm_output_is_dumb(struct drm_output *output, struct drm_fb *fb)
+{
+	int i;
+
+	for (i = 0; i < output->dumb_count; i++)
+		if (fb == output->dumb[i])
+			return 1;
+
+	return 0;
+}
+
 static void
 drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 {
 	if (!fb)
 		return;
 
-	if (fb->map &&
-            (fb != output->dumb[0] && fb != output->dumb[1])) {
+	if (fb->map && !drm_output_is_dumb(output, fb)) {
 		drm_fb_destroy_dumb(fb);
 	} else if (fb->bo) {
 		if (fb->is_client_buffer)
@@ -522,6 +595,14 @@ drm_output_prepare_scanout_view(struct drm_output *output,
 
 	drm_fb_set_buffer(output->next, buffer);
 
+#ifdef HAVE_DRM_ATOMIC
+	if (output->scanout_plane && drm_output_test_planes(output) < 0) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+		return NULL;
+	}
+#endif
+
 	return &output->fb_plane;
 }
 
@@ -553,17 +634,35 @@ static void
 drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
+	pixman_region32_t total_damage, oldest;
+	int age, i;
 
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
+	output->current_image = (output->current_image + 1) %
+				output->dumb_count;
+	age = output->dumb_age[output->current_image];
 
-	pixman_region32_copy(&previous_damage, damage);
+	/* Besides the new damage, the buffer misses whatever changed
+	 * since it was last drawn. */
+	pixman_region32_init(&total_damage);
+	if (age == 0 || age > output->dumb_count) {
+		pixman_region32_copy(&total_damage, &output->base.region);
+	} else {
+		pixman_region32_copy(&total_damage, damage);
+		for (i = 0; i < age - 1; i++)
+			pixman_region32_union(&total_damage, &total_damage,
+					      &output->damage_history[i]);
+	}
 
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+	oldest = output->damage_history[output->dumb_count - 1];
+	memmove(&output->damage_history[1], &output->damage_history[0],
+		(output->dumb_count - 1) * sizeof output->damage_history[0]);
+	output->damage_history[0] = oldest;
+	pixman_region32_copy(&output->damage_history[0], damage);
 
-	output->current_image ^= 1;
+	for (i = 0; i < output->dumb_count; i++)
+		if (output->dumb_age[i] > 0)
+			output->dumb_age[i]++;
+	output->dumb_age[output->current_image] = 1;
 
 	output->next = output->dumb[output->current_image];
 	pixman_renderer_output_set_buffer(&output->base,
@@ -572,7 +671,6 @@ drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 	ec->renderer->repaint_output(&output->base, &total_damage);
 
 	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
 }
 
 static void
@@ -637,6 +735,342 @@ drm_waitvblank_pipe(struct drm_output *output)
 		return 0;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static const char * const drm_plane_prop_names[] = {
+	[DRM_PLANE_FB_ID] = "FB_ID",
+	[DRM_PLANE_CRTC_ID] = "CRTC_ID",
+	[DRM_PLANE_SRC_X] = "SRC_X",
+	[DRM_PLANE_SRC_Y] = "SRC_Y",
+	[DRM_PLANE_SRC_W] = "SRC_W",
+	[DRM_PLANE_SRC_H] = "SRC_H",
+	[DRM_PLANE_CRTC_X] = "CRTC_X",
+	[DRM_PLANE_CRTC_Y] = "CRTC_Y",
+	[DRM_PLANE_CRTC_W] = "CRTC_W",
+	[DRM_PLANE_CRTC_H] = "CRTC_H",
+	[DRM_PLANE_TYPE] = "type",
+};
+
+static const char * const drm_crtc_prop_names[] = {
+	[DRM_CRTC_MODE_ID] = "MODE_ID",
+	[DRM_CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char * const drm_connector_prop_names[] = {
+	[DRM_CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+/**
+ * Look up the ids of KMS object properties by name
+ *
+ * @param fd DRM device file descriptor
+ * @param obj_id KMS object id
+ * @param obj_type KMS object type, one of DRM_MODE_OBJECT_*
+ * @param names Names of the properties to look up
+ * @param ids Filled with the property ids
+ * @param values Filled with the current property values, may be NULL
+ * @param count Number of properties to look up
+ * @returns 0 if all the properties were found, -1 otherwise
+ */
+static int
+drm_get_prop_ids(int fd, uint32_t obj_id, uint32_t obj_type,
+		 const char * const *names, uint32_t *ids, uint64_t *values,
+		 int count)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j, found = 0;
+
+	memset(ids, 0, count * sizeof *ids);
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (ids[j] || strcmp(prop->name, names[j]) != 0)
+				continue;
+
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+			found++;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return found == count ? 0 : -1;
+}
+
+static int
+drm_atomic_add(drmModeAtomicReq *req, uint32_t obj_id, uint32_t prop_id,
+	       uint64_t value)
+{
+	return drmModeAtomicAddProperty(req, obj_id, prop_id, value) < 0 ? -1 : 0;
+}
+
+/* Shows fb on the plane with the plane's src and dest rectangles, or
+ * turns the plane off for a NULL fb. */
+static int
+drm_plane_add_atomic(drmModeAtomicReq *req, struct drm_sprite *s,
+		     uint32_t crtc_id, struct drm_fb *fb)
+{
+	uint32_t *props = s->props;
+	int ret = 0;
+
+	if (!fb) {
+		ret |= drm_atomic_add(req, s->plane_id,
+				      props[DRM_PLANE_FB_ID], 0);
+		ret |= drm_atomic_add(req, s->plane_id,
+				      props[DRM_PLANE_CRTC_ID], 0);
+		return ret;
+	}
+
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_FB_ID],
+			      fb->fb_id);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_CRTC_ID],
+			      crtc_id);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_SRC_X],
+			      s->src_x);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_SRC_Y],
+			      s->src_y);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_SRC_W],
+			      s->src_w);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_SRC_H],
+			      s->src_h);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_CRTC_X],
+			      s->dest_x);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_CRTC_Y],
+			      s->dest_y);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_CRTC_W],
+			      s->dest_w);
+	ret |= drm_atomic_add(req, s->plane_id, props[DRM_PLANE_CRTC_H],
+			      s->dest_h);
+
+	return ret;
+}
+
+/* Adds the state of every plane of the output to the request: the
+ * primary plane showing primary_fb, and the sprites showing their next
+ * fb or turned off if they have none. */
+static int
+drm_output_populate_atomic(struct drm_output *output, drmModeAtomicReq *req,
+			   struct drm_fb *primary_fb)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *primary = output->scanout_plane;
+	struct drm_mode *mode;
+	struct drm_sprite *s;
+	int ret = 0;
+
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
+	primary->src_x = 0;
+	primary->src_y = 0;
+	primary->src_w = mode->mode_info.hdisplay << 16;
+	primary->src_h = mode->mode_info.vdisplay << 16;
+	primary->dest_x = 0;
+	primary->dest_y = 0;
+	primary->dest_w = mode->mode_info.hdisplay;
+	primary->dest_h = mode->mode_info.vdisplay;
+	ret |= drm_plane_add_atomic(req, primary, output->crtc_id, primary_fb);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		ret |= drm_plane_add_atomic(req, s, output->crtc_id,
+					    b->sprites_hidden ? NULL : s->next);
+	}
+
+	return ret;
+}
+
+/**
+ * Ask the kernel whether the planes chosen so far can be shown together
+ *
+ * Builds the commit the next repaint would make, using the fb that is
+ * on the primary plane now if the view assignment has not picked a
+ * scanout buffer, and checks it with a TEST_ONLY commit.
+ *
+ * @param output DRM output
+ * @returns 0 if the configuration works, -1 otherwise
+ */
+static int
+drm_output_test_planes(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_fb *primary_fb = output->next ? output->next : output->current;
+	drmModeAtomicReq *req;
+	int ret;
+
+	if (!primary_fb)
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_populate_atomic(output, req, primary_fb);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+
+	return ret == 0 ? 0 : -1;
+}
+
+/* Updates the crtc and all its planes in one commit, completed by a
+ * single page flip event. */
+static int
+drm_output_repaint_atomic(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	struct drm_mode *mode;
+	drmModeAtomicReq *req;
+	uint32_t blob_id = 0;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	if (!output->current ||
+	    output->current->stride != output->next->stride) {
+		mode = container_of(output->base.current_mode,
+				    struct drm_mode, base);
+		if (drmModeCreatePropertyBlob(b->drm.fd, &mode->mode_info,
+					      sizeof mode->mode_info,
+					      &blob_id) != 0) {
+			weston_log("failed to create mode blob: %m\n");
+			drmModeAtomicFree(req);
+			return -1;
+		}
+
+		ret |= drm_atomic_add(req, output->crtc_id,
+				      output->crtc_props[DRM_CRTC_MODE_ID],
+				      blob_id);
+		ret |= drm_atomic_add(req, output->crtc_id,
+				      output->crtc_props[DRM_CRTC_ACTIVE], 1);
+		ret |= drm_atomic_add(req, output->connector_id,
+				      output->connector_props[DRM_CONNECTOR_CRTC_ID],
+				      output->crtc_id);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	ret |= drm_output_populate_atomic(output, req, output->next);
+	if (ret == 0) {
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, output);
+		if (ret)
+			weston_log("atomic commit failed: %m\n");
+	} else {
+		weston_log("failed to build atomic request\n");
+	}
+
+	/* The crtc state holds its own reference to the mode blob. */
+	if (blob_id)
+		drmModeDestroyPropertyBlob(b->drm.fd, blob_id);
+	drmModeAtomicFree(req);
+
+	if (ret)
+		return -1;
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)
+		output->base.set_dpms(&output->base, WESTON_DPMS_ON);
+
+	return 0;
+}
+
+/* The sprites of the output show their next fb now. */
+static void
+drm_output_flip_sprites(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->current);
+		s->current = s->next;
+		s->next = NULL;
+		if (!s->current)
+			s->output = NULL;
+	}
+}
+
+/* Drops the sprite fbs chosen for a commit that did not happen. */
+static void
+drm_output_release_sprites(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output || !s->next)
+			continue;
+
+		drm_output_release_fb(output, s->next);
+		s->next = NULL;
+		if (!s->current)
+			s->output = NULL;
+	}
+}
+
+/**
+ * Set up an output for atomic commits
+ *
+ * Picks a free primary plane for the output's crtc and looks up the
+ * crtc and connector properties a modeset needs. If anything is
+ * missing, the output keeps using the legacy KMS calls.
+ *
+ * @param b DRM backend
+ * @param output DRM output with its crtc and connector set
+ */
+static void
+drm_output_init_atomic(struct drm_backend *b, struct drm_output *output)
+{
+	struct drm_sprite *s;
+
+	if (drm_get_prop_ids(b->drm.fd, output->crtc_id,
+			     DRM_MODE_OBJECT_CRTC, drm_crtc_prop_names,
+			     output->crtc_props, NULL, DRM_CRTC__COUNT) < 0 ||
+	    drm_get_prop_ids(b->drm.fd, output->connector_id,
+			     DRM_MODE_OBJECT_CONNECTOR, drm_connector_prop_names,
+			     output->connector_props, NULL,
+			     DRM_CONNECTOR__COUNT) < 0) {
+		weston_log("missing atomic crtc or connector properties\n");
+		return;
+	}
+
+	wl_list_for_each(s, &b->primary_plane_list, link) {
+		if (s->output || !(s->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		s->output = output;
+		output->scanout_plane = s;
+		return;
+	}
+
+	weston_log("no primary plane for crtc %d, using legacy page flips\n",
+		   output->crtc_id);
+}
+#endif
+
 static int
 drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage)
@@ -656,6 +1090,20 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!output->next)
 		return -1;
 
+#ifdef HAVE_DRM_ATOMIC
+	if (output->scanout_plane) {
+		if (drm_output_repaint_atomic(output) < 0) {
+			drm_output_release_sprites(output);
+			goto err_pageflip;
+		}
+
+		output->page_flip_pending = 1;
+		drm_output_set_cursor(output);
+
+		return 0;
+	}
+#endif
+
 	mode = container_of(output->base.current_mode, struct drm_mode, base);
 	if (!output->current ||
 	    output->current->stride != output->next->stride) {
@@ -865,6 +1313,10 @@ page_flip_handler(int fd, unsigned int frame,
 		drm_output_release_fb(output, output->current);
 		output->current = output->next;
 		output->next = NULL;
+#ifdef HAVE_DRM_ATOMIC
+		if (output->scanout_plane)
+			drm_output_flip_sprites(output);
+#endif
 	}
 
 	output->page_flip_pending = 0;
@@ -919,55 +1371,102 @@ drm_view_transform_supported(struct weston_view *ev)
 		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
 }
 
-static struct weston_plane *
-drm_output_prepare_overlay_view(struct drm_output *output,
-				struct weston_view *ev)
+/* Whether the view could be shown on an overlay of the output, as far
+ * as can be told without importing its buffer. */
+static int
+drm_view_overlay_candidate(struct drm_output *output, struct weston_view *ev)
 {
-	struct weston_compositor *ec = output->base.compositor;
-	struct drm_backend *b = (struct drm_backend *)ec->backend;
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_resource *buffer_resource;
-	struct drm_sprite *s;
-	struct linux_dmabuf_buffer *dmabuf;
-	int found = 0;
-	struct gbm_bo *bo;
-	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box, tbox;
-	uint32_t format;
-	wl_fixed_t sx1, sy1, sx2, sy2;
 
 	if (b->gbm == NULL)
-		return NULL;
+		return 0;
 
 	if (viewport->buffer.transform != output->base.transform)
-		return NULL;
+		return 0;
 
 	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
+		return 0;
 
 	if (b->sprites_are_broken)
-		return NULL;
+		return 0;
 
-	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+	if (!weston_output_mask_is_only(&ev->output_mask, output->base.id))
+		return 0;
 
 	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	buffer_resource = ev->surface->buffer_ref.buffer->resource;
+		return 0;
 
 	if (ev->alpha != 1.0f)
-		return NULL;
+		return 0;
 
-	if (wl_shm_buffer_get(buffer_resource))
-		return NULL;
+	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		return 0;
 
 	if (!drm_view_transform_supported(ev))
+		return 0;
+
+	/* Atomic commits need a primary fb to test the planes with. */
+	if (b->atomic_modeset &&
+	    (!output->scanout_plane || (!output->next && !output->current)))
+		return 0;
+
+	return 1;
+}
+
+/* The number of sprites the output could put views on. */
+static int
+drm_output_count_sprites(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *s;
+	int count = 0;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (!drm_sprite_crtc_supported(output, s->possible_crtcs))
+			continue;
+
+		if (b->atomic_modeset && s->output && s->output != output)
+			continue;
+
+		count++;
+	}
+
+	return count;
+}
+
+static struct weston_plane *
+drm_output_prepare_overlay_view(struct drm_output *output,
+				struct weston_view *ev)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_backend *b = (struct drm_backend *)ec->backend;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct wl_resource *buffer_resource;
+	struct drm_sprite *s;
+	struct linux_dmabuf_buffer *dmabuf;
+	int found = 0;
+	struct gbm_bo *bo;
+	pixman_region32_t dest_rect, src_rect;
+	pixman_box32_t *box, tbox;
+	uint32_t format;
+	wl_fixed_t sx1, sy1, sx2, sy2;
+
+	if (!drm_view_overlay_candidate(output, ev))
 		return NULL;
+	buffer_resource = ev->surface->buffer_ref.buffer->resource;
 
 	wl_list_for_each(s, &b->sprite_list, link) {
 		if (!drm_sprite_crtc_supported(output, s->possible_crtcs))
 			continue;
 
+		/* A sprite still shown on another output has to be
+		 * turned off there first. */
+		if (b->atomic_modeset && s->output && s->output != output)
+			continue;
+
 		if (!s->next) {
 			found = 1;
 			break;
@@ -1089,6 +1588,21 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 	s->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
+#ifdef HAVE_DRM_ATOMIC
+	/* Let the kernel decide instead of guessing what the hardware
+	 * can scan out. */
+	if (output->scanout_plane) {
+		s->output = output;
+		if (drm_output_test_planes(output) < 0) {
+			drm_output_release_fb(output, s->next);
+			s->next = NULL;
+			if (!s->current)
+				s->output = NULL;
+			return NULL;
+		}
+	}
+#endif
+
 	return &s->plane;
 }
 
@@ -1111,7 +1625,7 @@ drm_output_prepare_cursor_view(struct drm_output *output,
 		return NULL;
 	if (output->cursor_view)
 		return NULL;
-	if (ev->output_mask != (1u << output->base.id))
+	if (!weston_output_mask_is_only(&ev->output_mask, output->base.id))
 		return NULL;
 	if (b->cursors_are_broken)
 		return NULL;
@@ -1219,6 +1733,38 @@ drm_output_set_cursor(struct drm_output *output)
 	}
 }
 
+/* What a view was put on, as reported in the drm_assign_plane
+ * timeline point. */
+enum drm_view_plane {
+	DRM_VIEW_PLANE_PRIMARY = 0,
+	DRM_VIEW_PLANE_CURSOR,
+	DRM_VIEW_PLANE_SCANOUT,
+	DRM_VIEW_PLANE_OVERLAY,
+};
+
+/* Describes a view that could go on an overlay to the plane policy. */
+static int
+drm_output_add_policy_view(struct drm_output *output, struct weston_view *ev)
+{
+	struct weston_surface *es = ev->surface;
+	struct weston_buffer *buffer = es->buffer_ref.buffer;
+	pixman_region32_t visible;
+	pixman_box32_t *box;
+	uint32_t screen_area;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &ev->transform.boundingbox,
+				  &output->base.region);
+	box = pixman_region32_extents(&visible);
+	screen_area = (box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&visible);
+
+	return plane_policy_add(output->plane_policy, es, buffer,
+				pixman_region32_not_empty(&es->damage),
+				screen_area,
+				(uint32_t) buffer->width * buffer->height);
+}
+
 static void
 drm_assign_planes(struct weston_output *output_base)
 {
@@ -1228,25 +1774,53 @@ drm_assign_planes(struct weston_output *output_base)
 	struct weston_view *ev, *next;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	enum drm_view_plane kind;
+	struct timespec now;
+	int *handle, count, i;
 
 	/*
-	 * Find a surface for each sprite in the output using some heuristics:
-	 * 1) size
-	 * 2) frequency of update
-	 * 3) opacity (though some hw might support alpha blending)
-	 * 4) clipping (this can be fixed with color keys)
+	 * Overlays are handed out by the plane policy, which ranks the
+	 * views that could use one by the composition an overlay saves
+	 * them, going by their size on the output and how often they
+	 * update, against the bandwidth of scanning out their buffer.
+	 * A large video surface on a sprite lets the main display
+	 * surface go without updates, while a static window is cheaper
+	 * to leave on the primary plane.
 	 *
-	 * The idea is to save on blitting since this should save power.
-	 * If we can get a large video surface on the sprite for example,
-	 * the main display surface may not need to update at all, and
-	 * the client buffer can be used directly for the sprite surface
-	 * as we do for flipping full screen surfaces.
+	 * The first pass describes the candidates to the policy, the
+	 * second walks the views top to bottom and puts each on the
+	 * first plane that takes it.
 	 */
+	weston_compositor_read_presentation_clock(output_base->compositor, &now);
+	plane_policy_begin(output->plane_policy, timespec_to_nsec(&now) / 1000000,
+			   output_base->current_mode->refresh);
+
+	output->policy_handles.size = 0;
+	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
+		handle = wl_array_add(&output->policy_handles, sizeof *handle);
+		if (!handle)
+			break;
+
+		*handle = -1;
+		if (drm_view_overlay_candidate(output, ev))
+			*handle = drm_output_add_policy_view(output, ev);
+	}
+	count = output->policy_handles.size / sizeof *handle;
+
+	plane_policy_choose(output->plane_policy,
+			    drm_output_count_sprites(output));
+
 	pixman_region32_init(&overlap);
 	primary = &output_base->compositor->primary_plane;
 
+	i = 0;
 	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
 		struct weston_surface *es = ev->surface;
+		int policy_handle = -1;
+
+		if (i < count)
+			policy_handle = ((int *) output->policy_handles.data)[i];
+		i++;
 
 		/* Test whether this buffer can ever go into a plane:
 		 * non-shm, or small enough to be a cursor.
@@ -1276,13 +1850,35 @@ drm_assign_planes(struct weston_output *output_base)
 			next_plane = drm_output_prepare_cursor_view(output, ev);
 		if (next_plane == NULL)
 			next_plane = drm_output_prepare_scanout_view(output, ev);
-		if (next_plane == NULL)
+		if (next_plane == NULL &&
+		    plane_policy_allowed(output->plane_policy, policy_handle))
 			next_plane = drm_output_prepare_overlay_view(output, ev);
 		if (next_plane == NULL)
 			next_plane = primary;
 
 		weston_view_move_to_plane(ev, next_plane);
 
+		if (next_plane == primary)
+			kind = DRM_VIEW_PLANE_PRIMARY;
+		else if (next_plane == &output->cursor_plane)
+			kind = DRM_VIEW_PLANE_CURSOR;
+		else if (next_plane == &output->fb_plane)
+			kind = DRM_VIEW_PLANE_SCANOUT;
+		else
+			kind = DRM_VIEW_PLANE_OVERLAY;
+
+		if (kind == DRM_VIEW_PLANE_OVERLAY)
+			plane_policy_placed(output->plane_policy, policy_handle);
+
+		if (weston_output_mask_contains(&ev->output_mask,
+						output_base->id))
+			TL_POINT("drm_assign_plane", TLP_OUTPUT(output_base),
+				 TLP_SURFACE(es), TLP_INT("plane", kind),
+				 TLP_INT("score",
+					 plane_policy_score(output->plane_policy,
+							    policy_handle)),
+				 TLP_END);
+
 		if (next_plane == primary)
 			pixman_region32_union(&overlap, &overlap,
 					      &ev->transform.boundingbox);
@@ -1301,6 +1897,8 @@ drm_assign_planes(struct weston_output *output_base)
 		pixman_region32_fini(&surface_overlap);
 	}
 	pixman_region32_fini(&overlap);
+
+	plane_policy_end(output->plane_policy);
 }
 
 static void
@@ -1313,6 +1911,7 @@ drm_output_destroy(struct weston_output *output_base)
 	struct drm_backend *b =
 		(struct drm_backend *)output->base.compositor->backend;
 	drmModeCrtcPtr origcrtc = output->original_crtc;
+	struct drm_sprite *s;
 
 	if (output->page_flip_pending) {
 		output->destroy_pending = 1;
@@ -1337,6 +1936,23 @@ drm_output_destroy(struct weston_output *output_base)
 	b->crtc_allocator &= ~(1 << output->crtc_id);
 	b->connector_allocator &= ~(1 << output->connector_id);
 
+	if (output->scanout_plane) {
+		output->scanout_plane->output = NULL;
+
+		wl_list_for_each(s, &b->sprite_list, link) {
+			if (s->output != output)
+				continue;
+
+			drmModeSetPlane(b->drm.fd, s->plane_id,
+					output->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0);
+			drm_output_release_fb(output, s->current);
+			drm_output_release_fb(output, s->next);
+			s->current = s->next = NULL;
+			s->output = NULL;
+		}
+	}
+
 	if (b->use_pixman) {
 		drm_output_fini_pixman(output);
 	} else {
@@ -1347,6 +1963,9 @@ drm_output_destroy(struct weston_output *output_base)
 	weston_plane_release(&output->fb_plane);
 	weston_plane_release(&output->cursor_plane);
 
+	plane_policy_destroy(output->plane_policy);
+	wl_array_release(&output->policy_handles);
+
 	weston_output_destroy(&output->base);
 
 	free(output);
@@ -1522,6 +2141,15 @@ init_drm(struct drm_backend *b, struct udev_device *device)
 	else
 		b->cursor_height = 64;
 
+#ifdef HAVE_DRM_ATOMIC
+	/* This also exposes the primary and cursor planes. */
+	if (!getenv("WESTON_DISABLE_ATOMIC") &&
+	    drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0) {
+		weston_log("using atomic modesetting\n");
+		b->atomic_modeset = 1;
+	}
+#endif
+
 	return 0;
 }
 
@@ -1884,11 +2512,17 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 {
 	int w = output->base.current_mode->width;
 	int h = output->base.current_mode->height;
-	unsigned int i;
+	uint32_t flags = 0;
+	int i;
 
 	/* FIXME error checking */
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	output->dumb_count = b->pixman_buffers;
+	output->current_image = 0;
+
+	for (i = 0; i < output->dumb_count; i++) {
+		output->dumb_age[i] = 0;
+
 		output->dumb[i] = drm_fb_create_dumb(b, w, h);
 		if (!output->dumb[i])
 			goto err;
@@ -1901,16 +2535,19 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (b->pixman_shadow)
+		flags |= PIXMAN_RENDERER_OUTPUT_USE_SHADOW;
+
+	if (pixman_renderer_output_create(&output->base, flags) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_init(&output->damage_history[i]);
 
 	return 0;
 
 err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		if (output->dumb[i])
 			drm_fb_destroy_dumb(output->dumb[i]);
 		if (output->image[i])
@@ -1919,6 +2556,7 @@ err:
 		output->dumb[i] = NULL;
 		output->image[i] = NULL;
 	}
+	output->dumb_count = 0;
 
 	return -1;
 }
@@ -1926,17 +2564,18 @@ err:
 static void
 drm_output_fini_pixman(struct drm_output *output)
 {
-	unsigned int i;
+	int i;
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
+		pixman_region32_fini(&output->damage_history[i]);
 		drm_fb_destroy_dumb(output->dumb[i]);
 		pixman_image_unref(output->image[i]);
 		output->dumb[i] = NULL;
 		output->image[i] = NULL;
 	}
+	output->dumb_count = 0;
 }
 
 static void
@@ -2381,6 +3020,11 @@ create_output_for_connector(struct drm_backend *b,
 			   connector->mmWidth, connector->mmHeight,
 			   config->base.transform, config->base.scale);
 
+	wl_array_init(&output->policy_handles);
+	output->plane_policy = plane_policy_create();
+	if (!output->plane_policy)
+		goto err_output;
+
 	if (b->use_pixman) {
 		if (drm_output_init_pixman(output, b) < 0) {
 			weston_log("Failed to init output pixman state\n");
@@ -2402,6 +3046,11 @@ create_output_for_connector(struct drm_backend *b,
 		weston_log("Failed to initialize backlight\n");
 	}
 
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset)
+		drm_output_init_atomic(b, output);
+#endif
+
 	weston_compositor_add_output(b->compositor, &output->base);
 
 	find_and_parse_output_edid(b, output, connector);
@@ -2444,6 +3093,8 @@ create_output_for_connector(struct drm_backend *b,
 	return 0;
 
 err_output:
+	if (output->plane_policy)
+		plane_policy_destroy(output->plane_policy);
 	weston_output_destroy(&output->base);
 err_free:
 	wl_list_for_each_safe(drm_mode, next, &output->base.mode_list,
@@ -2466,8 +3117,15 @@ create_sprites(struct drm_backend *b)
 	struct drm_sprite *sprite;
 	drmModePlaneRes *plane_res;
 	drmModePlane *plane;
+	uint32_t props[DRM_PLANE__COUNT];
+#ifdef HAVE_DRM_ATOMIC
+	uint64_t values[DRM_PLANE__COUNT];
+	uint64_t type = 0;
+#endif
 	uint32_t i;
 
+	memset(props, 0, sizeof props);
+
 	plane_res = drmModeGetPlaneResources(b->drm.fd);
 	if (!plane_res) {
 		weston_log("failed to get plane resources: %s\n",
@@ -2480,6 +3138,27 @@ create_sprites(struct drm_backend *b)
 		if (!plane)
 			continue;
 
+#ifdef HAVE_DRM_ATOMIC
+		if (b->atomic_modeset) {
+			if (drm_get_prop_ids(b->drm.fd, plane->plane_id,
+					     DRM_MODE_OBJECT_PLANE,
+					     drm_plane_prop_names, props,
+					     values, DRM_PLANE__COUNT) < 0) {
+				weston_log("plane %d lacks atomic properties\n",
+					   plane->plane_id);
+				drmModeFreePlane(plane);
+				continue;
+			}
+
+			/* The cursor keeps using the legacy calls. */
+			type = values[DRM_PLANE_TYPE];
+			if (type == DRM_PLANE_TYPE_CURSOR) {
+				drmModeFreePlane(plane);
+				continue;
+			}
+		}
+#endif
+
 		sprite = zalloc(sizeof(*sprite) + ((sizeof(uint32_t)) *
 						   plane->count_formats));
 		if (!sprite) {
@@ -2497,7 +3176,16 @@ create_sprites(struct drm_backend *b)
 		sprite->count_formats = plane->count_formats;
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
+		memcpy(sprite->props, props, sizeof props);
 		drmModeFreePlane(plane);
+
+#ifdef HAVE_DRM_ATOMIC
+		if (type == DRM_PLANE_TYPE_PRIMARY) {
+			wl_list_insert(&b->primary_plane_list, &sprite->link);
+			continue;
+		}
+#endif
+
 		weston_plane_init(&sprite->plane, b->compositor, 0, 0);
 		weston_compositor_stack_plane(b->compositor, &sprite->plane,
 					      &b->compositor->primary_plane);
@@ -2525,6 +3213,14 @@ destroy_sprites(struct drm_backend *backend)
 		drm_output_release_fb(output, sprite->current);
 		drm_output_release_fb(output, sprite->next);
 		weston_plane_release(&sprite->plane);
+		wl_list_remove(&sprite->link);
+		free(sprite);
+	}
+
+	wl_list_for_each_safe(sprite, next, &backend->primary_plane_list, link) {
+		if (sprite->output)
+			sprite->output->scanout_plane = NULL;
+		wl_list_remove(&sprite->link);
 		free(sprite);
 	}
 }
@@ -3069,11 +3765,19 @@ drm_backend_create(struct weston_compositor *compositor,
 	 * to a fraction. For cursors, it's not so bad, so they are
 	 * enabled.
 	 *
-	 * These can be enabled again when nuclear/atomic support lands.
+	 * They are enabled below when the kernel supports atomic commits.
 	 */
 	b->sprites_are_broken = 1;
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
+	b->pixman_shadow = config->pixman_shadow;
+	b->pixman_buffers = config->pixman_buffers;
+	if (b->pixman_buffers < 2 ||
+	    b->pixman_buffers > DRM_PIXMAN_MAX_BUFFERS) {
+		weston_log("Invalid number of pixman buffers %d, using 2\n",
+			   b->pixman_buffers);
+		b->pixman_buffers = 2;
+	}
 
 	/* the backend become the owner */
 	b->config = config;
@@ -3114,6 +3818,9 @@ drm_backend_create(struct weston_compositor *compositor,
 		goto err_udev_dev;
 	}
 
+	if (b->atomic_modeset)
+		b->sprites_are_broken = 0;
+
 	if (b->use_pixman) {
 		if (init_pixman(b) < 0) {
 			weston_log("failed to initialize pixman renderer\n");
@@ -3135,6 +3842,7 @@ drm_backend_create(struct weston_compositor *compositor,
 	weston_setup_vt_switch_bindings(compositor);
 
 	wl_list_init(&b->sprite_list);
+	wl_list_init(&b->primary_plane_list);
 	create_sprites(b);
 
 	if (udev_input_init(&b->input,
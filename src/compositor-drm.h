@@ -76,6 +76,18 @@ WL_EXPORT void
 weston_drm_backend_config_set_use_pixman(
 		struct weston_drm_backend_config * ths, bool x);
 
+/** The number of dumb buffers each output cycles through with the pixman
+ * renderer, from 2 to 4. default: 2. */
+WL_EXPORT void
+weston_drm_backend_config_set_pixman_buffers(
+		struct weston_drm_backend_config * ths, int buffers);
+
+/** If false the pixman renderer composites straight into the scanout
+ * buffers instead of into a shadow image. default: true. */
+WL_EXPORT void
+weston_drm_backend_config_set_pixman_shadow(
+		struct weston_drm_backend_config * ths, bool x);
+
 /** reuse the current output mode */
 WL_EXPORT void
 weston_drm_backend_config_set_use_current_mode(
@@ -27,34 +27,50 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 #include <stdbool.h>
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "compositor.h"
 #include "pixman-renderer.h"
 #include "presentation_timing-server-protocol.h"
 
+/* How often the frame rate of a free-running output is logged. */
+#define HEADLESS_FPS_INTERVAL_NSEC	5000000000LL
+
 struct headless_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	bool free_running;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	int64_t frame_nsec;
+	int64_t next_frame_nsec;
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	struct {
+		uint32_t frames;
+		struct timespec begin;
+	} fps;
 };
 
 struct headless_parameters {
 	int width;
 	int height;
 	int use_pixman;
+	int free_running;
+	int output_count;
+	int32_t refresh;
 	uint32_t transform;
 };
 
@@ -67,31 +83,102 @@ headless_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, PRESENTATION_FEEDBACK_INVALID);
 }
 
+static void
+headless_output_update_fps(struct headless_backend *b,
+			   struct headless_output *output,
+			   const struct timespec *now)
+{
+	struct pixman_renderer_output_stats stats;
+	struct timespec gone;
+	int64_t nsec;
+
+	output->fps.frames++;
+
+	timespec_sub(&gone, now, &output->fps.begin);
+	nsec = timespec_to_nsec(&gone);
+	if (nsec < HEADLESS_FPS_INTERVAL_NSEC)
+		return;
+
+	weston_log("headless output %s: %.1f frames per second\n",
+		   output->base.name, output->fps.frames * 1e9 / nsec);
+
+	if (b->use_pixman) {
+		pixman_renderer_output_take_stats(&output->base, &stats);
+		if (stats.frames > 0 && stats.repaint_nsec > 0)
+			weston_log_continue(STAMP_SPACE "pixman: %.2f ms per "
+					    "frame, %d threads, %.2f busy "
+					    "on average\n",
+					    stats.repaint_nsec / 1e6 /
+					    stats.frames, stats.threads,
+					    (double) stats.busy_nsec /
+					    stats.repaint_nsec);
+	}
+
+	output->fps.frames = 0;
+	output->fps.begin = *now;
+}
+
 static int
 finish_frame_handler(void *data)
 {
 	struct headless_output *output = data;
+	struct headless_backend *b =
+		(struct headless_backend *) output->base.compositor->backend;
 	struct timespec ts;
 
 	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	if (b->free_running)
+		headless_output_update_fps(b, output, &ts);
 	weston_output_finish_frame(&output->base, &ts, 0);
 
 	return 1;
 }
 
+static void
+headless_output_schedule_frame(struct headless_output *output)
+{
+	struct timespec now;
+	int64_t now_nsec;
+	int msec;
+
+	/* Frames are due at whole multiples of the refresh period, so the
+	 * millisecond granularity of the timer does not add up to a wrong
+	 * frame rate. When we fell behind, e.g. after the output was idle,
+	 * start counting again from now. */
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	now_nsec = timespec_to_nsec(&now);
+
+	output->next_frame_nsec += output->frame_nsec;
+	if (output->next_frame_nsec <= now_nsec)
+		output->next_frame_nsec = now_nsec + output->frame_nsec;
+
+	msec = (output->next_frame_nsec - now_nsec + 999999) / 1000000;
+	wl_event_source_timer_update(output->finish_frame_timer, msec);
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_backend *b = (struct headless_backend *) ec->backend;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	/* In free-running mode there is no refresh to wait for, but the
+	 * frame still completes from a timer rather than an idle source,
+	 * so that clients and other fds get polled between frames. A delay
+	 * of zero would disarm the timer, one millisecond is the shortest
+	 * one. */
+	if (b->free_running)
+		wl_event_source_timer_update(output->finish_frame_timer, 1);
+	else
+		headless_output_schedule_frame(output);
 
 	return 0;
 }
@@ -118,8 +205,9 @@ headless_output_destroy(struct weston_output *output_base)
 	return;
 }
 
-static int
-headless_backend_create_output(struct headless_backend *b,
+static struct headless_output *
+headless_backend_create_output(struct headless_backend *b, int x,
+			       const char *name,
 			       struct headless_parameters *param)
 {
 	struct weston_compositor *c = b->compositor;
@@ -128,22 +216,28 @@ headless_backend_create_output(struct headless_backend *b,
 
 	output = zalloc(sizeof *output);
 	if (output == NULL)
-		return -1;
+		return NULL;
 
 	output->mode.flags =
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = param->width;
 	output->mode.height = param->height;
-	output->mode.refresh = 60000;
+	/* A refresh of zero tells the core and the clients that frames do
+	 * not follow a fixed refresh rate. */
+	output->mode.refresh = b->free_running ? 0 : param->refresh;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
+	output->frame_nsec = millihz_to_nsec(param->refresh);
+
 	output->base.current_mode = &output->mode;
-	weston_output_init(&output->base, c, 0, 0, param->width,
+	output->base.name = strdup(name);
+	weston_output_init(&output->base, c, x, 0, param->width,
 			   param->height, param->transform, 1);
 
 	output->base.make = "weston";
 	output->base.model = "headless";
+	weston_compositor_read_presentation_clock(c, &output->fps.begin);
 
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->finish_frame_timer =
@@ -160,7 +254,7 @@ headless_backend_create_output(struct headless_backend *b,
 	if (b->use_pixman) {
 		output->image_buf = malloc(param->width * param->height * 4);
 		if (!output->image_buf)
-			return -1;
+			return NULL;
 
 		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
 							 param->width,
@@ -168,8 +262,9 @@ headless_backend_create_output(struct headless_backend *b,
 							 output->image_buf,
 							 param->width * 4);
 
-		if (pixman_renderer_output_create(&output->base) < 0)
-			return -1;
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0)
+			return NULL;
 
 		pixman_renderer_output_set_buffer(&output->base,
 						  output->image);
@@ -177,6 +272,101 @@ headless_backend_create_output(struct headless_backend *b,
 
 	weston_compositor_add_output(c, &output->base);
 
+	weston_log("headless output %s: %dx%d, %s\n", name,
+		   param->width, param->height,
+		   b->free_running ? "free-running" : "timed refresh");
+
+	return output;
+}
+
+static int
+headless_parse_mode(const char *mode, struct headless_parameters *param)
+{
+	float refresh;
+
+	switch (sscanf(mode, "%dx%d@%f",
+		       &param->width, &param->height, &refresh)) {
+	case 3:
+		if (refresh <= 0)
+			return -1;
+		param->refresh = refresh * 1000 + 0.5f;
+		return 0;
+	case 2:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int
+headless_backend_create_outputs(struct headless_backend *b,
+				struct weston_config *config,
+				struct headless_parameters *defaults,
+				int option_width, int option_height)
+{
+	struct weston_config_section *section = NULL;
+	struct headless_parameters param;
+	struct headless_output *output;
+	const char *section_name;
+	char *name, *mode, *t;
+	char default_name[32];
+	int count = defaults->output_count ? defaults->output_count : 1;
+	int output_count = 0;
+	int x = 0;
+
+	while (weston_config_next_section(config, &section, &section_name)) {
+		if (defaults->output_count &&
+		    output_count >= defaults->output_count)
+			break;
+		if (strcmp(section_name, "output") != 0)
+			continue;
+		weston_config_section_get_string(section, "name", &name, NULL);
+		if (name == NULL || strncmp(name, "headless", 8) != 0) {
+			free(name);
+			continue;
+		}
+
+		param = *defaults;
+		weston_config_section_get_string(section, "mode", &mode, NULL);
+		if (mode && headless_parse_mode(mode, &param) < 0) {
+			weston_log("Invalid mode \"%s\" for output %s\n",
+				   mode, name);
+			param = *defaults;
+		}
+		free(mode);
+
+		if (option_width)
+			param.width = option_width;
+		if (option_height)
+			param.height = option_height;
+
+		weston_config_section_get_string(section,
+						 "transform", &t, NULL);
+		if (t && weston_parse_transform(t, &param.transform) < 0)
+			weston_log("Invalid transform \"%s\" for output %s\n",
+				   t, name);
+		free(t);
+
+		output = headless_backend_create_output(b, x, name, &param);
+		free(name);
+		if (output == NULL)
+			return -1;
+
+		x = pixman_region32_extents(&output->base.region)->x2;
+		output_count++;
+	}
+
+	for (; output_count < count; output_count++) {
+		snprintf(default_name, sizeof default_name,
+			 "headless-%d", output_count);
+		output = headless_backend_create_output(b, x, default_name,
+							defaults);
+		if (output == NULL)
+			return -1;
+
+		x = pixman_region32_extents(&output->base.region)->x2;
+	}
+
 	return 0;
 }
 
@@ -217,8 +407,9 @@ headless_destroy(struct weston_compositor *ec)
 
 static struct headless_backend *
 headless_backend_create(struct weston_compositor *compositor,
+			struct weston_config *config,
 			struct headless_parameters *param,
-			const char *display_name)
+			int option_width, int option_height)
 {
 	struct headless_backend *b;
 
@@ -237,10 +428,12 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->base.restore = headless_restore;
 
 	b->use_pixman = param->use_pixman;
+	b->free_running = param->free_running;
 	if (b->use_pixman) {
 		pixman_renderer_init(compositor);
 	}
-	if (headless_backend_create_output(b, param) < 0)
+	if (headless_backend_create_outputs(b, config, param,
+					    option_width, option_height) < 0)
 		goto err_input;
 
 	if (!b->use_pixman && noop_renderer_init(compositor) < 0)
@@ -263,8 +456,7 @@ backend_init(struct weston_compositor *compositor,
 	     struct weston_config *config,
 	     struct weston_backend_config *config_base)
 {
-	int width = 1024, height = 640;
-	char *display_name = NULL;
+	int width = 0, height = 0;
 	struct headless_parameters param = { 0, };
 	const char *transform = "normal";
 	struct headless_backend *b;
@@ -274,18 +466,26 @@ backend_init(struct weston_compositor *compositor,
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &param.output_count },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &param.refresh },
+		{ WESTON_OPTION_BOOLEAN, "free-running", 0, &param.free_running },
 	};
 
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	param.width = width;
-	param.height = height;
+	param.width = width ? width : 1024;
+	param.height = height ? height : 640;
+	if (param.output_count < 0)
+		param.output_count = 0;
+	if (param.refresh <= 0)
+		param.refresh = 60000;
 
 	if (weston_parse_transform(transform, &param.transform) < 0)
 		weston_log("Invalid transform \"%s\"\n", transform);
 
-	b = headless_backend_create(compositor, &param, display_name);
+	b = headless_backend_create(compositor, config, &param,
+				    width, height);
 	if (b == NULL)
 		return -1;
 	return 0;
@@ -26,8 +26,13 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -72,6 +77,8 @@
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_MAX_ENCODER_THREADS 16
+#define RDP_NSC_MIN_BAND_HEIGHT 64
 
 struct rdp_backend_config {
 	int width;
@@ -83,6 +90,7 @@ struct rdp_backend_config {
 	char *server_key;
 	int env_socket;
 	int no_clients_resize;
+	int encoder_threads;
 };
 
 struct rdp_output;
@@ -100,6 +108,7 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int encoder_threads;
 };
 
 enum peer_item_flags {
@@ -115,12 +124,52 @@ struct rdp_peers_item {
 	struct wl_list link;
 };
 
+/* A piece of a frame encoded by an encoder thread. */
+struct rdp_encode_job {
+	void (*encode)(struct rdp_encode_job *job, struct rdp_output *output);
+	struct wl_list link;
+};
+
+/* A band of the damage extents encoded once with NSCodec and sent to
+ * every NSCodec peer. */
+struct rdp_nsc_band {
+	struct rdp_encode_job job;
+	NSC_CONTEXT *nsc_context;
+	wStream *stream;
+	pixman_box32_t box;
+};
+
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
 	struct wl_list peers;
+
+	/* Threads encoding the peer updates off the compositor thread.
+	 * The queue and the pending count are protected by the mutex. */
+	struct {
+		int count;
+		pthread_t *threads;
+		pthread_mutex_t mutex;
+		pthread_cond_t work_cond;
+		pthread_cond_t done_cond;
+		bool quit;
+		struct wl_list queue;
+		int pending;
+		int done_fd;
+		struct wl_event_source *done_source;
+	} encoder;
+
+	/* The frame being encoded. The encoder threads only read it, and
+	 * the shadow surface, while in_flight is set. */
+	struct {
+		bool in_flight;
+		pixman_region32_t damage;
+		struct rdp_nsc_band nsc_bands[RDP_MAX_ENCODER_THREADS];
+		int nsc_band_count;
+		int nsc_band_max;
+	} frame;
 };
 
 struct rdp_peer_context {
@@ -133,6 +182,10 @@ struct rdp_peer_context {
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
 
+	/* The RemoteFX state is per peer, so is its encoding. */
+	struct rdp_encode_job rfx_job;
+	bool in_frame;
+
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
@@ -149,18 +202,43 @@ rdp_backend_config_init(struct rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = -1;
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_send_surface_bits(freerdp_peer *peer, const pixman_box32_t *box,
+			   UINT32 codec_id, wStream *stream)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+
+#ifdef HAVE_SKIP_COMPRESSION
+	cmd->skipCompression = TRUE;
+#else
+	memset(cmd, 0, sizeof(*cmd));
+#endif
+	cmd->destLeft = box->x1;
+	cmd->destTop = box->y1;
+	cmd->destRight = box->x2;
+	cmd->destBottom = box->y2;
+	cmd->bpp = 32;
+	cmd->codecID = codec_id;
+	cmd->width = box->x2 - box->x1;
+	cmd->height = box->y2 - box->y1;
+
+	cmd->bitmapDataLength = Stream_GetPosition(stream);
+	cmd->bitmapData = Stream_Buffer(stream);
+
+	update->SurfaceBits(update->context, cmd);
+}
+
+static void
+rdp_encode_rfx(RdpPeerContext *context, pixman_region32_t *damage, pixman_image_t *image)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -168,20 +246,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -202,52 +266,46 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
+}
 
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+static void
+rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	update->SurfaceBits(update->context, cmd);
+	rdp_encode_rfx(context, damage, image);
+	rdp_peer_send_surface_bits(peer, &damage->extents,
+				   peer->settings->RemoteFxCodecId,
+				   context->encode_stream);
 }
 
-
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_nsc(NSC_CONTEXT *nsc_context, wStream *stream,
+	       const pixman_box32_t *box, pixman_image_t *image)
 {
-	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	Stream_Clear(stream);
+	Stream_SetPosition(stream, 0);
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	ptr = pixman_image_get_data(image) + box->x1 +
+				box->y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	nsc_compose_message(nsc_context, stream, (BYTE *)ptr,
+			box->x2 - box->x1, box->y2 - box->y1,
+			pixman_image_get_stride(image));
+}
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+static void
+rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+	rdp_encode_nsc(context->nsc_context, context->encode_stream,
+		       &damage->extents, image);
+	rdp_peer_send_surface_bits(peer, &damage->extents,
+				   peer->settings->NSCodecId,
+				   context->encode_stream);
 }
 
 static void
@@ -322,6 +380,224 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	update->SurfaceFrameMarker(peer->context, marker);
 }
 
+static void
+rdp_peer_rfx_job_encode(struct rdp_encode_job *job, struct rdp_output *output)
+{
+	RdpPeerContext *context = container_of(job, RdpPeerContext, rfx_job);
+
+	rdp_encode_rfx(context, &output->frame.damage, output->shadow_surface);
+}
+
+static void
+rdp_nsc_band_encode(struct rdp_encode_job *job, struct rdp_output *output)
+{
+	struct rdp_nsc_band *band = container_of(job, struct rdp_nsc_band, job);
+
+	rdp_encode_nsc(band->nsc_context, band->stream, &band->box,
+		       output->shadow_surface);
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_output *output = data;
+	struct rdp_encode_job *job;
+
+	pthread_mutex_lock(&output->encoder.mutex);
+	for (;;) {
+		while (!output->encoder.quit &&
+		       wl_list_empty(&output->encoder.queue))
+			pthread_cond_wait(&output->encoder.work_cond,
+					  &output->encoder.mutex);
+		if (output->encoder.quit)
+			break;
+
+		job = container_of(output->encoder.queue.next,
+				   struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&output->encoder.mutex);
+
+		job->encode(job, output);
+
+		pthread_mutex_lock(&output->encoder.mutex);
+		if (--output->encoder.pending == 0) {
+			pthread_cond_signal(&output->encoder.done_cond);
+			eventfd_write(output->encoder.done_fd, 1);
+		}
+	}
+	pthread_mutex_unlock(&output->encoder.mutex);
+
+	return NULL;
+}
+
+/* Sends the encoded frame to the peers it was encoded for, the raw
+ * peers get it straight from the shadow surface. */
+static void
+rdp_output_send_frame(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	freerdp_peer *peer;
+	struct rdp_nsc_band *band;
+	int i;
+
+	output->frame.in_flight = false;
+
+	wl_list_for_each(item, &output->peers, link) {
+		peer = item->peer;
+		context = (RdpPeerContext *)peer->context;
+		if (!context->in_frame)
+			continue;
+
+		context->in_frame = false;
+		if (!(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		if (peer->settings->RemoteFxCodec) {
+			rdp_peer_send_surface_bits(peer,
+						   &output->frame.damage.extents,
+						   peer->settings->RemoteFxCodecId,
+						   context->encode_stream);
+		} else if (peer->settings->NSCodec) {
+			for (i = 0; i < output->frame.nsc_band_count; i++) {
+				band = &output->frame.nsc_bands[i];
+				rdp_peer_send_surface_bits(peer, &band->box,
+							   peer->settings->NSCodecId,
+							   band->stream);
+			}
+		} else {
+			rdp_peer_refresh_raw(&output->frame.damage,
+					     output->shadow_surface, peer);
+		}
+	}
+}
+
+/* Waits for the encoder threads and sends the frame in flight, if any.
+ * Must be called before anything writes to the shadow surface, or to
+ * the encoder state of a peer in the frame. */
+static void
+rdp_output_finish_encode(struct rdp_output *output)
+{
+	if (!output->frame.in_flight)
+		return;
+
+	pthread_mutex_lock(&output->encoder.mutex);
+	while (output->encoder.pending > 0)
+		pthread_cond_wait(&output->encoder.done_cond,
+				  &output->encoder.mutex);
+	pthread_mutex_unlock(&output->encoder.mutex);
+
+	rdp_output_send_frame(output);
+}
+
+static int
+rdp_encoder_done(int fd, uint32_t mask, void *data)
+{
+	struct rdp_output *output = data;
+	eventfd_t count;
+	bool done;
+
+	eventfd_read(fd, &count);
+
+	pthread_mutex_lock(&output->encoder.mutex);
+	done = output->encoder.pending == 0;
+	pthread_mutex_unlock(&output->encoder.mutex);
+
+	/* The frame may have been sent already by a finish. */
+	if (done && output->frame.in_flight)
+		rdp_output_send_frame(output);
+
+	return 1;
+}
+
+/* Splits the damage extents into as many bands as there are encoder
+ * threads, without making them too thin to be worth it. */
+static void
+rdp_output_split_nsc_bands(struct rdp_output *output)
+{
+	pixman_box32_t *extents = &output->frame.damage.extents;
+	int height = extents->y2 - extents->y1;
+	int count, i;
+
+	count = height / RDP_NSC_MIN_BAND_HEIGHT;
+	if (count > output->frame.nsc_band_max)
+		count = output->frame.nsc_band_max;
+	if (count < 1)
+		count = 1;
+
+	for (i = 0; i < count; i++) {
+		output->frame.nsc_bands[i].box.x1 = extents->x1;
+		output->frame.nsc_bands[i].box.x2 = extents->x2;
+		output->frame.nsc_bands[i].box.y1 =
+			extents->y1 + height * i / count;
+		output->frame.nsc_bands[i].box.y2 =
+			extents->y1 + height * (i + 1) / count;
+	}
+	output->frame.nsc_band_count = count;
+}
+
+/* Queues the damage of the shadow surface for encoding, once per
+ * RemoteFX peer and once for all the NSCodec peers. The frame is sent
+ * when the encoder threads are done with it, or right away without
+ * encoder threads. */
+static void
+rdp_output_encode(struct rdp_output *output, pixman_region32_t *damage)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	struct rdp_encode_job *job;
+	struct wl_list jobs;
+	bool nsc = false;
+	int i;
+
+	pixman_region32_copy(&output->frame.damage, damage);
+	wl_list_init(&jobs);
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_ACTIVATED) ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		context = (RdpPeerContext *)item->peer->context;
+		context->in_frame = true;
+		if (item->peer->settings->RemoteFxCodec)
+			wl_list_insert(jobs.prev, &context->rfx_job.link);
+		else if (item->peer->settings->NSCodec)
+			nsc = true;
+	}
+
+	if (nsc) {
+		rdp_output_split_nsc_bands(output);
+		for (i = 0; i < output->frame.nsc_band_count; i++)
+			wl_list_insert(jobs.prev,
+				       &output->frame.nsc_bands[i].job.link);
+	}
+
+	output->frame.in_flight = true;
+
+	if (output->encoder.count == 0 || wl_list_empty(&jobs)) {
+		wl_list_for_each(job, &jobs, link)
+			job->encode(job, output);
+		rdp_output_send_frame(output);
+		return;
+	}
+
+	pthread_mutex_lock(&output->encoder.mutex);
+	output->encoder.pending += wl_list_length(&jobs);
+	wl_list_insert_list(output->encoder.queue.prev, &jobs);
+	pthread_cond_broadcast(&output->encoder.work_cond);
+	pthread_mutex_unlock(&output->encoder.mutex);
+}
+
+/* Lets the frame in flight reach the peer before it is refreshed or
+ * its encoder state touched out of the frame. */
+static void
+rdp_peer_finish_encode(RdpPeerContext *context)
+{
+	if (context->in_frame)
+		rdp_output_finish_encode(context->rdpBackend->output);
+}
+
 static void
 rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 {
@@ -329,6 +605,8 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
 
+	rdp_peer_finish_encode(context);
+
 	if (settings->RemoteFxCodec)
 		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
 	else if (settings->NSCodec)
@@ -351,20 +629,15 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
-	struct rdp_peers_item *outputPeer;
+
+	/* The encoder threads may still be reading the shadow surface. */
+	rdp_output_finish_encode(output);
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
-		}
-	}
+	if (pixman_region32_not_empty(damage))
+		rdp_output_encode(output, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
@@ -373,11 +646,130 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 	return 0;
 }
 
+static int
+rdp_output_start_encoders(struct rdp_output *output, int threads)
+{
+	struct wl_event_loop *loop;
+	sigset_t mask, old_mask;
+	int i;
+
+	wl_list_init(&output->encoder.queue);
+	pthread_mutex_init(&output->encoder.mutex, NULL);
+	pthread_cond_init(&output->encoder.work_cond, NULL);
+	pthread_cond_init(&output->encoder.done_cond, NULL);
+	output->encoder.done_fd = -1;
+
+	if (threads < 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > RDP_MAX_ENCODER_THREADS)
+		threads = RDP_MAX_ENCODER_THREADS;
+	if (threads <= 0) {
+		weston_log("RDP encoding on the compositor thread\n");
+		return 0;
+	}
+
+	output->encoder.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (output->encoder.done_fd < 0)
+		return -1;
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	output->encoder.done_source =
+		wl_event_loop_add_fd(loop, output->encoder.done_fd,
+				     WL_EVENT_READABLE, rdp_encoder_done,
+				     output);
+	if (!output->encoder.done_source)
+		return -1;
+
+	output->encoder.threads = calloc(threads, sizeof *output->encoder.threads);
+	if (!output->encoder.threads)
+		return -1;
+
+	/* Leave signal handling to the compositor thread. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&output->encoder.threads[i], NULL,
+				   rdp_encoder_thread, output) != 0)
+			break;
+		output->encoder.count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	weston_log("RDP encoding with %d threads\n", output->encoder.count);
+
+	return 0;
+}
+
+static void
+rdp_output_stop_encoders(struct rdp_output *output)
+{
+	int i;
+
+	pthread_mutex_lock(&output->encoder.mutex);
+	output->encoder.quit = true;
+	pthread_cond_broadcast(&output->encoder.work_cond);
+	pthread_mutex_unlock(&output->encoder.mutex);
+
+	for (i = 0; i < output->encoder.count; i++)
+		pthread_join(output->encoder.threads[i], NULL);
+	free(output->encoder.threads);
+	output->encoder.threads = NULL;
+	output->encoder.count = 0;
+
+	if (output->encoder.done_source)
+		wl_event_source_remove(output->encoder.done_source);
+	if (output->encoder.done_fd >= 0)
+		close(output->encoder.done_fd);
+
+	pthread_mutex_destroy(&output->encoder.mutex);
+	pthread_cond_destroy(&output->encoder.work_cond);
+	pthread_cond_destroy(&output->encoder.done_cond);
+}
+
+static void
+rdp_output_init_nsc_bands(struct rdp_output *output)
+{
+	struct rdp_nsc_band *band;
+	int i;
+
+	output->frame.nsc_band_max =
+		output->encoder.count > 0 ? output->encoder.count : 1;
+
+	for (i = 0; i < output->frame.nsc_band_max; i++) {
+		band = &output->frame.nsc_bands[i];
+		band->job.encode = rdp_nsc_band_encode;
+		band->nsc_context = nsc_context_new();
+		nsc_context_set_pixel_format(band->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+		band->stream = Stream_New(NULL, 65536);
+	}
+}
+
+static void
+rdp_output_fini_nsc_bands(struct rdp_output *output)
+{
+	struct rdp_nsc_band *band;
+	int i;
+
+	for (i = 0; i < output->frame.nsc_band_max; i++) {
+		band = &output->frame.nsc_bands[i];
+		Stream_Free(band->stream, TRUE);
+		nsc_context_free(band->nsc_context);
+	}
+	output->frame.nsc_band_max = 0;
+}
+
 static void
 rdp_output_destroy(struct weston_output *output_base)
 {
 	struct rdp_output *output = (struct rdp_output *)output_base;
 
+	rdp_output_finish_encode(output);
+	rdp_output_stop_encoders(output);
+	rdp_output_fini_nsc_bands(output);
+	pixman_region32_fini(&output->frame.damage);
+
 	wl_event_source_remove(output->finish_frame_timer);
 	free(output);
 }
@@ -439,13 +831,16 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	if (local_mode == output->current_mode)
 		return 0;
 
+	rdp_output_finish_encode(rdpOutput);
+
 	output->current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
 
 	output->current_mode = local_mode;
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output,
+				      PIXMAN_RENDERER_OUTPUT_USE_SHADOW);
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -511,9 +906,17 @@ rdp_backend_create_output(struct rdp_backend *b, int width, int height)
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+					  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0)
 		goto out_shadow_surface;
 
+	if (rdp_output_start_encoders(output, b->encoder_threads) < 0) {
+		weston_log("Failed to start the RDP encoder threads.\n");
+		goto out_encoders;
+	}
+	rdp_output_init_nsc_bands(output);
+	pixman_region32_init(&output->frame.damage);
+
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
@@ -529,6 +932,9 @@ rdp_backend_create_output(struct rdp_backend *b, int width, int height)
 	weston_compositor_add_output(b->compositor, &output->base);
 	return 0;
 
+out_encoders:
+	rdp_output_stop_encoders(output);
+	pixman_renderer_output_destroy(&output->base);
 out_shadow_surface:
 	pixman_image_unref(output->shadow_surface);
 out_output:
@@ -622,6 +1028,7 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	nsc_context_set_pixel_format(context->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
 
 	context->encode_stream = Stream_New(NULL, 65536);
+	context->rfx_job.encode = rdp_peer_rfx_job_encode;
 }
 
 static void
@@ -632,6 +1039,7 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		return;
 
 	wl_list_remove(&context->item.link);
+	rdp_peer_finish_encode(context);
 	for (i = 0; i < MAX_FREERDP_FDS; i++) {
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
@@ -867,6 +1275,7 @@ xf_peer_activate(freerdp_peer* client)
 		}
 	}
 
+	rdp_peer_finish_encode(peerCtx);
 	rfx_context_reset(peerCtx->rfx_context);
 #ifdef HAVE_NSC_RESET
 	nsc_context_reset(peerCtx->nsc_context);
@@ -1217,6 +1626,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->base.restore = rdp_restore;
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
+	b->encoder_threads = config->encoder_threads;
 
 	/* activate TLS only if certificate/key are available */
 	if (config->server_cert && config->server_key) {
@@ -1300,6 +1710,7 @@ backend_init(struct weston_compositor *compositor, int *argc, char *argv[],
 		{ WESTON_OPTION_STRING,  "address", 0, &config.bind_address },
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
+		{ WESTON_OPTION_INTEGER, "encoder-threads", 0, &config.encoder_threads },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
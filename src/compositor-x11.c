@@ -922,7 +922,8 @@ x11_backend_create_output(struct x11_backend *b, int x, int y,
 			weston_log("Failed to initialize SHM for the X11 output\n");
 			return NULL;
 		}
-		if (pixman_renderer_output_create(&output->base) < 0) {
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0) {
 			weston_log("Failed to create pixman renderer for output\n");
 			x11_output_deinit_shm(b, output);
 			return NULL;
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -64,6 +65,11 @@
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+/* Adaptive repaint window, see output_repaint_window_msec() */
+#define REPAINT_MIN_SAMPLES 8
+#define REPAINT_PERCENTILE 95
+#define REPAINT_MARGIN_USEC 1000
+
 static void
 weston_output_transform_scale_init(struct weston_output *output,
 				   uint32_t transform, uint32_t scale);
@@ -1051,33 +1057,40 @@ weston_view_damage_below(struct weston_view *view)
  * outputs as appropriate.
  */
 static void
-weston_surface_update_output_mask(struct weston_surface *es, uint32_t mask)
+weston_surface_update_output_mask(struct weston_surface *es,
+				  const struct weston_output_mask *mask)
 {
-	uint32_t different = es->output_mask ^ mask;
-	uint32_t entered = mask & different;
-	uint32_t left = es->output_mask & different;
+	struct weston_output_mask different;
 	struct weston_output *output;
-	struct wl_resource *resource = NULL;
+	struct wl_resource *resource;
 	struct wl_client *client;
+	unsigned i;
+	int id;
+
+	for (i = 0; i < ARRAY_LENGTH(different.bits); i++)
+		different.bits[i] = es->output_mask.bits[i] ^ mask->bits[i];
 
-	es->output_mask = mask;
+	es->output_mask = *mask;
 	if (es->resource == NULL)
 		return;
-	if (different == 0)
+	if (weston_output_mask_is_empty(&different))
 		return;
 
 	client = wl_resource_get_client(es->resource);
 
-	wl_list_for_each(output, &es->compositor->output_list, link) {
-		if (1u << output->id & different)
-			resource =
-				wl_resource_find_for_client(&output->resource_list,
-							 client);
+	for (id = weston_output_mask_next(&different, 0); id >= 0;
+	     id = weston_output_mask_next(&different, id + 1)) {
+		output = es->compositor->outputs_by_id[id];
+		if (!output)
+			continue;
+
+		resource = wl_resource_find_for_client(&output->resource_list,
+						       client);
 		if (resource == NULL)
 			continue;
-		if (1u << output->id & entered)
+		if (weston_output_mask_contains(mask, id))
 			wl_surface_send_enter(es->resource, resource);
-		if (1u << output->id & left)
+		else
 			wl_surface_send_leave(es->resource, resource);
 	}
 }
@@ -1099,13 +1112,14 @@ weston_surface_assign_output(struct weston_surface *es)
 {
 	struct weston_output *new_output;
 	struct weston_view *view;
+	struct weston_output_mask mask;
 	pixman_region32_t region;
-	uint32_t max, area, mask;
+	uint32_t max, area;
 	pixman_box32_t *e;
 
 	new_output = NULL;
 	max = 0;
-	mask = 0;
+	weston_output_mask_clear(&mask);
 	pixman_region32_init(&region);
 	wl_list_for_each(view, &es->views, surface_link) {
 		if (!view->output)
@@ -1117,7 +1131,7 @@ weston_surface_assign_output(struct weston_surface *es)
 		e = pixman_region32_extents(&region);
 		area = (e->x2 - e->x1) * (e->y2 - e->y1);
 
-		mask |= view->output_mask;
+		weston_output_mask_union(&mask, &view->output_mask);
 
 		if (area >= max) {
 			new_output = view->output;
@@ -1126,8 +1140,12 @@ weston_surface_assign_output(struct weston_surface *es)
 	}
 	pixman_region32_fini(&region);
 
+	/* Sub-surfaces are only put in the view list while mapped. */
+	if (!es->output != !new_output)
+		weston_compositor_view_list_dirty(es->compositor);
+
 	es->output = new_output;
-	weston_surface_update_output_mask(es, mask);
+	weston_surface_update_output_mask(es, &mask);
 }
 
 /** Recalculate which output(s) the view is displayed on
@@ -1148,25 +1166,35 @@ weston_view_assign_output(struct weston_view *ev)
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct weston_output *output, *new_output;
 	pixman_region32_t region;
-	uint32_t max, area, mask;
-	pixman_box32_t *e;
+	uint32_t max, area;
+	pixman_box32_t *e, *bbox;
 
 	new_output = NULL;
 	max = 0;
-	mask = 0;
+	weston_output_mask_clear(&ev->output_mask);
+	bbox = pixman_region32_extents(&ev->transform.boundingbox);
 	pixman_region32_init(&region);
 	wl_list_for_each(output, &ec->output_list, link) {
 		if (output->destroying)
 			continue;
 
-		pixman_region32_intersect(&region, &ev->transform.boundingbox,
-					  &output->region);
+		/* Most outputs do not overlap the view at all. */
+		if (bbox->x2 <= output->x ||
+		    bbox->x1 >= output->x + output->width ||
+		    bbox->y2 <= output->y ||
+		    bbox->y1 >= output->y + output->height) {
+			area = 0;
+		} else {
+			pixman_region32_intersect(&region,
+						  &ev->transform.boundingbox,
+						  &output->region);
 
-		e = pixman_region32_extents(&region);
-		area = (e->x2 - e->x1) * (e->y2 - e->y1);
+			e = pixman_region32_extents(&region);
+			area = (e->x2 - e->x1) * (e->y2 - e->y1);
+		}
 
 		if (area > 0)
-			mask |= 1u << output->id;
+			weston_output_mask_add(&ev->output_mask, output->id);
 
 		if (area >= max) {
 			new_output = output;
@@ -1176,7 +1204,6 @@ weston_view_assign_output(struct weston_view *ev)
 	pixman_region32_fini(&region);
 
 	ev->output = new_output;
-	ev->output_mask = mask;
 
 	weston_surface_assign_output(ev->surface);
 }
@@ -1334,6 +1361,197 @@ weston_view_update_transform_enable(struct weston_view *view)
 	return 0;
 }
 
+/* The pick grid hashes cells of 2^PICK_GRID_CELL_SHIFT pixels into a fixed
+ * number of buckets. Hash collisions only add candidates, which are
+ * rejected by the bounding box test in weston_compositor_pick_view().
+ */
+#define PICK_GRID_CELL_SHIFT	7
+#define PICK_GRID_BUCKETS	1024	/* power of two */
+#define PICK_GRID_MAX_CELLS	64
+
+static struct wl_array *
+pick_grid_bucket(struct weston_compositor *compositor, int32_t cx, int32_t cy)
+{
+	uint32_t h = ((uint32_t) cx * 73856093u) ^ ((uint32_t) cy * 19349663u);
+
+	return &compositor->pick_grid[h & (PICK_GRID_BUCKETS - 1)];
+}
+
+/* Index of the first view in the array not above the given one. */
+static size_t
+pick_array_find(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **views = array->data;
+	size_t lo = 0, hi = array->size / sizeof *views;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (views[mid]->pick.z < view->pick.z)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool
+pick_array_insert(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **views;
+	size_t i, n;
+
+	i = pick_array_find(array, view);
+	n = array->size / sizeof *views;
+
+	/* Several cells of the view may share a bucket. */
+	if (i < n && ((struct weston_view **) array->data)[i] == view)
+		return true;
+
+	if (!wl_array_add(array, sizeof *views))
+		return false;
+
+	views = array->data;
+	memmove(&views[i + 1], &views[i], (n - i) * sizeof *views);
+	views[i] = view;
+
+	return true;
+}
+
+static void
+pick_array_remove(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **views = array->data;
+	size_t i, n;
+
+	i = pick_array_find(array, view);
+	n = array->size / sizeof *views;
+	if (i == n || views[i] != view)
+		return;
+
+	memmove(&views[i], &views[i + 1], (n - i - 1) * sizeof *views);
+	array->size -= sizeof *views;
+}
+
+static void
+pick_grid_view_cells(struct weston_view *view,
+		     int32_t *cx1, int32_t *cy1, int32_t *cx2, int32_t *cy2)
+{
+	pixman_box32_t *box;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	if (box->x1 >= box->x2 || box->y1 >= box->y2) {
+		*cx1 = *cy1 = 0;
+		*cx2 = *cy2 = -1;
+		return;
+	}
+
+	*cx1 = box->x1 >> PICK_GRID_CELL_SHIFT;
+	*cy1 = box->y1 >> PICK_GRID_CELL_SHIFT;
+	*cx2 = (box->x2 - 1) >> PICK_GRID_CELL_SHIFT;
+	*cy2 = (box->y2 - 1) >> PICK_GRID_CELL_SHIFT;
+}
+
+static void
+pick_grid_link_view(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	int64_t cells;
+	int32_t cx, cy;
+	bool ok = true;
+
+	pick_grid_view_cells(view, &view->pick.cx1, &view->pick.cy1,
+			     &view->pick.cx2, &view->pick.cy2);
+	view->pick.indexed = true;
+
+	cells = (int64_t) (view->pick.cx2 - view->pick.cx1 + 1) *
+		(view->pick.cy2 - view->pick.cy1 + 1);
+	view->pick.big = cells > PICK_GRID_MAX_CELLS;
+
+	if (view->pick.big) {
+		ok = pick_array_insert(&compositor->pick_big, view);
+	} else {
+		for (cy = view->pick.cy1; cy <= view->pick.cy2; cy++)
+			for (cx = view->pick.cx1; cx <= view->pick.cx2; cx++)
+				ok &= pick_array_insert(
+					pick_grid_bucket(compositor, cx, cy),
+					view);
+	}
+
+	if (!ok)
+		compositor->pick_grid_valid = false;
+}
+
+static void
+pick_grid_unlink_view(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	int32_t cx, cy;
+
+	if (!view->pick.indexed)
+		return;
+
+	view->pick.indexed = false;
+
+	if (view->pick.big) {
+		pick_array_remove(&compositor->pick_big, view);
+		return;
+	}
+
+	for (cy = view->pick.cy1; cy <= view->pick.cy2; cy++)
+		for (cx = view->pick.cx1; cx <= view->pick.cx2; cx++)
+			pick_array_remove(pick_grid_bucket(compositor, cx, cy),
+					  view);
+}
+
+/* Follow a bounding box change of a view in the view list. */
+static void
+pick_grid_update_view(struct weston_view *view)
+{
+	int32_t cx1, cy1, cx2, cy2;
+
+	if (!view->pick.indexed)
+		return;
+
+	pick_grid_view_cells(view, &cx1, &cy1, &cx2, &cy2);
+	if (cx1 == view->pick.cx1 && cy1 == view->pick.cy1 &&
+	    cx2 == view->pick.cx2 && cy2 == view->pick.cy2)
+		return;
+
+	pick_grid_unlink_view(view);
+	pick_grid_link_view(view);
+}
+
+/* Drop all views; called before the view list is rebuilt. */
+static void
+pick_grid_clear(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	int i;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		view->pick.indexed = false;
+
+	for (i = 0; i < PICK_GRID_BUCKETS; i++)
+		compositor->pick_grid[i].size = 0;
+	compositor->pick_big.size = 0;
+}
+
+static void
+pick_grid_fill(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	uint32_t z = 0;
+
+	compositor->pick_grid_valid = true;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->pick.z = z++;
+		pick_grid_link_view(view);
+	}
+}
+
 static struct weston_layer *
 get_view_layer(struct weston_view *view)
 {
@@ -1396,6 +1614,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_damage_below(view);
 
+	pick_grid_update_view(view);
+
 	weston_view_assign_output(view);
 
 	wl_signal_emit(&view->surface->compositor->transform_signal,
@@ -1418,6 +1638,7 @@ weston_view_geometry_dirty(struct weston_view *view)
 		return;
 
 	view->transform.dirty = 1;
+	view->transform.serial++;
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
@@ -1500,11 +1721,17 @@ weston_view_from_global(struct weston_view *view,
 WL_EXPORT void
 weston_surface_schedule_repaint(struct weston_surface *surface)
 {
-	struct weston_output *output;
+	struct weston_compositor *compositor = surface->compositor;
+	const struct weston_output_mask *mask = &surface->output_mask;
+	int id;
+
+	compositor->damage_accumulated = false;
 
-	wl_list_for_each(output, &surface->compositor->output_list, link)
-		if (surface->output_mask & (1u << output->id))
-			weston_output_schedule_repaint(output);
+	for (id = weston_output_mask_next(mask, 0); id >= 0;
+	     id = weston_output_mask_next(mask, id + 1))
+		if (compositor->outputs_by_id[id])
+			weston_output_schedule_repaint(
+				compositor->outputs_by_id[id]);
 }
 
 /**
@@ -1516,11 +1743,17 @@ weston_surface_schedule_repaint(struct weston_surface *surface)
 WL_EXPORT void
 weston_view_schedule_repaint(struct weston_view *view)
 {
-	struct weston_output *output;
+	struct weston_compositor *compositor = view->surface->compositor;
+	const struct weston_output_mask *mask = &view->output_mask;
+	int id;
 
-	wl_list_for_each(output, &view->surface->compositor->output_list, link)
-		if (view->output_mask & (1u << output->id))
-			weston_output_schedule_repaint(output);
+	compositor->damage_accumulated = false;
+
+	for (id = weston_output_mask_next(mask, 0); id >= 0;
+	     id = weston_output_mask_next(mask, id + 1))
+		if (compositor->outputs_by_id[id])
+			weston_output_schedule_repaint(
+				compositor->outputs_by_id[id]);
 }
 
 /**
@@ -1543,6 +1776,21 @@ weston_surface_damage(struct weston_surface *surface)
 	weston_surface_schedule_repaint(surface);
 }
 
+/** Record a texture upload of the surface contents
+ *
+ * \param surface The surface whose buffer contents were uploaded.
+ *
+ * Renderers call this from their flush_damage() hook each time they
+ * actually copy client pixels, so uploads deferred or skipped by the
+ * renderer are not counted. The uploads done while accumulating the damage
+ * of an output repaint are added to its \c uploads repaint statistic.
+ */
+WL_EXPORT void
+weston_surface_count_upload(struct weston_surface *surface)
+{
+	surface->compositor->texture_uploads++;
+}
+
 WL_EXPORT void
 weston_view_set_position(struct weston_view *view, float x, float y)
 {
@@ -1686,6 +1934,21 @@ weston_view_is_mapped(struct weston_view *view)
 		return false;
 }
 
+/** Check whether a view is completely hidden on an output
+ *
+ * \param view The view.
+ * \param output The output.
+ * \return True if opaque views above cover all of the view on output.
+ *
+ * Only valid during an output repaint, after the damage accumulation.
+ */
+WL_EXPORT bool
+weston_view_is_occluded(struct weston_view *view,
+			struct weston_output *output)
+{
+	return weston_output_mask_contains(&view->occluded_mask, output->id);
+}
+
 WL_EXPORT bool
 weston_surface_is_mapped(struct weston_surface *surface)
 {
@@ -1695,6 +1958,34 @@ weston_surface_is_mapped(struct weston_surface *surface)
 		return false;
 }
 
+/** Check whether nothing of a surface is visible
+ *
+ * \param surface The surface.
+ * \return True if the surface is mapped and all of its views are
+ * occluded on every output they are on.
+ *
+ * See weston_view_is_occluded().
+ */
+WL_EXPORT bool
+weston_surface_is_occluded(struct weston_surface *surface)
+{
+	struct weston_view *view;
+	bool mapped = false;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!view->output)
+			continue;
+
+		if (!weston_output_mask_is_subset(&view->output_mask,
+						  &view->occluded_mask))
+			return false;
+
+		mapped = true;
+	}
+
+	return mapped;
+}
+
 static void
 surface_set_size(struct weston_surface *surface, int32_t width, int32_t height)
 {
@@ -1790,40 +2081,74 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static bool
+view_accepts_input_at(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
+	struct weston_view *view, **cell, **big;
+	struct wl_array *bucket;
+	size_t i = 0, j = 0, ncell, nbig;
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (!compositor->pick_grid_valid) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+		goto miss;
+	}
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	bucket = pick_grid_bucket(compositor,
+				  wl_fixed_to_int(x) >> PICK_GRID_CELL_SHIFT,
+				  wl_fixed_to_int(y) >> PICK_GRID_CELL_SHIFT);
+	cell = bucket->data;
+	ncell = bucket->size / sizeof *cell;
+	big = compositor->pick_big.data;
+	nbig = compositor->pick_big.size / sizeof *big;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	/* Both arrays are in stacking order, merge them top to bottom. */
+	while (i < ncell || j < nbig) {
+		if (j == nbig || (i < ncell && cell[i]->pick.z < big[j]->pick.z))
+			view = cell[i++];
+		else
+			view = big[j++];
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+		if (view_accepts_input_at(view, x, y, vx, vy))
+			return view;
 	}
 
+miss:
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
@@ -1855,7 +2180,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
-	view->output_mask = 0;
+	pick_grid_unlink_view(view);
+	weston_output_mask_clear(&view->output_mask);
 	weston_surface_assign_output(view->surface);
 
 	if (weston_surface_is_mapped(view->surface))
@@ -1884,6 +2210,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -1909,7 +2236,9 @@ weston_view_destroy(struct weston_view *view)
 	}
 
 	wl_list_remove(&view->link);
+	pick_grid_unlink_view(view);
 	weston_layer_entry_remove(&view->layer_link);
+	view->surface->compositor->damage_accumulated = false;
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2124,6 +2453,47 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Record on which outputs the opaque regions of the views and planes
+ * above cover the view completely. Must follow view_accumulate_damage(),
+ * which leaves the opaque region of the views above in view->clip. */
+static void
+view_update_occlusion(struct weston_view *view,
+		      pixman_region32_t *plane_clip)
+{
+	struct weston_compositor *ec = view->surface->compositor;
+	struct weston_output *output;
+	pixman_region32_t visible;
+	bool hidden;
+	int id;
+
+	weston_output_mask_clear(&view->occluded_mask);
+
+	if (!pixman_region32_not_empty(&view->clip) &&
+	    !pixman_region32_not_empty(plane_clip))
+		return;
+
+	pixman_region32_init(&visible);
+	pixman_region32_subtract(&visible, &view->transform.boundingbox,
+				 &view->clip);
+	pixman_region32_subtract(&visible, &visible, plane_clip);
+	hidden = !pixman_region32_not_empty(&visible);
+
+	for (id = weston_output_mask_next(&view->output_mask, 0); id >= 0;
+	     id = weston_output_mask_next(&view->output_mask, id + 1)) {
+		output = ec->outputs_by_id[id];
+		if (!output)
+			continue;
+
+		if (hidden ||
+		    pixman_region32_contains_rectangle(&visible,
+				pixman_region32_extents(&output->region)) ==
+		    PIXMAN_REGION_OUT)
+			weston_output_mask_add(&view->occluded_mask, id);
+	}
+
+	pixman_region32_fini(&visible);
+}
+
 static void
 compositor_accumulate_damage(struct weston_compositor *ec)
 {
@@ -2143,6 +2513,7 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 				continue;
 
 			view_accumulate_damage(ev, &opaque);
+			view_update_occlusion(ev, &clip);
 		}
 
 		pixman_region32_union(&clip, &clip, &opaque);
@@ -2165,11 +2536,14 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 		 * by now. If renderer needs the buffer, it has its own
 		 * reference set. If the backend wants to keep the buffer
 		 * around for migrating the surface into a non-primary plane
-		 * later, keep_buffer is true. Otherwise, drop the core
-		 * reference now, and allow early buffer release. This enables
-		 * clients to use single-buffering.
+		 * later, keep_buffer is true. The renderer may also defer
+		 * the upload of an occluded surface, which needs another
+		 * flush once the surface is exposed. Otherwise, drop the
+		 * core reference now, and allow early buffer release. This
+		 * enables clients to use single-buffering.
 		 */
-		if (!ev->surface->keep_buffer)
+		if (!ev->surface->keep_buffer &&
+		    !weston_surface_is_occluded(ev->surface))
 			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
 	}
 }
@@ -2277,15 +2651,19 @@ view_list_add(struct weston_compositor *compositor,
 }
 
 static void
-weston_compositor_build_view_list(struct weston_compositor *compositor)
+view_list_rebuild(struct weston_compositor *compositor)
 {
-	struct weston_view *view;
+	struct weston_view *view, *next;
 	struct weston_layer *layer;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
 
+	/* Views that do not get re-added must not keep links into the
+	 * new list. */
+	wl_list_for_each_safe(view, next, &compositor->view_list, link)
+		wl_list_init(&view->link);
 	wl_list_init(&compositor->view_list);
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
@@ -2298,6 +2676,184 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 			surface_free_unused_subsurface_views(view->surface);
 }
 
+/* Shells are free to reorder compositor->layer_list directly, so the
+ * layer order used for the last rebuild is remembered and compared.
+ */
+static bool
+view_list_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **layers;
+	size_t count, i = 0;
+
+	layers = compositor->view_list_layers.data;
+	count = compositor->view_list_layers.size / sizeof *layers;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i == count || layers[i] != layer)
+			return true;
+		i++;
+	}
+
+	return i != count;
+}
+
+static void
+view_list_layers_record(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **l;
+
+	compositor->view_list_layers.size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		l = wl_array_add(&compositor->view_list_layers, sizeof *l);
+		if (!l) {
+			/* A short array never matches; rebuild next time. */
+			return;
+		}
+		*l = layer;
+	}
+}
+
+static bool
+view_list_verify_next(struct weston_compositor *compositor,
+		      struct wl_list **pos, struct weston_view *view)
+{
+	if (*pos == &compositor->view_list ||
+	    container_of(*pos, struct weston_view, link) != view)
+		return false;
+
+	*pos = (*pos)->next;
+	return true;
+}
+
+static bool
+view_list_verify_subsurface_view(struct weston_compositor *compositor,
+				 struct wl_list **pos,
+				 struct weston_subsurface *sub,
+				 struct weston_view *parent)
+{
+	struct weston_subsurface *child;
+	struct weston_view *view = NULL, *iv;
+
+	if (!weston_surface_is_mapped(sub->surface))
+		return true;
+
+	wl_list_for_each(iv, &sub->surface->views, surface_link) {
+		if (iv->geometry.parent == parent) {
+			view = iv;
+			break;
+		}
+	}
+
+	/* A rebuild would create the missing view. */
+	if (!view)
+		return false;
+
+	if (wl_list_empty(&sub->surface->subsurface_list))
+		return view_list_verify_next(compositor, pos, view);
+
+	wl_list_for_each(child, &sub->surface->subsurface_list, parent_link) {
+		if (child->surface == sub->surface) {
+			if (!view_list_verify_next(compositor, pos, view))
+				return false;
+		} else if (!view_list_verify_subsurface_view(compositor, pos,
+							     child, view)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Check the view list against what view_list_rebuild() would produce
+ *
+ * Walks the layers and sub-surface trees in the same order as
+ * view_list_add() without modifying anything, and compares the result
+ * with compositor->view_list.
+ */
+static bool
+view_list_verify(struct weston_compositor *compositor)
+{
+	struct wl_list *pos = compositor->view_list.next;
+	struct weston_subsurface *sub;
+	struct weston_layer *layer;
+	struct weston_view *view;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		wl_list_for_each(view, &layer->view_list.link,
+				 layer_link.link) {
+			if (wl_list_empty(&view->surface->subsurface_list)) {
+				if (!view_list_verify_next(compositor,
+							   &pos, view))
+					return false;
+				continue;
+			}
+
+			wl_list_for_each(sub, &view->surface->subsurface_list,
+					 parent_link) {
+				if (sub->surface == view->surface) {
+					if (!view_list_verify_next(compositor,
+								   &pos, view))
+						return false;
+				} else if (!view_list_verify_subsurface_view(
+						compositor, &pos, sub, view)) {
+					return false;
+				}
+			}
+		}
+	}
+
+	return pos == &compositor->view_list;
+}
+
+/** Mark the compositor's view list as stale
+ *
+ * \param compositor The compositor.
+ *
+ * The view list is rebuilt from the layers on the next repaint instead of
+ * being reused. Layer entry insertion and removal, sub-surface stacking
+ * and sub-surface mapping changes call this already. Code that edits a
+ * layer's view list without weston_layer_entry_insert() or
+ * weston_layer_entry_remove() must call it.
+ */
+WL_EXPORT void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+}
+
+static void
+weston_compositor_build_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (!compositor->view_list_needs_rebuild &&
+	    !view_list_layers_changed(compositor)) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+
+		/* A transform update may have mapped or unmapped a
+		 * sub-surface, in which case fall through and rebuild. */
+		if (!compositor->view_list_needs_rebuild) {
+			if (!compositor->verify_view_list ||
+			    view_list_verify(compositor))
+				return;
+
+			weston_log("view list: incremental view list differs "
+				   "from a full rebuild\n");
+		}
+	}
+
+	pick_grid_clear(compositor);
+	view_list_rebuild(compositor);
+	view_list_layers_record(compositor);
+	pick_grid_fill(compositor);
+	compositor->damage_accumulated = false;
+
+	/* Unmapping unused sub-surface views during the rebuild flags
+	 * the list dirty again, but it is up to date now. */
+	compositor->view_list_needs_rebuild = false;
+}
+
 static void
 weston_output_take_feedback_list(struct weston_output *output,
 				 struct weston_surface *surface)
@@ -2312,7 +2868,7 @@ weston_output_take_feedback_list(struct weston_output *output,
 	/* All views must have the flag for the flag to survive. */
 	wl_list_for_each(view, &surface->views, surface_link) {
 		/* ignore views that are not on this output at all */
-		if (view->output_mask & (1u << output->id))
+		if (weston_output_mask_contains(&view->output_mask, output->id))
 			flags &= view->psf_flags;
 	}
 
@@ -2323,6 +2879,255 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+static bool
+accumulated_damage_is_current(struct weston_compositor *ec,
+			      struct weston_output *output)
+{
+	struct timespec now, gone;
+
+	if (!ec->share_damage_accumulation || !ec->damage_accumulated)
+		return false;
+
+	if (output->current_mode->refresh == 0)
+		return false;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+	timespec_sub(&gone, &now, &ec->damage_accumulated_time);
+
+	return timespec_to_nsec(&gone) <
+	       millihz_to_nsec(output->current_mode->refresh);
+}
+
+static void
+output_repaint_time_add(struct weston_output *output, uint32_t usec)
+{
+	output->repaint_time.usec[output->repaint_time.next] = usec;
+	output->repaint_time.next =
+		(output->repaint_time.next + 1) % WESTON_REPAINT_SAMPLES;
+	if (output->repaint_time.count < WESTON_REPAINT_SAMPLES)
+		output->repaint_time.count++;
+}
+
+/** How long before the next vblank the repaint of an output must start
+ *
+ * \param output The output.
+ * \return The repaint window in milliseconds.
+ *
+ * This is the configured repaint-window, unless adaptive_repaint_window
+ * is set and enough repaints of the output have been timed. In that case
+ * it is the REPAINT_PERCENTILE percentile of the recent repaint
+ * durations plus REPAINT_MARGIN_USEC, so that light scenes get a shorter
+ * latency and heavy scenes still make it before the vblank.
+ */
+static int
+output_repaint_window_msec(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t sorted[WESTON_REPAINT_SAMPLES];
+	unsigned n = output->repaint_time.count;
+	unsigned i, j, k;
+	uint32_t v;
+
+	if (!compositor->adaptive_repaint_window || n < REPAINT_MIN_SAMPLES)
+		return compositor->repaint_msec;
+
+	for (i = 0; i < n; i++) {
+		v = output->repaint_time.usec[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+
+	k = (n * REPAINT_PERCENTILE + 99) / 100 - 1;
+
+	return MIN((sorted[k] + REPAINT_MARGIN_USEC + 999) / 1000, 1000);
+}
+
+static void
+repaint_histogram_add(struct weston_repaint_histogram *hist, uint64_t value)
+{
+	int i = 0;
+
+	if (value > 0)
+		i = MIN(64 - __builtin_clzll(value),
+			WESTON_REPAINT_STAT_BUCKETS - 1);
+
+	hist->bucket[i]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* The upper bound of the bucket holding the given percentile, which
+ * overestimates the percentile by less than a factor of two. */
+static uint64_t
+repaint_histogram_percentile(const struct weston_repaint_histogram *hist,
+			     unsigned percentile)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = ((uint64_t) hist->count * percentile + 99) / 100;
+	for (i = 0; i < WESTON_REPAINT_STAT_BUCKETS - 1; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == 0)
+		return 0;
+
+	return MIN((UINT64_C(1) << i) - 1, hist->max);
+}
+
+static void
+output_repaint_stats_add(struct weston_output *output, uint64_t usec,
+			 uint64_t damage, uint32_t views)
+{
+	struct weston_repaint_histogram *hist = output->repaint_stats.hist;
+
+	repaint_histogram_add(&hist[WESTON_REPAINT_STAT_TIME_US], usec);
+	repaint_histogram_add(&hist[WESTON_REPAINT_STAT_DAMAGE], damage);
+	repaint_histogram_add(&hist[WESTON_REPAINT_STAT_VIEWS], views);
+	repaint_histogram_add(&hist[WESTON_REPAINT_STAT_UPLOADS],
+			      output->repaint_stats.uploads);
+	output->repaint_stats.uploads = 0;
+}
+
+/* Every refresh period between two presented frames beyond the first is
+ * a missed vblank. The first frame of a repaint loop is not compared to
+ * the last one of the previous loop, the output was idle in between. */
+static void
+output_repaint_stats_present(struct weston_output *output,
+			     const struct timespec *stamp,
+			     int32_t refresh_nsec, uint32_t presented_flags)
+{
+	struct weston_repaint_histogram *hist = output->repaint_stats.hist;
+	struct timespec gone;
+	int64_t missed = 0;
+
+	if (presented_flags == PRESENTATION_FEEDBACK_INVALID) {
+		output->repaint_stats.last_stamp_valid = false;
+		return;
+	}
+
+	if (output->repaint_stats.last_stamp_valid && refresh_nsec > 0) {
+		timespec_sub(&gone, stamp, &output->repaint_stats.last_stamp);
+		missed = (timespec_to_nsec(&gone) + refresh_nsec / 2) /
+			 refresh_nsec - 1;
+		if (missed < 0)
+			missed = 0;
+	}
+
+	output->repaint_stats.frames++;
+	output->repaint_stats.missed_vblanks += missed;
+	repaint_histogram_add(&hist[WESTON_REPAINT_STAT_MISSED_VBLANKS],
+			      missed);
+
+	output->repaint_stats.last_stamp = *stamp;
+	output->repaint_stats.last_stamp_valid = true;
+}
+
+static const char * const repaint_stat_names[] = {
+	[WESTON_REPAINT_STAT_TIME_US] = "repaint-us",
+	[WESTON_REPAINT_STAT_DAMAGE] = "damage-pixels",
+	[WESTON_REPAINT_STAT_VIEWS] = "views",
+	[WESTON_REPAINT_STAT_UPLOADS] = "uploads",
+	[WESTON_REPAINT_STAT_MISSED_VBLANKS] = "missed-vblanks",
+};
+
+/** Write the repaint statistics of an output
+ *
+ * \param output The output.
+ * \param fp The stream to write to.
+ *
+ * Writes a line with the frame and missed vblank totals of the output,
+ * followed by one line per statistic with the count, sum, maximum and
+ * approximate 50th, 90th and 99th percentiles of the samples in the
+ * current window and the histogram buckets up to the last non-empty one.
+ * The format is described in weston.ini(5) under repaint-stats.
+ */
+WL_EXPORT void
+weston_output_write_repaint_stats(struct weston_output *output, FILE *fp)
+{
+	const struct weston_repaint_histogram *hist;
+	const char *name = output->name ? output->name : "unknown";
+	int i, n;
+	int k;
+
+	fprintf(fp, "output %s frames %" PRIu64 " missed-vblanks %" PRIu64 "\n",
+		name, output->repaint_stats.frames,
+		output->repaint_stats.missed_vblanks);
+
+	for (k = 0; k < WESTON_REPAINT_STAT_COUNT; k++) {
+		hist = &output->repaint_stats.hist[k];
+
+		fprintf(fp, "%s %s count %u sum %" PRIu64 " max %" PRIu64
+			" p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64
+			" buckets",
+			name, repaint_stat_names[k], hist->count,
+			hist->sum, hist->max,
+			repaint_histogram_percentile(hist, 50),
+			repaint_histogram_percentile(hist, 90),
+			repaint_histogram_percentile(hist, 99));
+
+		for (n = WESTON_REPAINT_STAT_BUCKETS; n > 0; n--)
+			if (hist->bucket[n - 1])
+				break;
+		for (i = 0; i < n; i++)
+			fprintf(fp, " %u", hist->bucket[i]);
+		fputc('\n', fp);
+	}
+}
+
+/* Hold back the frame callbacks of an occluded surface until
+ * occluded_frame_interval has passed since the last ones. */
+static bool
+frame_callbacks_throttled(struct weston_surface *surface,
+			  struct weston_output *output)
+{
+	struct weston_compositor *ec = surface->compositor;
+	uint32_t elapsed, deadline;
+
+	if (ec->occluded_frame_interval == 0 ||
+	    wl_list_empty(&surface->frame_callback_list))
+		return false;
+
+	elapsed = output->frame_time - surface->frame_callback_time;
+	if (elapsed >= ec->occluded_frame_interval ||
+	    !weston_surface_is_occluded(surface))
+		return false;
+
+	/* Repaint again when the interval is over, in case nothing
+	 * else does, so the callbacks still go out. The timer is shared
+	 * by all surfaces, so it only ever moves to an earlier deadline. */
+	deadline = surface->frame_callback_time + ec->occluded_frame_interval;
+	if (!ec->occluded_frame_timer_armed ||
+	    (int32_t) (deadline - ec->occluded_frame_deadline) < 0) {
+		wl_event_source_timer_update(ec->occluded_frame_timer,
+					     deadline - output->frame_time);
+		ec->occluded_frame_deadline = deadline;
+		ec->occluded_frame_timer_armed = true;
+	}
+
+	return true;
+}
+
+static int
+occluded_frame_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	ec->occluded_frame_timer_armed = false;
+	weston_compositor_schedule_repaint(ec);
+
+	return 0;
+}
+
 static int
 weston_output_repaint(struct weston_output *output)
 {
@@ -2332,11 +3137,20 @@ weston_output_repaint(struct weston_output *output)
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	struct timespec begin, end;
+	pixman_box32_t *rects;
+	uint64_t damage = 0;
+	uint32_t views = 0;
+	uint32_t uploads;
+	int64_t usec;
+	int i, n;
 	int r;
 
 	if (output->destroying)
 		return 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
 	/* Rebuild the surface list and update surface transforms up front. */
@@ -2351,28 +3165,65 @@ weston_output_repaint(struct weston_output *output)
 		}
 	}
 
+	if (accumulated_damage_is_current(ec, output)) {
+		TL_POINT("core_accumulate_damage_shared", TLP_OUTPUT(output),
+			 TLP_END);
+	} else {
+		TL_POINT("core_accumulate_damage", TLP_OUTPUT(output), TLP_END);
+		uploads = ec->texture_uploads;
+		compositor_accumulate_damage(ec);
+		output->repaint_stats.uploads += ec->texture_uploads - uploads;
+
+		if (ec->share_damage_accumulation) {
+			weston_compositor_read_presentation_clock(ec,
+				&ec->damage_accumulated_time);
+			ec->damage_accumulated = true;
+		}
+	}
+
+	output->occluded_views = 0;
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->plane != &ec->primary_plane)
+			continue;
+
+		if (weston_view_is_occluded(ev, output))
+			output->occluded_views++;
+		else if (weston_output_mask_contains(&ev->output_mask,
+						     output->id))
+			views++;
+	}
+
+	/* Taken after the damage accumulation, which updates the
+	 * occlusion the frame callback throttling depends on. */
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
 		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+			if (!frame_callbacks_throttled(ev->surface, output)) {
+				wl_list_insert_list(&frame_callback_list,
+					&ev->surface->frame_callback_list);
+				wl_list_init(&ev->surface->frame_callback_list);
+				ev->surface->frame_callback_time =
+					output->frame_time;
+			}
 
 			weston_output_take_feedback_list(output, ev->surface);
 		}
 	}
 
-	compositor_accumulate_damage(ec);
-
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
 				  &ec->primary_plane.damage, &output->region);
 	pixman_region32_subtract(&output_damage,
 				 &output_damage, &ec->primary_plane.clip);
 
+	rects = pixman_region32_rectangles(&output_damage, &n);
+	for (i = 0; i < n; i++)
+		damage += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			  (rects[i].y2 - rects[i].y1);
+
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
@@ -2380,6 +3231,22 @@ weston_output_repaint(struct weston_output *output)
 
 	pixman_region32_fini(&output_damage);
 
+	if (r == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timespec_sub(&end, &end, &begin);
+		usec = timespec_to_nsec(&end) / 1000;
+		output_repaint_time_add(output, MIN(usec, UINT32_MAX));
+		output_repaint_stats_add(output, usec, damage, views);
+
+		/* A positive error means the repaint overran its window. */
+		TL_POINT("core_repaint_time", TLP_OUTPUT(output),
+			 TLP_INT("time_us", usec),
+			 TLP_INT("error_us",
+				 usec - output->repaint_time.window_usec),
+			 TLP_INT("occluded_views", output->occluded_views),
+			 TLP_END);
+	}
+
 	output->repaint_needed = 0;
 
 	weston_compositor_repick(ec);
@@ -2418,6 +3285,7 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 	int fd;
 
 	output->repaint_scheduled = 0;
+	output->repaint_stats.last_stamp_valid = false;
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 
 	if (compositor->input_loop_source)
@@ -2456,23 +3324,39 @@ weston_output_finish_frame(struct weston_output *output,
 	int32_t refresh_nsec;
 	struct timespec now;
 	struct timespec gone;
+	int window_msec;
 	int msec;
 
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	/* A refresh rate of zero means the output has no fixed refresh,
+	 * see the refresh argument of presentation feedback. */
+	if (output->current_mode->refresh)
+		refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	else
+		refresh_nsec = 0;
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
 						  presented_flags);
+	output_repaint_stats_present(output, stamp, refresh_nsec,
+				     presented_flags);
 
 	output->frame_time = stamp->tv_sec * 1000 + stamp->tv_nsec / 1000000;
 
+	/* Without a refresh to align to, repaint again right away. */
+	if (refresh_nsec == 0) {
+		output_repaint_timer_handler(output);
+		return;
+	}
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 	timespec_sub(&gone, &now, stamp);
 	msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
-	msec -= compositor->repaint_msec;
+	window_msec = output_repaint_window_msec(output);
+	output->repaint_time.window_usec = window_msec * 1000;
+	msec -= window_msec;
 
 	if (msec < -1000 || msec > 1000) {
 		static bool warned;
@@ -2492,6 +3376,10 @@ weston_output_finish_frame(struct weston_output *output,
 	if (presented_flags == PRESENTATION_FEEDBACK_INVALID && msec < 0)
 		msec += refresh_nsec / 1000000;
 
+	TL_POINT("core_repaint_window", TLP_OUTPUT(output),
+		 TLP_INT("window_ms", window_msec),
+		 TLP_INT("delay_ms", msec), TLP_END);
+
 	if (msec < 1)
 		output_repaint_timer_handler(output);
 	else
@@ -2506,12 +3394,22 @@ idle_repaint(void *data)
 	output->start_repaint_loop(output);
 }
 
+static void
+layer_entry_view_list_dirty(struct weston_layer_entry *entry)
+{
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	weston_compositor_view_list_dirty(view->surface->compositor);
+}
+
 WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	layer_entry_view_list_dirty(entry);
 }
 
 WL_EXPORT void
@@ -2520,6 +3418,7 @@ weston_layer_entry_remove(struct weston_layer_entry *entry)
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
+	layer_entry_view_list_dirty(entry);
 }
 
 WL_EXPORT void
@@ -2725,11 +3624,32 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static bool
+subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur = surface->subsurface_list.next;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (cur != &sub->parent_link)
+			return true;
+		cur = cur->next;
+	}
+
+	return cur != &surface->subsurface_list;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!subsurface_order_changed(surface))
+		return;
+
+	weston_compositor_view_list_dirty(surface->compositor);
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
@@ -3289,6 +4209,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 	 * will not be drawn either.
 	 */
 	if (!weston_surface_is_mapped(surface)) {
+		struct weston_output_mask mask;
 		struct weston_output *output;
 
 		/* Cannot call weston_view_update_transform(),
@@ -3307,7 +4228,10 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 				      struct weston_output, link);
 
 		surface->output = output;
-		weston_surface_update_output_mask(surface, 1u << output->id);
+		weston_output_mask_clear(&mask);
+		weston_output_mask_add(&mask, output->id);
+		weston_surface_update_output_mask(surface, &mask);
+		weston_compositor_view_list_dirty(compositor);
 	}
 }
 
@@ -3466,6 +4390,47 @@ weston_surface_copy_content(struct weston_surface *surface,
 					 src_x, src_y, width, height);
 }
 
+/** Get a scaled copy of the whole surface content
+ *
+ * \param surface The surface to copy.
+ * \param target Pointer to the target memory buffer.
+ * \param size Size of the target buffer in bytes.
+ * \param width Width of the copy in pixels.
+ * \param height Height of the copy in pixels.
+ * \return 0 for success, -1 for failure.
+ *
+ * Like weston_surface_copy_content(), but the whole content is scaled to
+ * width by height pixels by the renderer, which only reads back the
+ * scaled image. The target memory is laid out the same way, with a
+ * stride of exactly width * 4.
+ */
+WL_EXPORT int
+weston_surface_copy_content_scaled(struct weston_surface *surface,
+				   void *target, size_t size,
+				   int width, int height)
+{
+	struct weston_renderer *rer = surface->compositor->renderer;
+	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	int cw, ch;
+
+	if (!rer->surface_copy_content_scaled)
+		return -1;
+
+	weston_surface_get_content_size(surface, &cw, &ch);
+
+	if (cw <= 0 || ch <= 0)
+		return -1;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	if (width * bytespp * height > size)
+		return -1;
+
+	return rer->surface_copy_content_scaled(surface, target, size,
+						width, height);
+}
+
 static void
 subsurface_set_position(struct wl_client *client,
 			struct wl_resource *resource, int32_t x, int32_t y)
@@ -3594,6 +4559,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3652,6 +4618,8 @@ static void
 weston_subsurface_link_parent(struct weston_subsurface *sub,
 			      struct weston_surface *parent)
 {
+	weston_compositor_view_list_dirty(parent->compositor);
+
 	sub->parent = parent;
 	sub->parent_destroy_listener.notify = subsurface_handle_parent_destroy;
 	wl_signal_add(&parent->destroy_signal,
@@ -4011,6 +4979,8 @@ weston_plane_release(struct weston_plane *plane)
 	pixman_region32_fini(&plane->damage);
 	pixman_region32_fini(&plane->clip);
 
+	plane->compositor->damage_accumulated = false;
+
 	wl_list_for_each(view, &plane->compositor->view_list, link) {
 		if (view->plane == plane)
 			view->plane = NULL;
@@ -4028,6 +4998,8 @@ weston_compositor_stack_plane(struct weston_compositor *ec,
 		wl_list_insert(above->link.prev, &plane->link);
 	else
 		wl_list_insert(&ec->plane_list, &plane->link);
+
+	ec->damage_accumulated = false;
 }
 
 static void unbind_resource(struct wl_resource *resource)
@@ -4108,7 +5080,7 @@ weston_output_destroy(struct weston_output *output)
 	output->destroying = 1;
 
 	wl_list_for_each(view, &output->compositor->view_list, link) {
-		if (view->output_mask & (1u << output->id))
+		if (weston_output_mask_contains(&view->output_mask, output->id))
 			weston_view_assign_output(view);
 	}
 
@@ -4125,7 +5097,9 @@ weston_output_destroy(struct weston_output *output)
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
-	output->compositor->output_id_pool &= ~(1u << output->id);
+	weston_output_mask_remove(&output->compositor->output_id_pool,
+				  output->id);
+	output->compositor->outputs_by_id[output->id] = NULL;
 
 	wl_resource_for_each(resource, &output->resource_list) {
 		wl_resource_set_destructor(resource, NULL);
@@ -4271,6 +5245,18 @@ weston_output_move(struct weston_output *output, int x, int y)
 	}
 }
 
+static int
+output_id_pool_find_free(const struct weston_output_mask *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(pool->bits); i++)
+		if (~pool->bits[i])
+			return i * 64 + __builtin_ctzll(~pool->bits[i]);
+
+	return -1;
+}
+
 /** Initialize a weston_output object's parameters
  *
  * \param output     The weston_output object to initialize
@@ -4288,10 +5274,11 @@ weston_output_move(struct weston_output *output, int x, int y)
  * Establishes a repaint timer for the output with the relevant display
  * object's event loop.  See output_repaint_timer_handler().
  *
- * The output is assigned an ID.  Weston can support up to 32 distinct
- * outputs, with IDs numbered from 0-31; the compositor's output_id_pool
- * is referred to and used to find the first available ID number, and
- * then this ID is marked as used in output_id_pool.
+ * The output is assigned an ID.  Weston can support up to
+ * WESTON_MAX_OUTPUTS distinct outputs, with IDs numbered from 0 to
+ * WESTON_MAX_OUTPUTS - 1; the compositor's output_id_pool is referred to
+ * and used to find the first available ID number, and then this ID is
+ * marked as used in output_id_pool.
  *
  * The output is also assigned a Wayland global with the wl_output
  * external interface.
@@ -4302,9 +5289,11 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 		   int32_t scale)
 {
 	struct wl_event_loop *loop;
+	int id;
 
-	/* Verify we haven't reached the limit of 32 available output IDs */
-	assert(ffs(~c->output_id_pool) > 0);
+	/* Verify we haven't reached the limit of available output IDs */
+	id = output_id_pool_find_free(&c->output_id_pool);
+	assert(id >= 0);
 
 	output->compositor = c;
 	output->x = x;
@@ -4331,12 +5320,12 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	output->repaint_timer = wl_event_loop_add_timer(loop,
 					output_repaint_timer_handler, output);
 
-	/* Invert the output id pool and look for the lowest numbered
-	 * switch (the least significant bit).  Take that bit's position
-	 * as our ID, and mark it used in the compositor's output_id_pool.
+	/* Take the lowest free ID, and mark it used in the compositor's
+	 * output_id_pool.
 	 */
-	output->id = ffs(~output->compositor->output_id_pool) - 1;
-	output->compositor->output_id_pool |= 1u << output->id;
+	output->id = id;
+	weston_output_mask_add(&c->output_id_pool, output->id);
+	c->outputs_by_id[output->id] = output;
 
 	output->global =
 		wl_global_create(c->wl_display, &wl_output_interface, 2,
@@ -4739,8 +5728,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	wl_signal_init(&ec->session_signal);
 	ec->session_active = 1;
 
-	ec->output_id_pool = 0;
+	weston_output_mask_clear(&ec->output_id_pool);
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->pixman_threads = 1;
 
 	if (!wl_global_create(ec->wl_display, &wl_compositor_interface, 4,
 			      ec, compositor_bind))
@@ -4759,6 +5749,14 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_needs_rebuild = true;
+	wl_array_init(&ec->view_list_layers);
+
+	ec->pick_grid = calloc(PICK_GRID_BUCKETS, sizeof *ec->pick_grid);
+	if (!ec->pick_grid)
+		goto fail;
+	wl_array_init(&ec->pick_big);
+	ec->pick_grid_valid = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -4779,6 +5777,8 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	loop = wl_display_get_event_loop(ec->wl_display);
 	ec->idle_source = wl_event_loop_add_timer(loop, idle_handler, ec);
+	ec->occluded_frame_timer =
+		wl_event_loop_add_timer(loop, occluded_frame_handler, ec);
 
 	ec->input_loop = wl_event_loop_create();
 
@@ -4799,8 +5799,13 @@ WL_EXPORT void
 weston_compositor_shutdown(struct weston_compositor *ec)
 {
 	struct weston_output *output, *next;
+	int i;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->occluded_frame_timer);
+	if (ec->repaint_stats_timer)
+		wl_event_source_remove(ec->repaint_stats_timer);
+	free(ec->repaint_stats_path);
 	if (ec->input_loop_source)
 		wl_event_source_remove(ec->input_loop_source);
 
@@ -4820,6 +5825,13 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	wl_array_release(&ec->view_list_layers);
+
+	for (i = 0; i < PICK_GRID_BUCKETS; i++)
+		wl_array_release(&ec->pick_grid[i]);
+	free(ec->pick_grid);
+	wl_array_release(&ec->pick_big);
+
 	wl_event_loop_destroy(ec->input_loop);
 }
 
@@ -4890,6 +5902,104 @@ weston_compositor_set_presentation_clock_software(
 	return -1;
 }
 
+static int
+repaint_stats_timer_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	static bool warned;
+	char *tmp;
+	FILE *fp;
+	int ret = -1;
+
+	/* Written to a temporary file and renamed, so that a reader polling
+	 * the file never sees it half written. */
+	if (asprintf(&tmp, "%s.tmp", compositor->repaint_stats_path) < 0)
+		tmp = NULL;
+
+	fp = tmp ? fopen(tmp, "w") : NULL;
+	if (fp) {
+		fprintf(fp, "interval-ms %u\n",
+			compositor->repaint_stats_interval);
+		wl_list_for_each(output, &compositor->output_list, link) {
+			weston_output_write_repaint_stats(output, fp);
+			memset(output->repaint_stats.hist, 0,
+			       sizeof output->repaint_stats.hist);
+		}
+
+		ret = fclose(fp);
+		if (ret == 0)
+			ret = rename(tmp, compositor->repaint_stats_path);
+	}
+
+	if (ret < 0 && !warned) {
+		weston_log("Failed to write repaint statistics to %s: %m\n",
+			   compositor->repaint_stats_path);
+		warned = true;
+	}
+
+	free(tmp);
+
+	wl_event_source_timer_update(compositor->repaint_stats_timer,
+				     compositor->repaint_stats_interval);
+
+	return 0;
+}
+
+/** Periodically write the repaint statistics of all outputs to a file
+ *
+ * \param compositor The compositor.
+ * \param path The file to write, or NULL to stop writing it.
+ * \param interval_msec How often to write the file, in milliseconds.
+ * \return 0 on success, -1 on failure.
+ *
+ * Each time the file is written, the histograms of all outputs start
+ * over, so the file always holds the statistics of the last interval.
+ * See weston_output_write_repaint_stats() for the contents.
+ */
+WL_EXPORT int
+weston_compositor_set_repaint_stats(struct weston_compositor *compositor,
+				    const char *path, uint32_t interval_msec)
+{
+	struct wl_event_loop *loop;
+
+	free(compositor->repaint_stats_path);
+	compositor->repaint_stats_path = NULL;
+
+	if (!path) {
+		if (compositor->repaint_stats_timer)
+			wl_event_source_remove(compositor->repaint_stats_timer);
+		compositor->repaint_stats_timer = NULL;
+		return 0;
+	}
+
+	if (interval_msec == 0)
+		return -1;
+
+	if (!compositor->repaint_stats_timer) {
+		loop = wl_display_get_event_loop(compositor->wl_display);
+		compositor->repaint_stats_timer =
+			wl_event_loop_add_timer(loop,
+						repaint_stats_timer_handler,
+						compositor);
+		if (!compositor->repaint_stats_timer)
+			return -1;
+	}
+
+	compositor->repaint_stats_path = strdup(path);
+	if (!compositor->repaint_stats_path) {
+		wl_event_source_remove(compositor->repaint_stats_timer);
+		compositor->repaint_stats_timer = NULL;
+		return -1;
+	}
+
+	compositor->repaint_stats_interval = interval_msec;
+	wl_event_source_timer_update(compositor->repaint_stats_timer,
+				     interval_msec);
+
+	return 0;
+}
+
 /** Read the current time from the Presentation clock
  *
  * \param compositor
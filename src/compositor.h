@@ -32,6 +32,9 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <pixman.h>
 #include <xkbcommon/xkbcommon.h>
@@ -84,6 +87,119 @@ struct weston_mode {
 	struct wl_list link;
 };
 
+/* The number of outputs a compositor can have at the same time. */
+#define WESTON_MAX_OUTPUTS 256
+
+/** A set of outputs, indexed by weston_output::id */
+struct weston_output_mask {
+	uint64_t bits[WESTON_MAX_OUTPUTS / 64];
+};
+
+static inline void
+weston_output_mask_clear(struct weston_output_mask *mask)
+{
+	memset(mask, 0, sizeof *mask);
+}
+
+static inline void
+weston_output_mask_add(struct weston_output_mask *mask, uint32_t id)
+{
+	mask->bits[id / 64] |= UINT64_C(1) << (id % 64);
+}
+
+static inline void
+weston_output_mask_remove(struct weston_output_mask *mask, uint32_t id)
+{
+	mask->bits[id / 64] &= ~(UINT64_C(1) << (id % 64));
+}
+
+static inline bool
+weston_output_mask_contains(const struct weston_output_mask *mask,
+			    uint32_t id)
+{
+	return mask->bits[id / 64] & (UINT64_C(1) << (id % 64));
+}
+
+static inline bool
+weston_output_mask_is_empty(const struct weston_output_mask *mask)
+{
+	uint64_t any = 0;
+	unsigned i;
+
+	for (i = 0; i < WESTON_MAX_OUTPUTS / 64; i++)
+		any |= mask->bits[i];
+
+	return any == 0;
+}
+
+/* Whether the mask contains the given output and no other. */
+static inline bool
+weston_output_mask_is_only(const struct weston_output_mask *mask,
+			   uint32_t id)
+{
+	uint64_t other = 0;
+	unsigned i;
+
+	for (i = 0; i < WESTON_MAX_OUTPUTS / 64; i++)
+		if (i != id / 64)
+			other |= mask->bits[i];
+
+	return other == 0 &&
+	       mask->bits[id / 64] == UINT64_C(1) << (id % 64);
+}
+
+static inline void
+weston_output_mask_union(struct weston_output_mask *dest,
+			 const struct weston_output_mask *src)
+{
+	unsigned i;
+
+	for (i = 0; i < WESTON_MAX_OUTPUTS / 64; i++)
+		dest->bits[i] |= src->bits[i];
+}
+
+static inline bool
+weston_output_mask_is_subset(const struct weston_output_mask *mask,
+			     const struct weston_output_mask *of)
+{
+	unsigned i;
+
+	for (i = 0; i < WESTON_MAX_OUTPUTS / 64; i++)
+		if (mask->bits[i] & ~of->bits[i])
+			return false;
+
+	return true;
+}
+
+/** Find the lowest output id in a mask
+ *
+ * \param mask The output mask.
+ * \param from The first id to consider.
+ * \return The lowest id >= from in the mask, or -1 if there is none.
+ *
+ * Iterate over a mask with
+ *	for (id = weston_output_mask_next(mask, 0); id >= 0;
+ *	     id = weston_output_mask_next(mask, id + 1))
+ */
+static inline int
+weston_output_mask_next(const struct weston_output_mask *mask, int from)
+{
+	unsigned i = from / 64;
+	uint64_t word;
+
+	if (from >= WESTON_MAX_OUTPUTS)
+		return -1;
+
+	word = mask->bits[i] & (~UINT64_C(0) << (from % 64));
+	while (word == 0) {
+		if (++i == WESTON_MAX_OUTPUTS / 64)
+			return -1;
+		word = mask->bits[i];
+	}
+
+	return i * 64 + __builtin_ctzll(word);
+}
+
 struct weston_shell_client {
 	void (*send_configure)(struct weston_surface *surface, int32_t width, int32_t height);
 	void (*send_position)(struct weston_surface *surface, int32_t x, int32_t y);
@@ -165,6 +281,30 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+/* Number of recent repaint durations kept for the adaptive repaint window */
+#define WESTON_REPAINT_SAMPLES 32
+
+/* Per-output repaint statistics, see weston_output_write_repaint_stats() */
+enum weston_repaint_stat {
+	WESTON_REPAINT_STAT_TIME_US,		/* repaint duration */
+	WESTON_REPAINT_STAT_DAMAGE,		/* damaged pixels */
+	WESTON_REPAINT_STAT_VIEWS,		/* views composited */
+	WESTON_REPAINT_STAT_UPLOADS,		/* texture uploads by the renderer */
+	WESTON_REPAINT_STAT_MISSED_VBLANKS,	/* per presented frame */
+	WESTON_REPAINT_STAT_COUNT
+};
+
+/* Bucket 0 counts the zero samples, bucket i > 0 the samples in
+ * [2^(i-1), 2^i), and the last bucket everything above. */
+#define WESTON_REPAINT_STAT_BUCKETS 32
+
+struct weston_repaint_histogram {
+	uint32_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t bucket[WESTON_REPAINT_STAT_BUCKETS];
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -203,6 +343,28 @@ struct weston_output {
 	int destroying;
 	struct wl_list feedback_list;
 
+	/* Adaptive repaint window, see output_repaint_window_msec() */
+	struct {
+		uint32_t usec[WESTON_REPAINT_SAMPLES]; /* ring buffer */
+		unsigned count;
+		unsigned next;
+		int32_t window_usec;	/* used to schedule the last repaint */
+	} repaint_time;
+
+	/* Views fully occluded on this output in the last repaint */
+	uint32_t occluded_views;
+
+	/* Histograms of the current statistics window, cleared each time
+	 * the repaint-stats file is written. */
+	struct {
+		struct weston_repaint_histogram hist[WESTON_REPAINT_STAT_COUNT];
+		uint32_t uploads;	/* done in the last damage flush */
+		uint64_t frames;	/* since the output was created */
+		uint64_t missed_vblanks;
+		struct timespec last_stamp;
+		bool last_stamp_valid;	/* last_stamp was a presented frame */
+	} repaint_stats;
+
 	char *make, *model, *serial_number;
 	uint32_t subpixel;
 	uint32_t transform;
@@ -642,6 +804,11 @@ struct weston_renderer {
 				    int src_x, int src_y,
 				    int width, int height);
 
+	/** See weston_surface_copy_content_scaled() */
+	int (*surface_copy_content_scaled)(struct weston_surface *surface,
+					   void *target, size_t size,
+					   int width, int height);
+
 	/** See weston_compositor_import_dmabuf() */
 	bool (*import_dmabuf)(struct weston_compositor *ec,
 			      struct linux_dmabuf_buffer *buffer);
@@ -738,7 +905,7 @@ struct weston_compositor {
 	struct wl_list output_list;
 	struct wl_list seat_list;
 	struct wl_list layer_list;
-	struct wl_list view_list;
+	struct wl_list view_list;	/* weston_view::link */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -749,6 +916,10 @@ struct weston_compositor {
 
 	uint32_t state;
 	struct wl_event_source *idle_source;
+	struct wl_event_source *occluded_frame_timer;
+	bool occluded_frame_timer_armed;
+	uint32_t occluded_frame_deadline;	/* frame_time, ms */
+	uint32_t texture_uploads;	/* see weston_surface_count_upload() */
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
 
@@ -756,6 +927,30 @@ struct weston_compositor {
 
 	/* Repaint state. */
 	struct weston_plane primary_plane;
+
+	/* view_list is only rebuilt from the layers when this is set, or
+	 * when the layer order differs from view_list_layers. */
+	bool view_list_needs_rebuild;
+	struct wl_array view_list_layers;	/* struct weston_layer * */
+	bool verify_view_list;
+
+	/* Uniform grid over view_list for weston_compositor_pick_view().
+	 * Each bucket holds the views overlapping its cells in stacking
+	 * order; views spanning too many cells are kept in pick_big.
+	 */
+	struct wl_array *pick_grid;
+	struct wl_array pick_big;
+	bool pick_grid_valid;
+
+	/* With share_damage_accumulation, outputs repainting within one
+	 * refresh period reuse the plane clip and damage computed for the
+	 * first of them, until a repaint is scheduled for a surface or view
+	 * or the view list or planes change.
+	 */
+	bool share_damage_accumulation;
+	bool damage_accumulated;
+	struct timespec damage_accumulated_time;
+
 	uint32_t capabilities; /* combination of enum weston_capability */
 
 	struct weston_renderer *renderer;
@@ -766,7 +961,8 @@ struct weston_compositor {
 
 	struct weston_launcher *launcher;
 
-	uint32_t output_id_pool;
+	struct weston_output_mask output_id_pool;
+	struct weston_output *outputs_by_id[WESTON_MAX_OUTPUTS];
 
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
@@ -782,6 +978,26 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	bool adaptive_repaint_window;
+
+	/* Minimum time between frame callbacks of occluded surfaces in
+	 * milliseconds, 0 to not throttle them. */
+	uint32_t occluded_frame_interval;
+
+	/* Threads compositing an output with the pixman renderer, including
+	 * the compositor thread; 0 uses one per online CPU. */
+	int32_t pixman_threads;
+
+	/* Write the timeline log in the binary format, to a ring buffer
+	 * of timeline_buffer_size MiB. */
+	int timeline_binary;
+	uint32_t timeline_buffer_size;
+
+	/* Repaint statistics of all outputs are written to this file every
+	 * repaint_stats_interval milliseconds, NULL to not write them. */
+	char *repaint_stats_path;
+	uint32_t repaint_stats_interval;
+	struct wl_event_source *repaint_stats_timer;
 
 	int exit_code;
 
@@ -913,6 +1129,10 @@ struct weston_view {
 	struct {
 		int dirty;
 
+		/* Bumped by weston_view_geometry_dirty(), so that renderers
+		 * can tell when geometry they cached is out of date. */
+		uint32_t serial;
+
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
 		 *   the smallest possible single rectangle.
@@ -943,10 +1163,24 @@ struct weston_view {
 	 * A more complete representation of all outputs this surface is
 	 * displayed on.
 	 */
-	uint32_t output_mask;
+	struct weston_output_mask output_mask;
+
+	/*
+	 * Outputs on which opaque views above hide all of this view, as of
+	 * the last damage accumulation. Renderers skip the view there.
+	 */
+	struct weston_output_mask occluded_mask;
 
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
+
+	/* Position in weston_compositor::pick_grid, private to the core. */
+	struct {
+		uint32_t z;		/* stacking order in view_list */
+		bool indexed;		/* true iff in view_list and the grid */
+		bool big;		/* in pick_big instead of the grid */
+		int32_t cx1, cy1, cx2, cy2;	/* cells covered, inclusive */
+	} pick;
 };
 
 struct weston_surface_state {
@@ -1013,11 +1247,14 @@ struct weston_surface {
 	 * A more complete representation of all outputs this surface is
 	 * displayed on.
 	 */
-	uint32_t output_mask;
+	struct weston_output_mask output_mask;
 
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* weston_output::frame_time when frame callbacks were last sent */
+	uint32_t frame_callback_time;
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1208,6 +1445,9 @@ weston_layer_set_mask(struct weston_layer *layer, int x, int y, int width, int h
 void
 weston_layer_set_mask_infinite(struct weston_layer *layer);
 
+void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor);
+
 void
 weston_plane_init(struct weston_plane *plane,
 			struct weston_compositor *ec,
@@ -1230,6 +1470,8 @@ weston_output_finish_frame(struct weston_output *output,
 void
 weston_output_schedule_repaint(struct weston_output *output);
 void
+weston_output_write_repaint_stats(struct weston_output *output, FILE *fp);
+void
 weston_output_damage(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
@@ -1383,12 +1625,19 @@ weston_view_set_mask_infinite(struct weston_view *view);
 bool
 weston_view_is_mapped(struct weston_view *view);
 
+bool
+weston_view_is_occluded(struct weston_view *view,
+			struct weston_output *output);
+
 void
 weston_view_schedule_repaint(struct weston_view *view);
 
 bool
 weston_surface_is_mapped(struct weston_surface *surface);
 
+bool
+weston_surface_is_occluded(struct weston_surface *surface);
+
 void
 weston_surface_set_size(struct weston_surface *surface,
 			int32_t width, int32_t height);
@@ -1399,6 +1648,9 @@ weston_surface_schedule_repaint(struct weston_surface *surface);
 void
 weston_surface_damage(struct weston_surface *surface);
 
+void
+weston_surface_count_upload(struct weston_surface *surface);
+
 void
 weston_view_damage_below(struct weston_view *view);
 
@@ -1435,6 +1687,11 @@ weston_surface_copy_content(struct weston_surface *surface,
 			    int src_x, int src_y,
 			    int width, int height);
 
+int
+weston_surface_copy_content_scaled(struct weston_surface *surface,
+				   void *target, size_t size,
+				   int width, int height);
+
 struct weston_buffer *
 weston_buffer_from_resource(struct wl_resource *resource);
 
@@ -1459,6 +1716,9 @@ weston_compositor_set_presentation_clock(struct weston_compositor *compositor,
 int
 weston_compositor_set_presentation_clock_software(
 					struct weston_compositor *compositor);
+int
+weston_compositor_set_repaint_stats(struct weston_compositor *compositor,
+				    const char *path, uint32_t interval_msec);
 void
 weston_compositor_read_presentation_clock(
 			const struct weston_compositor *compositor,
@@ -1566,7 +1826,8 @@ screenshooter_create(struct weston_compositor *ec);
 enum weston_screenshooter_outcome {
 	WESTON_SCREENSHOOTER_SUCCESS,
 	WESTON_SCREENSHOOTER_NO_MEMORY,
-	WESTON_SCREENSHOOTER_BAD_BUFFER
+	WESTON_SCREENSHOOTER_BAD_BUFFER,
+	WESTON_SCREENSHOOTER_NO_CONTENT
 };
 
 typedef void (*weston_screenshooter_done_func_t)(void *data,
@@ -1574,6 +1835,18 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  struct weston_buffer *buffer,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
+int
+weston_screenshooter_shoot_surface(struct weston_surface *surface,
+				   struct weston_buffer *buffer,
+				   weston_screenshooter_done_func_t done,
+				   void *data);
 
 struct clipboard *
 clipboard_create(struct weston_seat *seat);
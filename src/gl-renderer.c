@@ -40,6 +40,8 @@
 
 #include "gl-renderer.h"
 #include "vertex-clipping.h"
+#include "region-bands.h"
+#include "timeline.h"
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 
@@ -164,6 +166,54 @@ struct gl_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* A run of triangles drawn with a single call, all with the shader,
+ * textures and uniforms of one view. The indices are relative to
+ * first_vertex, so that they fit in a GLushort. */
+struct gl_batch {
+	struct weston_view *view;
+	struct gl_shader *shader;
+	GLint filter;
+	bool blend;
+
+	int order;
+	uint32_t first_vertex;
+	uint32_t first_index;
+	uint32_t index_count;
+};
+
+struct gl_batch_list {
+	struct wl_array batches;
+	struct wl_array indices;	/* GLushort */
+};
+
+#define GL_VIEW_CACHE_SIZE 4
+
+/* The triangle fans texture_region() made for a pair of regions. */
+struct gl_geometry_cache {
+	pixman_region32_t region;
+	pixman_region32_t surf_region;
+	struct wl_array vertices;
+	struct wl_array vtxcnt;
+};
+
+/* The geometry of a view, kept across repaints. The opaque and blended
+ * parts of the view are looked up by their regions, and a few entries
+ * cover the damage alternating between the buffers of an output. The
+ * entries are dropped when the view geometry or the mapping of the
+ * surface to its buffer changes. */
+struct gl_view_state {
+	uint32_t transform_serial;
+	int pitch, height, y_inverted;
+	int32_t surface_width, surface_height;
+	int32_t width_from_buffer, height_from_buffer;
+	struct weston_buffer_viewport buffer_viewport;
+
+	struct gl_geometry_cache cache[GL_VIEW_CACHE_SIZE];
+	int cache_count, cache_next;
+
+	struct wl_listener view_destroy_listener;
+};
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
@@ -178,6 +228,13 @@ struct gl_renderer {
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
 
+	/* The triangles of an output repaint, indexing into vertices.
+	 * The opaque batches cover disjoint areas and are drawn first in
+	 * any order, the others are drawn back to front after them. */
+	struct gl_batch_list opaque_batches;
+	struct gl_batch_list ordered_batches;
+	int batch_count;
+
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
 	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
@@ -434,55 +491,6 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 	return n;
 }
 
-static bool
-merge_down(pixman_box32_t *a, pixman_box32_t *b, pixman_box32_t *merge)
-{
-	if (a->x1 == b->x1 && a->x2 == b->x2 && a->y1 == b->y2) {
-		merge->x1 = a->x1;
-		merge->x2 = a->x2;
-		merge->y1 = b->y1;
-		merge->y2 = a->y2;
-		return true;
-	}
-	return false;
-}
-
-static int
-compress_bands(pixman_box32_t *inrects, int nrects,
-		   pixman_box32_t **outrects)
-{
-	bool merged;
-	pixman_box32_t *out, merge_rect;
-	int i, j, nout;
-
-	if (!nrects) {
-		*outrects = NULL;
-		return 0;
-	}
-
-	/* nrects is an upper bound - we're not too worried about
-	 * allocating a little extra
-	 */
-	out = malloc(sizeof(pixman_box32_t) * nrects);
-	out[0] = inrects[0];
-	nout = 1;
-	for (i = 1; i < nrects; i++) {
-		for (j = 0; j < nout; j++) {
-			merged = merge_down(&inrects[i], &out[j], &merge_rect);
-			if (merged) {
-				out[j] = merge_rect;
-				break;
-			}
-		}
-		if (!merged) {
-			out[nout] = inrects[i];
-			nout++;
-		}
-	}
-	*outrects = out;
-	return nout;
-}
-
 static int
 texture_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
@@ -499,16 +507,17 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
 
-	if (raw_nrects < 4) {
-		used_band_compression = false;
+	used_band_compression = false;
+	if (raw_nrects >= 4) {
+		nrects = compress_bands(raw_rects, raw_nrects, &rects);
+		used_band_compression = nrects >= 0;
+	}
+	if (!used_band_compression) {
 		nrects = raw_nrects;
 		rects = raw_rects;
-	} else {
-		nrects = compress_bands(raw_rects, raw_nrects, &rects);
-		used_band_compression = true;
 	}
 	/* worst case we can have 8 vertices per rect (ie. clipped into
-	 * an octagon):
+	 * an octagon), the arrays are trimmed to what is used below:
 	 */
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
@@ -565,60 +574,223 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 		}
 	}
 
+	gr->vertices.size = (char *) v - (char *) gr->vertices.data;
+	gr->vtxcnt.size = (char *) &vtxcnt[nvtx] - (char *) gr->vtxcnt.data;
+
 	if (used_band_compression)
 		free(rects);
 	return nvtx;
 }
 
 static void
-triangle_fan_debug(struct weston_view *view, int first, int count)
+gl_view_state_clear_cache(struct gl_view_state *vs)
 {
-	struct weston_compositor *compositor = view->surface->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
 	int i;
-	GLushort *buffer;
-	GLushort *index;
-	int nelems;
-	static int color_idx = 0;
-	static const GLfloat color[][4] = {
-			{ 1.0, 0.0, 0.0, 1.0 },
-			{ 0.0, 1.0, 0.0, 1.0 },
-			{ 0.0, 0.0, 1.0, 1.0 },
-			{ 1.0, 1.0, 1.0, 1.0 },
-	};
 
-	nelems = (count - 1 + count - 2) * 2;
+	for (i = 0; i < vs->cache_count; i++) {
+		pixman_region32_fini(&vs->cache[i].region);
+		pixman_region32_fini(&vs->cache[i].surf_region);
+		wl_array_release(&vs->cache[i].vertices);
+		wl_array_release(&vs->cache[i].vtxcnt);
+	}
 
-	buffer = malloc(sizeof(GLushort) * nelems);
-	index = buffer;
+	vs->cache_count = 0;
+	vs->cache_next = 0;
+}
+
+static void
+view_state_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_view_state *vs;
+
+	vs = container_of(listener, struct gl_view_state,
+			  view_destroy_listener);
 
-	for (i = 1; i < count; i++) {
-		*index++ = first;
-		*index++ = first + i;
+	wl_list_remove(&vs->view_destroy_listener.link);
+	gl_view_state_clear_cache(vs);
+	free(vs);
+}
+
+static bool
+buffer_viewport_equal(const struct weston_buffer_viewport *a,
+		      const struct weston_buffer_viewport *b)
+{
+	return a->buffer.transform == b->buffer.transform &&
+	       a->buffer.scale == b->buffer.scale &&
+	       a->buffer.src_x == b->buffer.src_x &&
+	       a->buffer.src_y == b->buffer.src_y &&
+	       a->buffer.src_width == b->buffer.src_width &&
+	       a->buffer.src_height == b->buffer.src_height &&
+	       a->surface.width == b->surface.width &&
+	       a->surface.height == b->surface.height;
+}
+
+/* Returns the state of the view, with the cache emptied if the
+ * geometry it was computed for has changed since. */
+static struct gl_view_state *
+get_view_state(struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct wl_listener *listener;
+	struct gl_view_state *vs;
+
+	listener = wl_signal_get(&ev->destroy_signal,
+				 view_state_handle_view_destroy);
+	if (listener) {
+		vs = container_of(listener, struct gl_view_state,
+				  view_destroy_listener);
+	} else {
+		vs = zalloc(sizeof *vs);
+		if (!vs)
+			return NULL;
+
+		vs->view_destroy_listener.notify =
+			view_state_handle_view_destroy;
+		wl_signal_add(&ev->destroy_signal,
+			      &vs->view_destroy_listener);
 	}
 
-	for (i = 2; i < count; i++) {
-		*index++ = first + i - 1;
-		*index++ = first + i;
+	if (vs->transform_serial != ev->transform.serial ||
+	    vs->pitch != gs->pitch || vs->height != gs->height ||
+	    vs->y_inverted != gs->y_inverted ||
+	    vs->surface_width != surface->width ||
+	    vs->surface_height != surface->height ||
+	    vs->width_from_buffer != surface->width_from_buffer ||
+	    vs->height_from_buffer != surface->height_from_buffer ||
+	    !buffer_viewport_equal(&vs->buffer_viewport,
+				   &surface->buffer_viewport)) {
+		gl_view_state_clear_cache(vs);
+
+		vs->transform_serial = ev->transform.serial;
+		vs->pitch = gs->pitch;
+		vs->height = gs->height;
+		vs->y_inverted = gs->y_inverted;
+		vs->surface_width = surface->width;
+		vs->surface_height = surface->height;
+		vs->width_from_buffer = surface->width_from_buffer;
+		vs->height_from_buffer = surface->height_from_buffer;
+		vs->buffer_viewport = surface->buffer_viewport;
 	}
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
-	glUseProgram(gr->current_shader->program);
-	free(buffer);
+	return vs;
+}
+
+/* Like texture_region(), but reuses the triangle fans of an earlier
+ * repaint of the same regions of the view. */
+static int
+view_texture_region(struct weston_view *ev, pixman_region32_t *region,
+		    pixman_region32_t *surf_region)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct gl_view_state *vs = get_view_state(ev);
+	struct gl_geometry_cache *cache;
+	size_t first;
+	void *p;
+	int i, nfans;
+
+	if (!vs)
+		return texture_region(ev, region, surf_region);
+
+	for (i = 0; i < vs->cache_count; i++) {
+		cache = &vs->cache[i];
+		if (!pixman_region32_equal(&cache->region, region) ||
+		    !pixman_region32_equal(&cache->surf_region, surf_region))
+			continue;
+
+		p = wl_array_add(&gr->vertices, cache->vertices.size);
+		if (!p)
+			return 0;
+		memcpy(p, cache->vertices.data, cache->vertices.size);
+
+		p = wl_array_add(&gr->vtxcnt, cache->vtxcnt.size);
+		if (!p)
+			return 0;
+		memcpy(p, cache->vtxcnt.data, cache->vtxcnt.size);
+
+		return cache->vtxcnt.size / sizeof(unsigned int);
+	}
+
+	first = gr->vertices.size;
+	nfans = texture_region(ev, region, surf_region);
+
+	if (vs->cache_count < GL_VIEW_CACHE_SIZE) {
+		cache = &vs->cache[vs->cache_count++];
+		pixman_region32_init(&cache->region);
+		pixman_region32_init(&cache->surf_region);
+		wl_array_init(&cache->vertices);
+		wl_array_init(&cache->vtxcnt);
+	} else {
+		cache = &vs->cache[vs->cache_next];
+		vs->cache_next = (vs->cache_next + 1) % GL_VIEW_CACHE_SIZE;
+		cache->vertices.size = 0;
+		cache->vtxcnt.size = 0;
+	}
+
+	pixman_region32_copy(&cache->region, region);
+	pixman_region32_copy(&cache->surf_region, surf_region);
+
+	p = wl_array_add(&cache->vertices, gr->vertices.size - first);
+	if (p) {
+		memcpy(p, (char *) gr->vertices.data + first,
+		       gr->vertices.size - first);
+		p = wl_array_add(&cache->vtxcnt, gr->vtxcnt.size);
+	}
+
+	if (p) {
+		memcpy(p, gr->vtxcnt.data, gr->vtxcnt.size);
+	} else {
+		/* Only an empty region matches an empty entry. */
+		pixman_region32_clear(&cache->region);
+		cache->vertices.size = 0;
+		cache->vtxcnt.size = 0;
+	}
+
+	return nfans;
+}
+
+static struct gl_batch *
+gl_batch_list_add(struct gl_batch_list *list, struct gl_renderer *gr,
+		  const struct gl_batch *state, uint32_t first_vertex)
+{
+	struct gl_batch *batch;
+
+	batch = wl_array_add(&list->batches, sizeof *batch);
+	if (!batch)
+		return NULL;
+
+	*batch = *state;
+	batch->order = gr->batch_count++;
+	batch->first_vertex = first_vertex;
+	batch->first_index = list->indices.size / sizeof(GLushort);
+	batch->index_count = 0;
+
+	return batch;
+}
+
+static bool
+gl_batch_matches(const struct gl_batch *batch, const struct gl_batch *state)
+{
+	return batch->shader == state->shader &&
+	       batch->filter == state->filter &&
+	       batch->blend == state->blend &&
+	       batch->view->alpha == state->view->alpha &&
+	       batch->view->surface == state->view->surface;
 }
 
 static void
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+	       pixman_region32_t *surf_region, const struct gl_batch *state,
+	       struct gl_batch_list *list)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	struct gl_batch *batch = NULL;
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	uint32_t first, base;
+	GLushort *index;
+	unsigned int k;
+	int i, nfans;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -628,30 +800,41 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices, actually).
 	 */
-	nfans = texture_region(ev, region, surf_region);
-
-	v = gr->vertices.data;
+	first = gr->vertices.size / (4 * sizeof(GLfloat));
+	nfans = view_texture_region(ev, region, surf_region);
 	vtxcnt = gr->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+	/* Consecutive regions drawn the same way share a batch. */
+	if (list->batches.size > 0) {
+		batch = (struct gl_batch *) ((char *) list->batches.data +
+					     list->batches.size) - 1;
+		if (!gl_batch_matches(batch, state))
+			batch = NULL;
+	}
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+	for (i = 0; i < nfans; first += vtxcnt[i], i++) {
+		if (!batch ||
+		    first + vtxcnt[i] - batch->first_vertex > UINT16_MAX + 1) {
+			batch = gl_batch_list_add(list, gr, state, first);
+			if (!batch)
+				break;
+		}
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
-	}
+		index = wl_array_add(&list->indices,
+				     3 * (vtxcnt[i] - 2) * sizeof *index);
+		if (!index)
+			break;
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+		/* Split the fan into triangles. */
+		base = first - batch->first_vertex;
+		for (k = 1; k + 1 < vtxcnt[i]; k++) {
+			*index++ = base;
+			*index++ = base + k;
+			*index++ = base + k + 1;
+		}
+		batch->index_count += 3 * (vtxcnt[i] - 2);
+	}
 
-	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
 }
 
@@ -720,9 +903,124 @@ shader_uniforms(struct gl_shader *shader,
 		glUniform1i(shader->tex_uniforms[i], i);
 }
 
+/* Draws the lines of the triangles of a batch on top of them. */
+static void
+triangle_debug(struct weston_output *output, struct gl_batch *batch,
+	       GLushort *indices)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	GLushort *buffer, *index;
+	uint32_t i;
+	static int color_idx = 0;
+	static const GLfloat color[][4] = {
+			{ 1.0, 0.0, 0.0, 1.0 },
+			{ 0.0, 1.0, 0.0, 1.0 },
+			{ 0.0, 0.0, 1.0, 1.0 },
+			{ 1.0, 1.0, 1.0, 1.0 },
+	};
+
+	buffer = malloc(sizeof(GLushort) * batch->index_count * 2);
+	if (!buffer)
+		return;
+
+	index = buffer;
+	for (i = 0; i < batch->index_count; i += 3) {
+		*index++ = indices[i];
+		*index++ = indices[i + 1];
+		*index++ = indices[i + 1];
+		*index++ = indices[i + 2];
+		*index++ = indices[i + 2];
+		*index++ = indices[i];
+	}
+
+	use_shader(gr, &gr->solid_shader);
+	glUniformMatrix4fv(gr->solid_shader.proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform4fv(gr->solid_shader.color_uniform, 1,
+			color[color_idx++ % ARRAY_LENGTH(color)]);
+	/* Not left over from the batch, which may be translucent. */
+	glUniform1f(gr->solid_shader.alpha_uniform, 1.0f);
+	glEnable(GL_BLEND);
+	glDrawElements(GL_LINES, batch->index_count * 2, GL_UNSIGNED_SHORT,
+		       buffer);
+	free(buffer);
+}
+
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+draw_batches(struct weston_output *output, struct gl_batch_list *list)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	GLfloat *v = gr->vertices.data;
+	GLushort *indices = list->indices.data;
+	struct gl_surface_state *gs;
+	struct gl_batch *batch;
+	int i;
+
+	wl_array_for_each(batch, &list->batches) {
+		gs = get_surface_state(batch->view->surface);
+
+		use_shader(gr, batch->shader);
+		shader_uniforms(batch->shader, batch->view, output);
+
+		for (i = 0; i < gs->num_textures; i++) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(gs->target, gs->textures[i]);
+			glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER,
+					batch->filter);
+			glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER,
+					batch->filter);
+		}
+
+		if (batch->blend)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+
+		/* position: */
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[4 * batch->first_vertex]);
+		/* texcoord: */
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[4 * batch->first_vertex + 2]);
+
+		glDrawElements(GL_TRIANGLES, batch->index_count,
+			       GL_UNSIGNED_SHORT, &indices[batch->first_index]);
+
+		if (gr->fan_debug)
+			triangle_debug(output, batch,
+				       &indices[batch->first_index]);
+	}
+}
+
+static int
+compare_batches(const void *a, const void *b)
+{
+	const struct gl_batch *ba = a, *bb = b;
+	struct gl_surface_state *gsa = get_surface_state(ba->view->surface);
+	struct gl_surface_state *gsb = get_surface_state(bb->view->surface);
+
+	if (ba->shader != bb->shader)
+		return (uintptr_t) ba->shader < (uintptr_t) bb->shader ? -1 : 1;
+
+	if (gsa->textures[0] != gsb->textures[0])
+		return gsa->textures[0] < gsb->textures[0] ? -1 : 1;
+
+	return ba->order - bb->order;
+}
+
+/** Add the triangles of a view to the batches of the output repaint
+ *
+ * The parts of a view inside ev->transform.opaque go to the opaque
+ * batches. The core clips every view below with those parts, so they do
+ * not overlap anything else drawn in the repaint and their order does
+ * not matter. Everything else is drawn in stacking order, including
+ * opaque content outside ev->transform.opaque: that region is only
+ * updated with the view geometry, so it can lag behind an alpha change.
+ */
+static void
+batch_view(struct weston_view *ev, struct weston_output *output,
+	   pixman_region32_t *damage) /* in global coordinates */
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
@@ -733,8 +1031,9 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
-	GLint filter;
-	int i;
+	/* opaque region hiding the views below, in surface coordinates: */
+	pixman_region32_t surface_unordered;
+	struct gl_batch state = { .view = ev };
 
 	/* In case of a runtime switch of renderers, we may not have received
 	 * an attach for this surface since the switch. In that case we don't
@@ -742,6 +1041,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!gs->shader)
 		return;
 
+	/* Opaque views above hide all of it */
+	if (weston_view_is_occluded(ev, output))
+		return;
+
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
 				  &ev->transform.boundingbox, damage);
@@ -750,28 +1053,11 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
-	}
-
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
-
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
+		state.filter = GL_LINEAR;
 	else
-		filter = GL_NEAREST;
-
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
+		state.filter = GL_NEAREST;
 
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -782,7 +1068,6 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	pixman_region32_subtract(&surface_blend, &surface_blend,
 				 &ev->surface->opaque);
 
-	/* XXX: Should we be using ev->transform.opaque here? */
 	pixman_region32_init(&surface_opaque);
 	if (ev->geometry.scissor_enabled)
 		pixman_region32_intersect(&surface_opaque,
@@ -791,31 +1076,46 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
-
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
+	pixman_region32_init(&surface_unordered);
+	if (!ev->transform.enabled) {
+		pixman_region32_copy(&surface_unordered, &ev->transform.opaque);
+		pixman_region32_translate(&surface_unordered,
+					  -ev->geometry.x, -ev->geometry.y);
+		pixman_region32_intersect(&surface_unordered,
+					  &surface_unordered, &surface_opaque);
+		pixman_region32_subtract(&surface_opaque, &surface_opaque,
+					 &surface_unordered);
+	}
+
+	if (pixman_region32_not_empty(&surface_opaque) ||
+	    pixman_region32_not_empty(&surface_unordered)) {
+		/* Special case for RGBA textures with possibly
+		 * bad data in alpha channel: use the shader
+		 * that forces texture alpha = 1.0.
+		 * Xwayland surfaces need this.
+		 */
+		if (gs->shader == &gr->texture_shader_rgba)
+			state.shader = &gr->texture_shader_rgbx;
 		else
-			glDisable(GL_BLEND);
+			state.shader = gs->shader;
+		state.blend = ev->alpha < 1.0;
 
-		repaint_region(ev, &repaint, &surface_opaque);
+		if (pixman_region32_not_empty(&surface_unordered))
+			repaint_region(ev, &repaint, &surface_unordered,
+				       &state, &gr->opaque_batches);
+		if (pixman_region32_not_empty(&surface_opaque))
+			repaint_region(ev, &repaint, &surface_opaque, &state,
+				       &gr->ordered_batches);
 	}
 
 	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		state.shader = gs->shader;
+		state.blend = true;
+		repaint_region(ev, &repaint, &surface_blend, &state,
+			       &gr->ordered_batches);
 	}
 
+	pixman_region32_fini(&surface_unordered);
 	pixman_region32_fini(&surface_blend);
 	pixman_region32_fini(&surface_opaque);
 
@@ -823,15 +1123,48 @@ out:
 	pixman_region32_fini(&repaint);
 }
 
+static void
+gl_batch_list_clear(struct gl_batch_list *list)
+{
+	list->batches.size = 0;
+	list->indices.size = 0;
+}
+
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			batch_view(view, output, damage);
+
+	qsort(gr->opaque_batches.batches.data,
+	      gr->opaque_batches.batches.size / sizeof(struct gl_batch),
+	      sizeof(struct gl_batch), compare_batches);
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	draw_batches(output, &gr->opaque_batches);
+	draw_batches(output, &gr->ordered_batches);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	TL_POINT("gl_repaint_batches", TLP_OUTPUT(output),
+		 TLP_INT("draws", gr->batch_count),
+		 TLP_INT("vertices",
+			 gr->vertices.size / (4 * sizeof(GLfloat))),
+		 TLP_END);
+
+	gl_batch_list_clear(&gr->opaque_batches);
+	gl_batch_list_clear(&gr->ordered_batches);
+	gr->vertices.size = 0;
+	gr->batch_count = 0;
 }
 
 static void
@@ -1224,8 +1557,10 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+/* Uploads the accumulated damage of an shm buffer to the texture. Unless
+ * forced, a texture that will not be drawn this time is left stale. */
 static void
-gl_renderer_flush_damage(struct weston_surface *surface)
+gl_surface_flush_damage(struct weston_surface *surface, bool force)
 {
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
@@ -1245,6 +1580,9 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	if (!buffer)
 		return;
 
+	if (force)
+		goto upload;
+
 	/* Avoid upload, if the texture won't be used this time.
 	 * We still accumulate the damage in texture_damage, and
 	 * hold the reference to the buffer, in case the surface
@@ -1260,10 +1598,17 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	if (!texture_used)
 		return;
 
+	/* Likewise while opaque surfaces above hide it, the upload happens
+	 * on the first flush after the surface is exposed again. */
+	if (weston_surface_is_occluded(surface))
+		return;
+
+upload:
 	if (!pixman_region32_not_empty(&gs->texture_damage) &&
 	    !gs->needs_full_upload)
 		goto done;
 
+	weston_surface_count_upload(surface);
 	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
 
 	if (!gr->has_unpack_subimage) {
@@ -1316,6 +1661,12 @@ done:
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 }
 
+static void
+gl_renderer_flush_damage(struct weston_surface *surface)
+{
+	gl_surface_flush_damage(surface, false);
+}
+
 static void
 ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
@@ -1975,11 +2326,12 @@ pack_color(pixman_format_code_t format, float *c)
 	}
 }
 
+/* Draws the whole surface content into a tex_width by tex_height
+ * texture and reads the given rectangle of it into target. */
 static int
-gl_renderer_surface_copy_content(struct weston_surface *surface,
-				 void *target, size_t size,
-				 int src_x, int src_y,
-				 int width, int height)
+draw_surface_content(struct weston_surface *surface, void *target,
+		     int tex_width, int tex_height, GLint filter,
+		     int src_x, int src_y, int width, int height)
 {
 	static const GLfloat verts[4 * 2] = {
 		0.0f, 0.0f,
@@ -1999,36 +2351,19 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		 0.0f,  0.0f, 1.0f, 0.0f,
 		-1.0f,  1.0f, 0.0f, 1.0f
 	};
-	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
-	int cw, ch;
 	GLuint fbo;
 	GLuint tex;
 	GLenum status;
 	const GLfloat *proj;
 	int i;
 
-	gl_renderer_surface_get_content_size(surface, &cw, &ch);
-
-	switch (gs->buffer_type) {
-	case BUFFER_TYPE_NULL:
-		return -1;
-	case BUFFER_TYPE_SOLID:
-		*(uint32_t *)target = pack_color(format, gs->color);
-		return 0;
-	case BUFFER_TYPE_SHM:
-		gl_renderer_flush_damage(surface);
-		/* fall through */
-	case BUFFER_TYPE_EGL:
-		break;
-	}
-
 	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cw, ch,
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tex_width, tex_height,
 		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -2045,7 +2380,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		return -1;
 	}
 
-	glViewport(0, 0, cw, ch);
+	glViewport(0, 0, tex_width, tex_height);
 	glDisable(GL_BLEND);
 	use_shader(gr, gs->shader);
 	if (gs->y_inverted)
@@ -2061,8 +2396,8 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 		glActiveTexture(GL_TEXTURE0 + i);
 		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
 	}
 
 	/* position: */
@@ -2088,6 +2423,71 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	return 0;
 }
 
+static int
+gl_renderer_surface_copy_content(struct weston_surface *surface,
+				 void *target, size_t size,
+				 int src_x, int src_y,
+				 int width, int height)
+{
+	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
+	struct gl_surface_state *gs = get_surface_state(surface);
+	int cw, ch;
+
+	gl_renderer_surface_get_content_size(surface, &cw, &ch);
+
+	switch (gs->buffer_type) {
+	case BUFFER_TYPE_NULL:
+		return -1;
+	case BUFFER_TYPE_SOLID:
+		*(uint32_t *)target = pack_color(format, gs->color);
+		return 0;
+	case BUFFER_TYPE_SHM:
+		/* The texture may be stale while the surface is occluded
+		 * or off the primary plane. */
+		gl_surface_flush_damage(surface, true);
+		/* fall through */
+	case BUFFER_TYPE_EGL:
+		break;
+	}
+
+	return draw_surface_content(surface, target, cw, ch, GL_NEAREST,
+				    src_x, src_y, width, height);
+}
+
+static int
+gl_renderer_surface_copy_content_scaled(struct weston_surface *surface,
+					void *target, size_t size,
+					int width, int height)
+{
+	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
+	struct gl_surface_state *gs = get_surface_state(surface);
+	uint32_t *pixel = target;
+	uint32_t color;
+	int i;
+
+	switch (gs->buffer_type) {
+	case BUFFER_TYPE_NULL:
+		return -1;
+	case BUFFER_TYPE_SOLID:
+		color = pack_color(format, gs->color);
+		for (i = 0; i < width * height; i++)
+			pixel[i] = color;
+		return 0;
+	case BUFFER_TYPE_SHM:
+		/* The texture may be stale while the surface is occluded
+		 * or off the primary plane. */
+		gl_surface_flush_damage(surface, true);
+		/* fall through */
+	case BUFFER_TYPE_EGL:
+		break;
+	}
+
+	/* The texture is drawn at the target size, so only the pixels
+	 * asked for are read back. */
+	return draw_surface_content(surface, target, width, height, GL_LINEAR,
+				    0, 0, width, height);
+}
+
 static void
 surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 {
@@ -2659,6 +3059,10 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->opaque_batches.batches);
+	wl_array_release(&gr->opaque_batches.indices);
+	wl_array_release(&gr->ordered_batches.batches);
+	wl_array_release(&gr->ordered_batches.indices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
@@ -2873,6 +3277,8 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 	gr->base.surface_get_content_size =
 		gl_renderer_surface_get_content_size;
 	gr->base.surface_copy_content = gl_renderer_surface_copy_content;
+	gr->base.surface_copy_content_scaled =
+		gl_renderer_surface_copy_content_scaled;
 	gr->egl_display = NULL;
 
 	/* extension_suffix is supported */
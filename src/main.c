@@ -46,6 +46,7 @@
 #include "../shared/helpers.h"
 #include "git-version.h"
 #include "version.h"
+#include "timeline.h"
 
 #include "compositor-drm.h"
 
@@ -286,7 +287,10 @@ usage(int error_code)
 		"  --height=HEIGHT\tHeight of memory surface\n"
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
-		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n\n");
+		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
+		"  --refresh=RATE\tRefresh rate of the outputs in mHz (default: 60000)\n"
+		"  --free-running\tFinish frames as soon as they are repainted\n\n");
 #endif
 
 #if defined(BUILD_RDP_COMPOSITOR)
@@ -298,6 +302,8 @@ usage(int error_code)
 		"  --address=ADDR\tThe address to bind\n"
 		"  --port=PORT\t\tThe port to listen on\n"
 		"  --no-clients-resize\tThe RDP peers will be forced to the size of the desktop\n"
+		"  --encoder-threads=N\tThe number of threads encoding the updates, 0 to\n"
+		"\t\t\tencode on the compositor thread (default: one per CPU)\n"
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
@@ -502,6 +508,13 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct weston_config_section *s;
 	int repaint_msec;
 	int vt_switching;
+	int verify_view_list;
+	int share_damage_accumulation;
+	int adaptive_repaint_window;
+	int timeline;
+	char *timeline_format;
+	char *repaint_stats;
+	uint32_t repaint_stats_interval;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
@@ -536,8 +549,75 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &adaptive_repaint_window, false);
+	ec->adaptive_repaint_window = adaptive_repaint_window;
+	if (ec->adaptive_repaint_window)
+		weston_log("Output repaint window adapts to the measured "
+			   "repaint time, starting at %d ms.\n",
+			   ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_bool(s, "verify-view-list",
+				       &verify_view_list, false);
+	ec->verify_view_list = verify_view_list;
+
+	weston_config_section_get_bool(s, "share-damage-accumulation",
+				       &share_damage_accumulation, false);
+	ec->share_damage_accumulation = share_damage_accumulation;
+
+	weston_config_section_get_uint(s, "occluded-frame-interval",
+				       &ec->occluded_frame_interval, 0);
+
+	weston_config_section_get_int(s, "pixman-threads",
+				      &ec->pixman_threads, 1);
+	if (ec->pixman_threads < 0) {
+		weston_log("Invalid pixman-threads value in config: %d\n",
+			   ec->pixman_threads);
+		ec->pixman_threads = 1;
+	}
+
+	weston_config_section_get_string(s, "timeline-format",
+					 &timeline_format, "json");
+	if (strcmp(timeline_format, "binary") == 0)
+		ec->timeline_binary = 1;
+	else if (strcmp(timeline_format, "json") != 0)
+		weston_log("Invalid timeline-format value in config: %s\n",
+			   timeline_format);
+	free(timeline_format);
+
+	weston_config_section_get_uint(s, "timeline-buffer-size",
+				       &ec->timeline_buffer_size, 16);
+	if (ec->timeline_buffer_size == 0 ||
+	    ec->timeline_buffer_size > 4096) {
+		weston_log("Invalid timeline-buffer-size value in config: %u\n",
+			   ec->timeline_buffer_size);
+		ec->timeline_buffer_size = 16;
+	}
+
+	weston_config_section_get_bool(s, "timeline", &timeline, false);
+	if (timeline)
+		weston_timeline_open(ec);
+
+	weston_config_section_get_string(s, "repaint-stats",
+					 &repaint_stats, NULL);
+	weston_config_section_get_uint(s, "repaint-stats-interval",
+				       &repaint_stats_interval, 1000);
+	if (repaint_stats_interval == 0) {
+		weston_log("Invalid repaint-stats-interval value in config: "
+			   "%u\n", repaint_stats_interval);
+		repaint_stats_interval = 1000;
+	}
+	if (repaint_stats &&
+	    weston_compositor_set_repaint_stats(ec, repaint_stats,
+						repaint_stats_interval) < 0)
+		weston_log("Failed to set up repaint statistics.\n");
+	else if (repaint_stats)
+		weston_log("Writing repaint statistics to %s every %u ms.\n",
+			   repaint_stats, repaint_stats_interval);
+	free(repaint_stats);
 
 	return 0;
 }
@@ -670,6 +750,8 @@ load_drm_backend(struct weston_compositor *c, char const * backend,
 	int cf_connector = 0;
 	int cf_tty = 0;
 	bool cf_use_pixman = false;
+	int cf_pixman_buffers = 2;
+	int cf_pixman_shadow = 1;
 	bool cf_use_current_mode = true;
 	char *cf_seat_id = NULL;
 	char *cf_format = NULL;
@@ -687,6 +769,10 @@ load_drm_backend(struct weston_compositor *c, char const * backend,
 	/* get format */
 	section = weston_config_get_section(wc, "core", NULL, NULL);
 	weston_config_section_get_string(section, "gbm-format", &cf_format, NULL);
+	weston_config_section_get_int(section, "pixman-buffers",
+				      &cf_pixman_buffers, 2);
+	weston_config_section_get_bool(section, "pixman-shadow",
+				       &cf_pixman_shadow, 1);
 
 	/* fill the config structure */
 	weston_drm_backend_config_set_connector(config, cf_connector);
@@ -694,6 +780,8 @@ load_drm_backend(struct weston_compositor *c, char const * backend,
 	weston_drm_backend_config_set_tty(config, cf_tty);
 	weston_drm_backend_config_set_use_current_mode(config, cf_use_current_mode);
 	weston_drm_backend_config_set_use_pixman(config, cf_use_pixman);
+	weston_drm_backend_config_set_pixman_buffers(config, cf_pixman_buffers);
+	weston_drm_backend_config_set_pixman_shadow(config, cf_pixman_shadow);
 
 	if(cf_format)
 		weston_drm_backend_config_set_format(config, cf_format);
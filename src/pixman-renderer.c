@@ -29,23 +29,35 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 
 #include <linux/input.h>
 
+#define PIXMAN_MAX_THREADS		64
+#define PIXMAN_BANDS_PER_THREAD		4
+
 struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+
+	struct pixman_renderer_output_stats stats;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color;
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -53,6 +65,24 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* The pixman image of a wl_shm buffer, kept for as long as the buffer
+ * lives so that attaching it again does not create a new image. */
+struct pixman_buffer_state {
+	pixman_image_t *image;
+	pixman_format_code_t format;
+	int32_t width, height, stride;
+	void *data;
+
+	struct wl_listener buffer_destroy_listener;
+};
+
+struct pixman_view_state {
+	pixman_image_t *alpha_mask;
+	uint16_t alpha;
+
+	struct wl_listener view_destroy_listener;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -61,6 +91,28 @@ struct pixman_renderer {
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
+
+	/* Worker threads compositing output bands in parallel with the
+	 * compositor thread. Everything below the mutex is protected by
+	 * it. */
+	struct {
+		int count;
+		pthread_t *threads;
+		pthread_mutex_t mutex;
+		pthread_cond_t work_cond;
+		pthread_cond_t done_cond;
+		pthread_mutex_t shm_mutex;
+
+		bool quit;
+		uint32_t generation;
+		struct weston_output *output;
+		pixman_region32_t *damage;
+		pixman_box32_t extents;
+		int band_count;
+		int next_band;
+		int bands_done;
+		uint64_t busy_nsec;
+	} workers;
 };
 
 static inline struct pixman_output_state *
@@ -96,12 +148,36 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_transform_t transform;
 	pixman_image_t *out_buf;
+	uint8_t *src, *dst;
+	int src_stride, cpp;
+	uint32_t i;
 
 	if (!po->hw_buffer) {
 		errno = ENODEV;
 		return -1;
 	}
 
+	/* Without a format conversion the flip is a plain copy of each
+	 * row, much cheaper than a transformed composite. */
+	if (pixman_image_get_format(po->hw_buffer) == format &&
+	    x + width <= (uint32_t) pixman_image_get_width(po->hw_buffer) &&
+	    y + height <= (uint32_t) pixman_image_get_height(po->hw_buffer)) {
+		cpp = PIXMAN_FORMAT_BPP(format) / 8;
+		src_stride = pixman_image_get_stride(po->hw_buffer);
+		src = (uint8_t *) pixman_image_get_data(po->hw_buffer) +
+		      (pixman_image_get_height(po->hw_buffer) - 1 - (int) y) *
+		      src_stride + x * cpp;
+		dst = pixels;
+
+		for (i = 0; i < height; i++) {
+			memcpy(dst, src, width * cpp);
+			dst += width * cpp;
+			src -= src_stride;
+		}
+
+		return 0;
+	}
+
 	out_buf = pixman_image_create_bits(format,
 		width,
 		height,
@@ -315,6 +391,127 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+static void
+shm_buffer_begin_access(struct pixman_renderer *pr,
+			struct weston_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	/* The SIGBUS protection is per thread, but the pool reference
+	 * count it updates is not. */
+	pthread_mutex_lock(&pr->workers.shm_mutex);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	pthread_mutex_unlock(&pr->workers.shm_mutex);
+}
+
+static void
+shm_buffer_end_access(struct pixman_renderer *pr,
+		      struct weston_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	pthread_mutex_lock(&pr->workers.shm_mutex);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+	pthread_mutex_unlock(&pr->workers.shm_mutex);
+}
+
+/** Get an image of the surface contents private to the caller
+ *
+ * Compositing sets the transform and filter of the source image, and
+ * pixman computes some image properties lazily, so threads cannot share
+ * a source image. Wrapping the same pixels in a new image is cheap.
+ */
+static pixman_image_t *
+surface_state_get_image(struct pixman_renderer *pr,
+			struct pixman_surface_state *ps)
+{
+	void *data;
+
+	if (pr->workers.count == 0)
+		return pixman_image_ref(ps->image);
+
+	data = pixman_image_get_data(ps->image);
+	if (!data)
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			data, pixman_image_get_stride(ps->image));
+}
+
+static pixman_image_t *
+image_wrap(pixman_image_t *image)
+{
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(image),
+			pixman_image_get_width(image),
+			pixman_image_get_height(image),
+			pixman_image_get_data(image),
+			pixman_image_get_stride(image));
+}
+
+static void
+view_state_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct pixman_view_state *vs;
+
+	vs = container_of(listener, struct pixman_view_state,
+			  view_destroy_listener);
+
+	wl_list_remove(&vs->view_destroy_listener.link);
+	if (vs->alpha_mask)
+		pixman_image_unref(vs->alpha_mask);
+	free(vs);
+}
+
+/** Get a solid mask image for the alpha of a view
+ *
+ * The mask is cached with the view and only recreated when the alpha
+ * changes. With worker threads every caller gets its own image, like in
+ * surface_state_get_image().
+ */
+static pixman_image_t *
+view_get_alpha_mask(struct pixman_renderer *pr, struct weston_view *view)
+{
+	struct pixman_view_state *vs;
+	struct wl_listener *listener;
+	pixman_color_t mask = { 0, };
+
+	mask.alpha = 0xffff * view->alpha;
+
+	if (pr->workers.count > 0)
+		return pixman_image_create_solid_fill(&mask);
+
+	listener = wl_signal_get(&view->destroy_signal,
+				 view_state_handle_view_destroy);
+	if (listener) {
+		vs = container_of(listener, struct pixman_view_state,
+				  view_destroy_listener);
+	} else {
+		vs = zalloc(sizeof *vs);
+		if (!vs)
+			return pixman_image_create_solid_fill(&mask);
+
+		vs->view_destroy_listener.notify =
+			view_state_handle_view_destroy;
+		wl_signal_add(&view->destroy_signal,
+			      &vs->view_destroy_listener);
+	}
+
+	if (!vs->alpha_mask || vs->alpha != mask.alpha) {
+		if (vs->alpha_mask)
+			pixman_image_unref(vs->alpha_mask);
+		vs->alpha_mask = pixman_image_create_solid_fill(&mask);
+		vs->alpha = mask.alpha;
+	}
+
+	return pixman_image_ref(vs->alpha_mask);
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
@@ -326,6 +523,7 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       pixman_image_t *target,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -333,15 +531,14 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
-	pixman_color_t mask = { 0, };
 
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(target, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -350,45 +547,44 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	else
 		filter = PIXMAN_FILTER_NEAREST;
 
-	if (ps->buffer_ref.buffer)
-		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
+	shm_buffer_begin_access(pr, ps->buffer_ref.buffer);
+	src_image = surface_state_get_image(pr, ps);
 
-	if (ev->alpha < 1.0) {
-		mask.alpha = 0xffff * ev->alpha;
-		mask_image = pixman_image_create_solid_fill(&mask);
-	} else {
+	if (ev->alpha < 1.0)
+		mask_image = view_get_alpha_mask(pr, ev);
+	else
 		mask_image = NULL;
-	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src_image, mask_image, target,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src_image, mask_image,
+				target, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
-	if (ps->buffer_ref.buffer)
-		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
+	pixman_image_unref(src_image);
+	shm_buffer_end_access(pr, ps->buffer_ref.buffer);
 
 	if (pr->repaint_debug)
 		pixman_image_composite32(PIXMAN_OP_OVER,
 					 pr->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target), /* width */
+					 pixman_image_get_height (target) /* height */);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (target, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     pixman_image_t *target,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -416,8 +612,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -427,7 +623,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, target, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -438,6 +634,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 pixman_image_t *target,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -463,7 +660,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, target, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -473,6 +670,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  pixman_image_t *target,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -483,6 +681,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!ps->image)
 		return;
 
+	/* Opaque views above hide all of it */
+	if (weston_view_is_occluded(ev, output))
+		return;
+
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
 				  &ev->transform.boundingbox, damage);
@@ -499,7 +701,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, target, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -508,27 +710,28 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, target, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, pixman_image_t *target,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, target, damage);
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+copy_to_hw_buffer(struct weston_output *output, pixman_image_t *src,
+		  pixman_image_t *hw_buffer, pixman_region32_t *region)
 {
-	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t output_region;
 
 	pixman_region32_init(&output_region);
@@ -536,33 +739,191 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 
 	region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	pixman_image_set_clip_region32 (hw_buffer, &output_region);
 	pixman_region32_fini(&output_region);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 src, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 hw_buffer, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 pixman_image_get_width (hw_buffer), /* width */
+				 pixman_image_get_height (hw_buffer) /* height */);
+
+	pixman_image_set_clip_region32 (hw_buffer, NULL);
+}
+
+/** Composite and copy one horizontal band of the output damage
+ *
+ * Every band paints through its own images wrapping the shadow and
+ * hardware buffers, so bands can be painted by different threads. Each
+ * pixel is computed exactly as in a single pass over the whole damage.
+ * Outputs without a shadow are composited straight into the hardware
+ * buffer.
+ */
+static void
+repaint_band(struct pixman_renderer *pr, int band)
+{
+	struct weston_output *output = pr->workers.output;
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_box32_t *extents = &pr->workers.extents;
+	pixman_region32_t band_damage;
+	pixman_image_t *shadow, *hw_buffer;
+	int height, y1, y2;
+
+	height = extents->y2 - extents->y1;
+	y1 = extents->y1 + height * band / pr->workers.band_count;
+	y2 = extents->y1 + height * (band + 1) / pr->workers.band_count;
+
+	pixman_region32_init_rect(&band_damage, extents->x1, y1,
+				  extents->x2 - extents->x1, y2 - y1);
+	pixman_region32_intersect(&band_damage, &band_damage,
+				  pr->workers.damage);
+
+	if (pixman_region32_not_empty(&band_damage) && po->shadow_image) {
+		shadow = image_wrap(po->shadow_image);
+		hw_buffer = image_wrap(po->hw_buffer);
+
+		repaint_surfaces(output, shadow, &band_damage);
+		copy_to_hw_buffer(output, shadow, hw_buffer, &band_damage);
+
+		pixman_image_unref(hw_buffer);
+		pixman_image_unref(shadow);
+	} else if (pixman_region32_not_empty(&band_damage)) {
+		hw_buffer = image_wrap(po->hw_buffer);
+		repaint_surfaces(output, hw_buffer, &band_damage);
+		pixman_image_unref(hw_buffer);
+	}
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	pixman_region32_fini(&band_damage);
+}
+
+/* Called with the worker mutex held, returns with it held. */
+static void
+repaint_bands(struct pixman_renderer *pr)
+{
+	struct timespec begin, end;
+	int band;
+
+	while (pr->workers.next_band < pr->workers.band_count) {
+		band = pr->workers.next_band++;
+		pthread_mutex_unlock(&pr->workers.mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		repaint_band(pr, band);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timespec_sub(&end, &end, &begin);
+
+		pthread_mutex_lock(&pr->workers.mutex);
+		pr->workers.busy_nsec += timespec_to_nsec(&end);
+		if (++pr->workers.bands_done == pr->workers.band_count)
+			pthread_cond_signal(&pr->workers.done_cond);
+	}
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	struct pixman_renderer *pr = data;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&pr->workers.mutex);
+	for (;;) {
+		while (!pr->workers.quit &&
+		       pr->workers.generation == generation)
+			pthread_cond_wait(&pr->workers.work_cond,
+					  &pr->workers.mutex);
+		if (pr->workers.quit)
+			break;
+
+		generation = pr->workers.generation;
+		repaint_bands(pr);
+	}
+	pthread_mutex_unlock(&pr->workers.mutex);
+
+	return NULL;
+}
+
+static uint64_t
+repaint_output_parallel(struct weston_output *output,
+			pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct weston_view *view;
+	int height, band_count;
+	uint64_t busy_nsec;
+
+	/* get_surface_state() creates missing surface states, which must
+	 * not happen concurrently on the worker threads. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	height = pixman_region32_extents(damage)->y2 -
+		 pixman_region32_extents(damage)->y1;
+	band_count = (pr->workers.count + 1) * PIXMAN_BANDS_PER_THREAD;
+	if (band_count > height)
+		band_count = height;
+
+	pthread_mutex_lock(&pr->workers.mutex);
+	pr->workers.output = output;
+	pr->workers.damage = damage;
+	pr->workers.extents = *pixman_region32_extents(damage);
+	pr->workers.band_count = band_count;
+	pr->workers.next_band = 0;
+	pr->workers.bands_done = 0;
+	pr->workers.busy_nsec = 0;
+	pr->workers.generation++;
+	pthread_cond_broadcast(&pr->workers.work_cond);
+
+	/* The compositor thread paints bands too, instead of idling. */
+	repaint_bands(pr);
+	while (pr->workers.bands_done < pr->workers.band_count)
+		pthread_cond_wait(&pr->workers.done_cond, &pr->workers.mutex);
+
+	busy_nsec = pr->workers.busy_nsec;
+	pr->workers.output = NULL;
+	pr->workers.damage = NULL;
+	pthread_mutex_unlock(&pr->workers.mutex);
+
+	return busy_nsec;
 }
 
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	struct timespec begin, end;
+	uint64_t busy_nsec = 0;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	/* The debug overlay shares one solid image, paint it serially. */
+	if (pr->workers.count > 0 && !pr->repaint_debug &&
+	    pixman_region32_not_empty(output_damage)) {
+		busy_nsec = repaint_output_parallel(output, output_damage);
+	} else if (po->shadow_image) {
+		repaint_surfaces(output, po->shadow_image, output_damage);
+		copy_to_hw_buffer(output, po->shadow_image, po->hw_buffer,
+				  output_damage);
+	} else {
+		repaint_surfaces(output, po->hw_buffer, output_damage);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespec_sub(&end, &end, &begin);
+
+	po->stats.frames++;
+	po->stats.repaint_nsec += timespec_to_nsec(&end);
+	po->stats.busy_nsec += busy_nsec ? busy_nsec : timespec_to_nsec(&end);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -592,6 +953,76 @@ buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 	ps->buffer_destroy_listener.notify = NULL;
 }
 
+static void
+pixman_buffer_state_handle_buffer_destroy(struct wl_listener *listener,
+					  void *data)
+{
+	struct pixman_buffer_state *bs;
+
+	bs = container_of(listener, struct pixman_buffer_state,
+			  buffer_destroy_listener);
+
+	wl_list_remove(&bs->buffer_destroy_listener.link);
+	if (bs->image)
+		pixman_image_unref(bs->image);
+	free(bs);
+}
+
+/** Get the cached pixman image of a wl_shm buffer
+ *
+ * The image is created on the first attach of the buffer and reused
+ * until the buffer is destroyed, unless its format, size, stride or
+ * data pointer changed, the latter happening when the pool is resized.
+ */
+static pixman_image_t *
+buffer_get_image(struct weston_buffer *buffer,
+		 pixman_format_code_t format)
+{
+	struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+	struct pixman_buffer_state *bs;
+	struct wl_listener *listener;
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	void *data = wl_shm_buffer_get_data(shm_buffer);
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 pixman_buffer_state_handle_buffer_destroy);
+	if (listener) {
+		bs = container_of(listener, struct pixman_buffer_state,
+				  buffer_destroy_listener);
+	} else {
+		bs = zalloc(sizeof *bs);
+		if (!bs)
+			return NULL;
+
+		bs->buffer_destroy_listener.notify =
+			pixman_buffer_state_handle_buffer_destroy;
+		wl_signal_add(&buffer->destroy_signal,
+			      &bs->buffer_destroy_listener);
+	}
+
+	if (bs->image && bs->format == format &&
+	    bs->width == buffer->width && bs->height == buffer->height &&
+	    bs->stride == stride && bs->data == data)
+		return pixman_image_ref(bs->image);
+
+	if (bs->image)
+		pixman_image_unref(bs->image);
+
+	bs->image = pixman_image_create_bits(format,
+					     buffer->width, buffer->height,
+					     data, stride);
+	bs->format = format;
+	bs->width = buffer->width;
+	bs->height = buffer->height;
+	bs->stride = stride;
+	bs->data = data;
+
+	if (!bs->image)
+		return NULL;
+
+	return pixman_image_ref(bs->image);
+}
+
 static void
 pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 {
@@ -643,10 +1074,12 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
 
-	ps->image = pixman_image_create_bits(pixman_format,
-		buffer->width, buffer->height,
-		wl_shm_buffer_get_data(shm_buffer),
-		wl_shm_buffer_get_stride(shm_buffer));
+	ps->image = buffer_get_image(buffer, pixman_format);
+	if (!ps->image) {
+		weston_log("Failed to create a pixman image for a buffer\n");
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		return;
+	}
 
 	ps->buffer_destroy_listener.notify =
 		buffer_state_handle_buffer_destroy;
@@ -734,6 +1167,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -743,11 +1177,77 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
+static void
+destroy_worker_threads(struct pixman_renderer *pr)
+{
+	int i;
+
+	pthread_mutex_lock(&pr->workers.mutex);
+	pr->workers.quit = true;
+	pthread_cond_broadcast(&pr->workers.work_cond);
+	pthread_mutex_unlock(&pr->workers.mutex);
+
+	for (i = 0; i < pr->workers.count; i++)
+		pthread_join(pr->workers.threads[i], NULL);
+	free(pr->workers.threads);
+	pr->workers.threads = NULL;
+	pr->workers.count = 0;
+
+	pthread_mutex_destroy(&pr->workers.mutex);
+	pthread_mutex_destroy(&pr->workers.shm_mutex);
+	pthread_cond_destroy(&pr->workers.work_cond);
+	pthread_cond_destroy(&pr->workers.done_cond);
+}
+
+static int
+setup_worker_threads(struct pixman_renderer *pr, int threads)
+{
+	sigset_t mask, old_mask;
+	int i;
+
+	pthread_mutex_init(&pr->workers.mutex, NULL);
+	pthread_mutex_init(&pr->workers.shm_mutex, NULL);
+	pthread_cond_init(&pr->workers.work_cond, NULL);
+	pthread_cond_init(&pr->workers.done_cond, NULL);
+
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > PIXMAN_MAX_THREADS)
+		threads = PIXMAN_MAX_THREADS;
+	if (threads <= 1)
+		return 0;
+
+	pr->workers.threads = calloc(threads - 1, sizeof *pr->workers.threads);
+	if (!pr->workers.threads)
+		return -1;
+
+	/* Leave signal handling to the compositor thread, the workers
+	 * only need SIGBUS for the shm access protection. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&pr->workers.threads[i], NULL,
+				   worker_thread_function, pr) != 0)
+			break;
+		pr->workers.count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	weston_log("Pixman renderer compositing with %d threads\n",
+		   pr->workers.count + 1);
+
+	return 0;
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	destroy_worker_threads(pr);
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -778,6 +1278,7 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 {
 	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	struct pixman_renderer *pr = get_renderer(surface->compositor);
 	struct pixman_surface_state *ps = get_surface_state(surface);
 	pixman_image_t *out_buf;
 
@@ -787,6 +1288,7 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	out_buf = pixman_image_create_bits(format, width, height,
 					   target, width * bytespp);
 
+	shm_buffer_begin_access(pr, ps->buffer_ref.buffer);
 	pixman_image_set_transform(ps->image, NULL);
 	pixman_image_composite32(PIXMAN_OP_SRC,
 				 ps->image,    /* src */
@@ -796,6 +1298,48 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 				 0, 0,         /* mask_x, mask_y */
 				 0, 0,         /* dest_x, dest_y */
 				 width, height);
+	shm_buffer_end_access(pr, ps->buffer_ref.buffer);
+
+	pixman_image_unref(out_buf);
+
+	return 0;
+}
+
+static int
+pixman_renderer_surface_copy_content_scaled(struct weston_surface *surface,
+					    void *target, size_t size,
+					    int width, int height)
+{
+	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
+	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	struct pixman_renderer *pr = get_renderer(surface->compositor);
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	pixman_transform_t transform;
+	pixman_image_t *out_buf;
+
+	if (!ps->image)
+		return -1;
+
+	out_buf = pixman_image_create_bits(format, width, height,
+					   target, width * bytespp);
+
+	pixman_transform_init_scale(&transform,
+		pixman_int_to_fixed(pixman_image_get_width(ps->image)) / width,
+		pixman_int_to_fixed(pixman_image_get_height(ps->image)) / height);
+	pixman_image_set_transform(ps->image, &transform);
+	pixman_image_set_filter(ps->image, PIXMAN_FILTER_GOOD, NULL, 0);
+	shm_buffer_begin_access(pr, ps->buffer_ref.buffer);
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 ps->image,    /* src */
+				 NULL,         /* mask */
+				 out_buf,      /* dest */
+				 0, 0,         /* src_x, src_y */
+				 0, 0,         /* mask_x, mask_y */
+				 0, 0,         /* dest_x, dest_y */
+				 width, height);
+	shm_buffer_end_access(pr, ps->buffer_ref.buffer);
+	pixman_image_set_transform(ps->image, NULL);
+	pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
 
 	pixman_image_unref(out_buf);
 
@@ -832,6 +1376,12 @@ pixman_renderer_init(struct weston_compositor *ec)
 	if (renderer == NULL)
 		return -1;
 
+	if (setup_worker_threads(renderer, ec->pixman_threads) < 0) {
+		destroy_worker_threads(renderer);
+		free(renderer);
+		return -1;
+	}
+
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
@@ -844,6 +1394,8 @@ pixman_renderer_init(struct weston_compositor *ec)
 		pixman_renderer_surface_get_content_size;
 	renderer->base.surface_copy_content =
 		pixman_renderer_surface_copy_content;
+	renderer->base.surface_copy_content_scaled =
+		pixman_renderer_surface_copy_content_scaled;
 	ec->renderer = &renderer->base;
 	ec->capabilities |= WESTON_CAP_ROTATION_ANY;
 	ec->capabilities |= WESTON_CAP_CAPTURE_YFLIP;
@@ -875,8 +1427,17 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+/** Create the renderer state of an output
+ *
+ * \param output The output to composite with the pixman renderer.
+ * \param flags PIXMAN_RENDERER_OUTPUT_USE_SHADOW to composite into a
+ * shadow image in system memory and copy the damage to the buffer set
+ * with pixman_renderer_output_set_buffer(). Without it the views are
+ * composited straight into that buffer, which saves the copy but reads
+ * the buffer back when blending.
+ */
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
 	int w, h;
@@ -885,6 +1446,11 @@ pixman_renderer_output_create(struct weston_output *output)
 	if (po == NULL)
 		return -1;
 
+	if (!(flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW)) {
+		output->renderer_state = po;
+		return 0;
+	}
+
 	/* set shadow image transformation */
 	w = output->current_mode->width;
 	h = output->current_mode->height;
@@ -911,12 +1477,33 @@ pixman_renderer_output_create(struct weston_output *output)
 	return 0;
 }
 
+/** Read and reset the composition statistics of an output
+ *
+ * \param output The output, which must use the pixman renderer.
+ * \param stats Filled with the statistics since the previous call.
+ *
+ * The ratio of stats->busy_nsec to stats->repaint_nsec is the average
+ * number of threads that were compositing during a repaint.
+ */
+WL_EXPORT void
+pixman_renderer_output_take_stats(struct weston_output *output,
+				  struct pixman_renderer_output_stats *stats)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+
+	*stats = po->stats;
+	stats->threads = pr->workers.count + 1;
+	memset(&po->stats, 0, sizeof po->stats);
+}
+
 WL_EXPORT void
 pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
@@ -27,14 +27,29 @@
 
 #include "compositor.h"
 
+struct pixman_renderer_output_stats {
+	int threads;
+	uint32_t frames;
+	uint64_t repaint_nsec;	/* wall clock time spent compositing */
+	uint64_t busy_nsec;	/* summed over all compositing threads */
+};
+
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+enum pixman_renderer_output_flags {
+	PIXMAN_RENDERER_OUTPUT_USE_SHADOW = (1 << 0),
+};
+
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
 
 void
 pixman_renderer_output_destroy(struct weston_output *output);
+
+void
+pixman_renderer_output_take_stats(struct weston_output *output,
+				  struct pixman_renderer_output_stats *stats);
@@ -0,0 +1,240 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "plane-policy.h"
+
+/* Scanning a pixel out of an overlay is this many times cheaper than
+ * compositing it. */
+#define PLANE_POLICY_SCANOUT_DIVISOR	16
+
+/* The composition cost of moving a view to an overlay, in frames of its
+ * area per second. A view only moves when it saves more than this, and
+ * only leaves when it stops saving anything. */
+#define PLANE_POLICY_PROMOTE_HZ		4
+
+/* How long a view that is no candidate anymore is remembered. */
+#define PLANE_POLICY_FORGET_MSEC	1000
+
+struct plane_policy_entry {
+	const void *key;
+	const void *content;
+	int64_t last_seen;
+	int64_t last_update;
+	double rate;
+	int64_t score;
+	uint32_t screen_area;
+	bool candidate;
+	bool allowed;
+	bool placed;
+};
+
+struct plane_policy {
+	struct plane_policy_entry *entries;
+	int count;
+	int size;
+
+	int64_t now;
+	uint32_t refresh_mhz;
+};
+
+struct plane_policy *
+plane_policy_create(void)
+{
+	return calloc(1, sizeof(struct plane_policy));
+}
+
+void
+plane_policy_destroy(struct plane_policy *policy)
+{
+	free(policy->entries);
+	free(policy);
+}
+
+void
+plane_policy_begin(struct plane_policy *policy, int64_t now_msec,
+		   uint32_t refresh_mhz)
+{
+	int i;
+
+	policy->now = now_msec;
+	policy->refresh_mhz = refresh_mhz;
+
+	for (i = 0; i < policy->count; i++) {
+		policy->entries[i].candidate = false;
+		policy->entries[i].allowed = false;
+	}
+}
+
+static int
+plane_policy_lookup(struct plane_policy *policy, const void *key)
+{
+	struct plane_policy_entry *entries;
+	int i, size;
+
+	for (i = 0; i < policy->count; i++)
+		if (policy->entries[i].key == key)
+			return i;
+
+	if (policy->count == policy->size) {
+		size = policy->size ? policy->size * 2 : 16;
+		entries = realloc(policy->entries, size * sizeof *entries);
+		if (!entries)
+			return -1;
+		policy->entries = entries;
+		policy->size = size;
+	}
+
+	i = policy->count++;
+	memset(&policy->entries[i], 0, sizeof policy->entries[i]);
+	policy->entries[i].key = key;
+	policy->entries[i].last_update = policy->now;
+
+	return i;
+}
+
+/* Follows the update rate with a moving average, and lets it decay as
+ * soon as the view is idle for longer than its update period. */
+static void
+plane_policy_entry_update(struct plane_policy_entry *entry, int64_t now,
+			  bool updated)
+{
+	int64_t since = now - entry->last_update;
+
+	if (since <= 0)
+		return;
+
+	if (updated) {
+		entry->rate += (1000.0 / since - entry->rate) / 4;
+		entry->last_update = now;
+	} else if (1000.0 / since < entry->rate) {
+		entry->rate = 1000.0 / since;
+	}
+}
+
+int
+plane_policy_add(struct plane_policy *policy, const void *key,
+		 const void *content, bool damaged,
+		 uint32_t screen_area, uint32_t buffer_area)
+{
+	struct plane_policy_entry *entry;
+	double refresh_hz = policy->refresh_mhz / 1000.0;
+	double saved, cost;
+	int i;
+
+	i = plane_policy_lookup(policy, key);
+	if (i < 0)
+		return -1;
+	entry = &policy->entries[i];
+
+	plane_policy_entry_update(entry, policy->now,
+				  damaged || content != entry->content);
+	entry->content = content;
+	entry->last_seen = policy->now;
+	entry->screen_area = screen_area;
+
+	/* Every update of a view on the primary plane composites its
+	 * area again, while an overlay scans its whole buffer out every
+	 * refresh instead. */
+	saved = (double)screen_area * entry->rate;
+	cost = (double)buffer_area * refresh_hz / PLANE_POLICY_SCANOUT_DIVISOR;
+	if (!entry->placed)
+		cost += (double)screen_area * PLANE_POLICY_PROMOTE_HZ;
+
+	entry->score = saved - cost;
+	entry->candidate = true;
+	entry->placed = false;
+
+	return i;
+}
+
+void
+plane_policy_choose(struct plane_policy *policy, int planes)
+{
+	struct plane_policy_entry *best;
+	int i;
+
+	while (planes-- > 0) {
+		best = NULL;
+		for (i = 0; i < policy->count; i++) {
+			struct plane_policy_entry *entry = &policy->entries[i];
+
+			if (!entry->candidate || entry->allowed ||
+			    entry->score <= 0)
+				continue;
+
+			if (!best || entry->score > best->score)
+				best = entry;
+		}
+
+		if (!best)
+			break;
+		best->allowed = true;
+	}
+}
+
+bool
+plane_policy_allowed(struct plane_policy *policy, int handle)
+{
+	return handle >= 0 && policy->entries[handle].allowed;
+}
+
+int64_t
+plane_policy_score(struct plane_policy *policy, int handle)
+{
+	return handle >= 0 ? policy->entries[handle].score : 0;
+}
+
+void
+plane_policy_placed(struct plane_policy *policy, int handle)
+{
+	if (handle >= 0)
+		policy->entries[handle].placed = true;
+}
+
+void
+plane_policy_end(struct plane_policy *policy)
+{
+	struct plane_policy_entry *entry;
+	int i = 0;
+
+	while (i < policy->count) {
+		entry = &policy->entries[i];
+
+		if (!entry->candidate)
+			entry->placed = false;
+
+		if (policy->now - entry->last_seen > PLANE_POLICY_FORGET_MSEC) {
+			*entry = policy->entries[--policy->count];
+			continue;
+		}
+
+		i++;
+	}
+}
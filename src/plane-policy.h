@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PLANE_POLICY_H
+#define WESTON_PLANE_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Decides which views of an output are worth a hardware overlay plane.
+ *
+ * Each frame the backend adds the views that could go on an overlay,
+ * and the policy ranks them by the composition work an overlay would
+ * save against the cost of scanning out their buffer. Views are
+ * tracked across frames by a key, so their update rate is known, and
+ * a view has to be clearly better than the one it would replace before
+ * it gets a plane, which keeps views from bouncing between an overlay
+ * and the primary plane.
+ *
+ * The policy knows nothing about KMS or weston, so it can be tested
+ * with a made up description of the planes.
+ */
+struct plane_policy;
+
+struct plane_policy *
+plane_policy_create(void);
+
+void
+plane_policy_destroy(struct plane_policy *policy);
+
+/* Starts a frame. now_msec is a monotonic time, refresh_mhz the refresh
+ * rate of the output. */
+void
+plane_policy_begin(struct plane_policy *policy, int64_t now_msec,
+		   uint32_t refresh_mhz);
+
+/* Adds a view that could go on an overlay this frame, and returns a
+ * handle for it valid until plane_policy_end(). content changes when
+ * the view shows new content, e.g. a new buffer, and damaged tells
+ * about new content in the same buffer. */
+int
+plane_policy_add(struct plane_policy *policy, const void *key,
+		 const void *content, bool damaged,
+		 uint32_t screen_area, uint32_t buffer_area);
+
+/* Allows the best candidates onto at most planes overlays. */
+void
+plane_policy_choose(struct plane_policy *policy, int planes);
+
+bool
+plane_policy_allowed(struct plane_policy *policy, int handle);
+
+int64_t
+plane_policy_score(struct plane_policy *policy, int handle);
+
+/* Tells that the candidate ended up on an overlay. */
+void
+plane_policy_placed(struct plane_policy *policy, int handle);
+
+/* Ends the frame, and forgets the views not seen for a while. */
+void
+plane_policy_end(struct plane_policy *policy);
+
+#endif /* WESTON_PLANE_POLICY_H */
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "region-bands.h"
+
+/*
+ * The rectangles of a band share y1 and y2 and are sorted by x1 without
+ * overlapping. A rectangle can only continue an output rectangle that
+ * ends where its band starts, and those are the rectangles of the
+ * previous band, in the same order. So walking the two bands side by
+ * side finds every merge in linear time.
+ */
+int
+compress_bands(const pixman_box32_t *inrects, int nrects,
+	       pixman_box32_t **outrects)
+{
+	pixman_box32_t *out, *above;
+	int *prev, *cur, *tmp;
+	int i, j, k, band_end, nout, nprev, ncur;
+
+	*outrects = NULL;
+	if (nrects == 0)
+		return 0;
+
+	out = malloc(nrects * sizeof *out);
+	prev = malloc(nrects * sizeof *prev);
+	cur = malloc(nrects * sizeof *cur);
+	if (!out || !prev || !cur) {
+		free(out);
+		free(prev);
+		free(cur);
+		return -1;
+	}
+
+	nout = 0;
+	nprev = 0;
+	for (i = 0; i < nrects; i = band_end) {
+		for (band_end = i + 1; band_end < nrects; band_end++)
+			if (inrects[band_end].y1 != inrects[i].y1)
+				break;
+
+		ncur = 0;
+		k = 0;
+		for (j = i; j < band_end; j++) {
+			while (k < nprev && out[prev[k]].x1 < inrects[j].x1)
+				k++;
+
+			above = k < nprev ? &out[prev[k]] : NULL;
+			if (above && above->y2 == inrects[j].y1 &&
+			    above->x1 == inrects[j].x1 &&
+			    above->x2 == inrects[j].x2) {
+				above->y2 = inrects[j].y2;
+				cur[ncur++] = prev[k++];
+			} else {
+				out[nout] = inrects[j];
+				cur[ncur++] = nout++;
+			}
+		}
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+		nprev = ncur;
+	}
+
+	free(prev);
+	free(cur);
+
+	*outrects = out;
+	return nout;
+}
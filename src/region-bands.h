@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_REGION_BANDS_H
+#define WESTON_REGION_BANDS_H
+
+#include <pixman.h>
+
+/*
+ * Merges the rectangles of a pixman region that continue each other
+ * vertically. inrects must be in the y-x banded order that
+ * pixman_region32_rectangles() returns. Each rectangle is merged into
+ * the rectangle with the same horizontal extent right above it, if
+ * any, so that e.g. a column of damaged terminal lines cut into bands
+ * by other damage turns back into a single rectangle.
+ *
+ * Returns the number of rectangles stored in *outrects, which the
+ * caller frees, or -1 when out of memory.
+ */
+int
+compress_bands(const pixman_box32_t *inrects, int nrects,
+	       pixman_box32_t **outrects);
+
+#endif /* WESTON_REGION_BANDS_H */
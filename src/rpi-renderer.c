@@ -1430,6 +1430,8 @@ rpi_renderer_flush_damage(struct weston_surface *base)
 	if (ret)
 		weston_log("%s error: updating Dispmanx resource failed.\n",
 			   __func__);
+	else if (pixman_region32_not_empty(&base->damage))
+		weston_surface_count_upload(base);
 
 	weston_buffer_reference(&surface->buffer_ref, NULL);
 }
@@ -72,7 +72,14 @@ struct shared_output {
 		struct wl_list free_buffers;
 	} shm;
 
-	int cache_dirty;
+	/* Captured and waiting for the parent's frame callback. Later
+	 * repaints update it in place until it is sent. */
+	struct ss_shm_buffer *ready;
+	/* Changed since the last buffer sent, in output coordinates */
+	pixman_region32_t surface_damage;
+
+	/* Only with an output transform or scale, see
+	 * shared_output_capture_cached() */
 	pixman_image_t *cache_image;
 	uint32_t *tmp_data;
 	size_t tmp_data_size;
@@ -431,10 +438,22 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		wl_list_for_each(sb, &so->shm.buffers, link)
 			sb->output = NULL;
 
+		/* The ready buffer is not in use by the parent. */
+		if (so->ready)
+			ss_shm_buffer_destroy(so->ready);
+		so->ready = NULL;
+
 		so->shm.width = width;
 		so->shm.height = height;
+
+		pixman_region32_fini(&so->surface_damage);
+		pixman_region32_init_rect(&so->surface_damage,
+					  0, 0, width, height);
 	}
 
+	if (so->ready)
+		return so->ready;
+
 	if (!wl_list_empty(&so->shm.free_buffers)) {
 		sb = container_of(so->shm.free_buffers.next,
 				  struct ss_shm_buffer, free_link);
@@ -588,7 +607,7 @@ shared_output_ensure_tmp_data(struct shared_output *so,
 }
 
 static void
-shared_output_update(struct shared_output *so);
+shared_output_send(struct shared_output *so);
 
 static void
 shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
@@ -601,31 +620,156 @@ shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
 	wl_callback_destroy(cb);
 	so->parent.frame_cb = NULL;
 
-	shared_output_update(so);
+	shared_output_send(so);
 }
 
 static const struct wl_callback_listener shared_output_frame_listener = {
 	shared_output_frame_callback
 };
 
+/* Sends the ready buffer, unless the parent has not shown the previous
+ * one yet. The next repaint is captured meanwhile. */
 static void
-shared_output_update(struct shared_output *so)
+shared_output_send(struct shared_output *so)
 {
-	struct ss_shm_buffer *sb;
+	struct ss_shm_buffer *sb = so->ready;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
+	if (sb == NULL || so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
+	r = pixman_region32_rectangles(&so->surface_damage, &nrects);
+	for (i = 0; i < nrects; ++i)
+		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
+				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+
+	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
+
+	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
+	wl_callback_add_listener(so->parent.frame_cb,
+				 &shared_output_frame_listener, so);
+
+	wl_surface_commit(so->parent.surface);
+	wl_callback_destroy(wl_display_sync(so->parent.display));
+	wl_display_flush(so->parent.display);
+
+	pixman_region32_clear(&so->surface_damage);
+	so->ready = NULL;
+}
+
+/* Reads rectangles of the output framebuffer into an image of the same
+ * size. A y-flipped capture is read into tmp_data and blitted to its
+ * place, the blit undoing the flip. Otherwise the rows are read straight
+ * into place: whole rows in one go, narrower rectangles one row at a
+ * time, as read_pixels() packs its rows tightly. */
+static int
+shared_output_read_rects(struct shared_output *so, pixman_region32_t *region,
+			 uint32_t *dst, int dst_stride)
+{
+	struct weston_renderer *renderer = so->output->compositor->renderer;
+	int32_t x, y, width, height, j;
+	int i, nrects, do_yflip;
+	pixman_box32_t *r;
+
+	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	if (do_yflip && shared_output_ensure_tmp_data(so, region) < 0)
+		return -1;
+
+	r = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		x = r[i].x1;
+		y = r[i].y1;
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		if (do_yflip) {
+			renderer->read_pixels(so->output, PIXMAN_a8r8g8b8,
+				so->tmp_data, x,
+				so->output->current_mode->height - r[i].y2,
+				width, height);
+
+			pixman_blt(so->tmp_data, dst, -width, dst_stride,
+				   32, 32, 0, 1 - height, x, y, width, height);
+		} else if (width == dst_stride) {
+			renderer->read_pixels(so->output, PIXMAN_a8r8g8b8,
+				dst + y * dst_stride, x, y, width, height);
+		} else {
+			for (j = 0; j < height; j++)
+				renderer->read_pixels(so->output,
+					PIXMAN_a8r8g8b8,
+					dst + (y + j) * dst_stride + x,
+					x, y + j, width, 1);
+		}
 	}
 
+	return 0;
+}
+
+/* Without an output transform or scale the buffer has the layout of the
+ * framebuffer, so its stale parts are read straight into it. */
+static int
+shared_output_capture_direct(struct shared_output *so,
+			     struct ss_shm_buffer *sb)
+{
+	/* Not kept up to date meanwhile. */
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
+	so->cache_image = NULL;
+
+	return shared_output_read_rects(so, &sb->damage, sb->data,
+					so->shm.width);
+}
+
+/* Otherwise the framebuffer is mirrored in cache_image, from which the
+ * stale parts of the buffer are composited with the output transform. */
+static int
+shared_output_capture_cached(struct shared_output *so,
+			     struct ss_shm_buffer *sb,
+			     pixman_region32_t *output_damage)
+{
+	pixman_region32_t damage;
+	pixman_transform_t transform;
+	int32_t width, height;
+	int ret;
+
+	/* Transform to buffer coordinates */
+	pixman_region32_init(&damage);
+	weston_transformed_region(so->output->width, so->output->height,
+				  so->output->transform,
+				  so->output->current_scale,
+				  output_damage, &damage);
+
+	width = so->output->current_mode->width;
+	height = so->output->current_mode->height;
+
+	if (!so->cache_image ||
+	    pixman_image_get_width(so->cache_image) != width ||
+	    pixman_image_get_height(so->cache_image) != height) {
+		if (so->cache_image)
+			pixman_image_unref(so->cache_image);
+
+		so->cache_image =
+			pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 width, height, NULL,
+						 width * 4);
+		if (!so->cache_image) {
+			pixman_region32_fini(&damage);
+			return -1;
+		}
+
+		pixman_region32_fini(&damage);
+		pixman_region32_init_rect(&damage, 0, 0, width, height);
+	}
+
+	ret = shared_output_read_rects(so, &damage,
+				       pixman_image_get_data(so->cache_image),
+				       width);
+	pixman_region32_fini(&damage);
+	if (ret < 0)
+		return -1;
+
 	output_compute_transform(so->output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
 
@@ -649,27 +793,9 @@ shared_output_update(struct shared_output *so)
 				 so->output->width, /* width */
 				 so->output->height /* height */);
 
-	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
-	for (i = 0; i < nrects; ++i)
-		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
-				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
-
-	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
-
-	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
-	wl_callback_add_listener(so->parent.frame_cb,
-				 &shared_output_frame_listener, so);
-
-	wl_surface_commit(so->parent.surface);
-	wl_callback_destroy(wl_display_sync(so->parent.display));
-	wl_display_flush(so->parent.display);
-
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	return 0;
 }
 
 static void
@@ -784,6 +910,10 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+/* Every repaint is captured right away, into the buffer waiting to be
+ * sent or a free one, so the capture of a frame overlaps the transfer of
+ * the previous one. Only what changed since a buffer was last filled is
+ * read back into it. */
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
@@ -791,10 +921,7 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		container_of(listener, struct shared_output, frame_listener);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
-	pixman_box32_t *r;
-	uint32_t *cache_data;
+	int ret;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -805,74 +932,33 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 	/* Apply damage to all buffers */
 	wl_list_for_each(sb, &so->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	pixman_region32_union(&so->surface_damage, &so->surface_damage,
+			      &damage);
 
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
-
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
-			shared_output_destroy(so);
-			return;
-		}
-
+	sb = shared_output_get_shm_buffer(so);
+	if (sb == NULL) {
 		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
-	}
-
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
 		shared_output_destroy(so);
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
+	if (so->output->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	    so->output->current_scale == 1)
+		ret = shared_output_capture_direct(so, sb);
+	else
+		ret = shared_output_capture_cached(so, sb, &damage);
 
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
+	pixman_region32_fini(&damage);
 
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
+	if (ret < 0) {
+		shared_output_destroy(so);
+		return;
 	}
 
-	pixman_region32_fini(&damage);
-
-	so->cache_dirty = 1;
+	pixman_region32_clear(&sb->damage);
+	so->ready = sb;
 
-	shared_output_update(so);
+	shared_output_send(so);
 }
 
 static struct shared_output *
@@ -955,6 +1041,7 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	pixman_region32_init(&so->surface_damage);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -996,8 +1083,10 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
 	free(so->tmp_data);
+	pixman_region32_fini(&so->surface_damage);
 
 	free(so);
 }
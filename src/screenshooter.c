@@ -28,16 +28,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <sys/uio.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "compositor.h"
 #include "weston-screenshooter-server-protocol.h"
 #include "shared/helpers.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap/wcap-rle.h"
 
 struct screenshooter {
 	struct weston_compositor *ec;
@@ -52,35 +66,36 @@ struct screenshooter_frame_listener {
 	struct weston_buffer *buffer;
 	weston_screenshooter_done_func_t done;
 	void *data;
-};
-
-static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
 
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
+	/* The rectangle to capture, in output framebuffer pixels, and
+	 * whether it is scaled to the buffer size. */
+	int32_t x, y, width, height;
+	bool scale;
+};
 
 static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+copy_row_swap_RB(void *vdst, const void *vsrc, int bytes)
 {
 	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
+	const uint32_t *src = vsrc;
 	uint32_t *end = dst + bytes / 4;
 
+#ifdef __SSE2__
+	const __m128i ag = _mm_set1_epi32((int) 0xff00ff00);
+	const __m128i r = _mm_set1_epi32(0x00ff0000);
+	const __m128i b = _mm_set1_epi32(0x000000ff);
+	__m128i v;
+
+	for (; dst + 4 <= end; dst += 4, src += 4) {
+		v = _mm_loadu_si128((const __m128i *) src);
+		v = _mm_or_si128(_mm_and_si128(v, ag),
+				 _mm_or_si128(
+					_mm_and_si128(_mm_srli_epi32(v, 16), b),
+					_mm_and_si128(_mm_slli_epi32(v, 16), r)));
+		_mm_storeu_si128((__m128i *) dst, v);
+	}
+#endif
+
 	while (dst < end) {
 		uint32_t v = *src++;
 		/*                    A R G B */
@@ -91,32 +106,93 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 	}
 }
 
+/* dst and src may be the same row. */
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_row(void *dst, const void *src, int bytes, bool swap_rb)
 {
-	uint8_t *end;
+	if (swap_rb)
+		copy_row_swap_RB(dst, src, bytes);
+	else if (dst != src)
+		memcpy(dst, src, bytes);
+}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+/* Flips an image upside down in place, swapping R and B on the way if
+ * asked to, with only a small stack buffer. */
+static void
+flip_in_place(uint8_t *data, int height, int stride, int bytes, bool swap_rb)
+{
+	uint8_t tmp[1024];
+	uint8_t *top = data;
+	uint8_t *bottom = data + (height - 1) * stride;
+	int off, n;
+
+	for (; top < bottom; top += stride, bottom -= stride) {
+		for (off = 0; off < bytes; off += n) {
+			n = MIN(bytes - off, (int) sizeof tmp);
+			memcpy(tmp, top + off, n);
+			copy_row(top + off, bottom + off, n, swap_rb);
+			copy_row(bottom + off, tmp, n, swap_rb);
+		}
 	}
+
+	if (top == bottom)
+		copy_row(top, top, bytes, swap_rb);
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_image(uint8_t *dst, int dst_stride, uint8_t *src, int src_stride,
+	   int height, int bytes, bool yflip, bool swap_rb)
 {
-	uint8_t *end;
+	int i;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+	if (yflip) {
+		src += (height - 1) * src_stride;
+		src_stride = -src_stride;
 	}
+
+	for (i = 0; i < height; i++)
+		copy_row(dst + i * dst_stride, src + i * src_stride,
+			 bytes, swap_rb);
 }
 
+/* Scales an image read back by the renderer, after the flip and the
+ * swizzle, to the size of the client buffer. */
+static void
+scale_image(struct weston_buffer *buffer, pixman_format_code_t format,
+	    uint8_t *pixels, int32_t width, int32_t height)
+{
+	pixman_image_t *src, *dst;
+	pixman_transform_t transform;
+
+	src = pixman_image_create_bits(format, width, height,
+				       (uint32_t *) pixels, width * 4);
+	dst = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+			buffer->width, buffer->height,
+			wl_shm_buffer_get_data(buffer->shm_buffer),
+			wl_shm_buffer_get_stride(buffer->shm_buffer));
+
+	pixman_transform_init_scale(&transform,
+				    pixman_int_to_fixed(width) / buffer->width,
+				    pixman_int_to_fixed(height) /
+				    buffer->height);
+	pixman_image_set_transform(src, &transform);
+	pixman_image_set_filter(src, PIXMAN_FILTER_GOOD, NULL, 0);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+				 0, 0, 0, 0, 0, 0,
+				 buffer->width, buffer->height);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	pixman_image_unref(src);
+	pixman_image_unref(dst);
+}
+
+/* The renderer reads straight into the client buffer when its rows are
+ * packed like the ones read_pixels() writes, and the flip and swizzle
+ * are then done in place. Other buffers get the pixels through a
+ * temporary copy of the rectangle, which is also where a scaled capture
+ * is scaled from. */
 static void
 screenshooter_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -125,79 +201,117 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 			     struct screenshooter_frame_listener, listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	int32_t width, height, read_y;
+	int32_t stride, bytes;
+	uint8_t *pixels, *d;
+	bool yflip, swap_rb;
 
 	output->disable_planes--;
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
-
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
-		return;
-	}
-
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
-
-	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
-
-	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
 	switch (compositor->read_format) {
 	case PIXMAN_a8r8g8b8:
 	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
+		swap_rb = false;
 		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+		swap_rb = true;
 		break;
 	default:
-		break;
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+		free(l);
+		return;
+	}
+
+	/* The mode may have changed since the request. */
+	width = MIN(l->width, output->current_mode->width - l->x);
+	height = MIN(l->height, output->current_mode->height - l->y);
+	if (width <= 0 || height <= 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		free(l);
+		return;
 	}
 
-	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	read_y = yflip ? output->current_mode->height - l->y - height : l->y;
+	bytes = width * 4;
+	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
+
+	if (!l->scale && stride == bytes) {
+		wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+
+		if (compositor->renderer->read_pixels(output,
+					compositor->read_format, d,
+					l->x, read_y, width, height) == 0) {
+			if (yflip)
+				flip_in_place(d, height, stride, bytes,
+					      swap_rb);
+			else if (swap_rb)
+				copy_image(d, stride, d, stride, height, bytes,
+					   false, true);
+		}
+
+		wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	} else {
+		pixels = malloc(bytes * height);
+		if (pixels == NULL) {
+			l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+			free(l);
+			return;
+		}
+
+		compositor->renderer->read_pixels(output,
+				     compositor->read_format, pixels,
+				     l->x, read_y, width, height);
+
+		if (l->scale) {
+			if (yflip)
+				flip_in_place(pixels, height, bytes, bytes,
+					      swap_rb);
+			else if (swap_rb)
+				copy_image(pixels, bytes, pixels, bytes,
+					   height, bytes, false, true);
+			scale_image(l->buffer,
+				    PIXMAN_FORMAT_A(compositor->read_format) ?
+				    PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+				    pixels, width, height);
+		} else {
+			wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+			copy_image(d, stride, pixels, bytes, height, bytes,
+				   yflip, swap_rb);
+			wl_shm_buffer_end_access(l->buffer->shm_buffer);
+		}
+
+		free(pixels);
+	}
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
 	free(l);
 }
 
-WL_EXPORT int
-weston_screenshooter_shoot(struct weston_output *output,
-			   struct weston_buffer *buffer,
-			   weston_screenshooter_done_func_t done, void *data)
+static int
+screenshooter_get_shm_buffer(struct weston_buffer *buffer)
 {
-	struct screenshooter_frame_listener *l;
-
-	if (!wl_shm_buffer_get(buffer->resource)) {
-		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+	if (!wl_shm_buffer_get(buffer->resource))
 		return -1;
-	}
 
 	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
-	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
-		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
-		return -1;
-	}
+	return 0;
+}
+
+static int
+screenshooter_shoot_output(struct weston_output *output,
+			   struct weston_buffer *buffer,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height, bool scale,
+			   weston_screenshooter_done_func_t done, void *data)
+{
+	struct screenshooter_frame_listener *l;
 
 	l = malloc(sizeof *l);
 	if (l == NULL) {
@@ -208,6 +322,11 @@ weston_screenshooter_shoot(struct weston_output *output,
 	l->buffer = buffer;
 	l->done = done;
 	l->data = data;
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
+	l->scale = scale;
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
 	output->disable_planes++;
@@ -216,6 +335,131 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+WL_EXPORT int
+weston_screenshooter_shoot(struct weston_output *output,
+			   struct weston_buffer *buffer,
+			   weston_screenshooter_done_func_t done, void *data)
+{
+	if (screenshooter_get_shm_buffer(buffer) < 0) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	if (buffer->width < output->current_mode->width ||
+	    buffer->height < output->current_mode->height) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	return screenshooter_shoot_output(output, buffer, 0, 0,
+					  output->current_mode->width,
+					  output->current_mode->height, false,
+					  done, data);
+}
+
+/** Capture a rectangle of an output into a client buffer
+ *
+ * \param output The output to capture.
+ * \param x The left edge of the rectangle, in framebuffer pixels.
+ * \param y The top edge of the rectangle, in framebuffer pixels.
+ * \param width The width of the rectangle.
+ * \param height The height of the rectangle.
+ * \param buffer A wl_shm buffer, the rectangle is scaled to its size.
+ * \param done Called with the outcome once the capture is done.
+ * \param data User data for done.
+ * \return 0 if the capture was started, -1 if done was called with a
+ * failure already.
+ *
+ * Only the rectangle is read back from the renderer, at the next repaint
+ * of the output.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  struct weston_buffer *buffer,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
+{
+	if (screenshooter_get_shm_buffer(buffer) < 0 ||
+	    x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    x > output->current_mode->width - width ||
+	    y > output->current_mode->height - height) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	return screenshooter_shoot_output(output, buffer, x, y, width, height,
+					  buffer->width != width ||
+					  buffer->height != height,
+					  done, data);
+}
+
+/** Capture the content of a surface into a client buffer
+ *
+ * \param surface The surface to capture.
+ * \param buffer A wl_shm buffer, the content is scaled to its size.
+ * \param done Called with the outcome before this returns.
+ * \param data User data for done.
+ * \return 0 on success, -1 on failure.
+ *
+ * The renderer draws the content at the buffer size, see
+ * weston_surface_copy_content_scaled(), so no output repaint is needed.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_surface(struct weston_surface *surface,
+				   struct weston_buffer *buffer,
+				   weston_screenshooter_done_func_t done,
+				   void *data)
+{
+	int32_t stride, bytes;
+	uint8_t *pixels, *d;
+	size_t size;
+	int ret;
+
+	if (screenshooter_get_shm_buffer(buffer) < 0) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	bytes = buffer->width * 4;
+	size = (size_t) bytes * buffer->height;
+	pixels = malloc(size);
+	if (pixels == NULL) {
+		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		return -1;
+	}
+
+	/* The renderer may access the shm pool of the surface itself, and
+	 * libwayland allows access to only one pool at a time, so the copy
+	 * is not made straight into the client buffer. */
+	ret = weston_surface_copy_content_scaled(surface, pixels, size,
+						 buffer->width,
+						 buffer->height);
+
+	/* The copy is PIXMAN_a8b8g8r8, so R and B are always swapped. */
+	if (ret == 0) {
+		stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+		d = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		copy_image(d, stride, pixels, bytes, buffer->height,
+			   bytes, false, true);
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+	}
+
+	free(pixels);
+
+	if (ret < 0) {
+		done(data, WESTON_SCREENSHOOTER_NO_CONTENT);
+		return -1;
+	}
+
+	done(data, WESTON_SCREENSHOOTER_SUCCESS);
+
+	return 0;
+}
+
 static void
 screenshooter_done(void *data, enum weston_screenshooter_outcome outcome)
 {
@@ -229,6 +473,9 @@ screenshooter_done(void *data, enum weston_screenshooter_outcome outcome)
 		wl_resource_post_no_memory(resource);
 		break;
 	default:
+		if (wl_resource_get_version(resource) >=
+		    WESTON_SCREENSHOOTER_FAILED_SINCE_VERSION)
+			weston_screenshooter_send_failed(resource);
 		break;
 	}
 }
@@ -252,8 +499,87 @@ screenshooter_shoot(struct wl_client *client,
 	weston_screenshooter_shoot(output, buffer, screenshooter_done, resource);
 }
 
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   int32_t x, int32_t y, int32_t width, int32_t height,
+			   struct wl_resource *buffer_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct weston_buffer *buffer =
+		weston_buffer_from_resource(buffer_resource);
+
+	if (buffer == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	weston_screenshooter_shoot_region(output, x, y, width, height, buffer,
+					  screenshooter_done, resource);
+}
+
+/* The topmost view showing its surface at the point, unlike
+ * weston_compositor_pick_view() regardless of the input region. */
+static struct weston_surface *
+screenshooter_surface_at(struct weston_compositor *compositor,
+			 int32_t x, int32_t y)
+{
+	struct weston_view *view;
+	int32_t sx, sy;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!pixman_region32_contains_point(&view->transform.boundingbox,
+						    x, y, NULL))
+			continue;
+
+		weston_view_from_global(view, x, y, &sx, &sy);
+		if (sx >= 0 && sy >= 0 &&
+		    sx < view->surface->width && sy < view->surface->height)
+			return view->surface;
+	}
+
+	return NULL;
+}
+
+static void
+screenshooter_shoot_surface(struct wl_client *client,
+			    struct wl_resource *resource,
+			    struct wl_resource *output_resource,
+			    int32_t x, int32_t y,
+			    struct wl_resource *buffer_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct weston_buffer *buffer =
+		weston_buffer_from_resource(buffer_resource);
+	struct weston_surface *surface;
+	wl_fixed_t gx, gy;
+
+	if (buffer == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	weston_output_transform_coordinate(output, wl_fixed_from_int(x),
+					   wl_fixed_from_int(y), &gx, &gy);
+	surface = screenshooter_surface_at(output->compositor,
+					   wl_fixed_to_int(gx),
+					   wl_fixed_to_int(gy));
+	if (surface == NULL) {
+		screenshooter_done(resource, WESTON_SCREENSHOOTER_NO_CONTENT);
+		return;
+	}
+
+	weston_screenshooter_shoot_surface(surface, buffer,
+					   screenshooter_done, resource);
+}
+
 struct weston_screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region,
+	screenshooter_shoot_surface
 };
 
 static void
@@ -264,7 +590,8 @@ bind_shooter(struct wl_client *client,
 	struct wl_resource *resource;
 
 	resource = wl_resource_create(client,
-				      &weston_screenshooter_interface, 1, id);
+				      &weston_screenshooter_interface,
+				      MIN(version, 2), id);
 
 	if (client != shooter->client) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
@@ -308,49 +635,319 @@ screenshooter_binding(struct weston_keyboard *keyboard, uint32_t time,
 	free(screenshooter_exe);
 }
 
+/* Frames read back and waiting for the writer thread. When all slots
+ * are taken, frames are dropped instead of stalling the repaint. */
+#define RECORDER_SLOTS	4
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	int keyframe;
+	pixman_region32_t damage;	/* in the read back buffer */
+	uint32_t *pixels;		/* each damage rectangle in turn */
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
 	int fd;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int destroying;
+	int do_yflip;
+	int width, height;
+
+	/* wcap container version, 2 adds keyframes, compression and
+	 * an index */
+	int version;
+	uint32_t compression;
+	uint32_t keyframe_interval;	/* msecs */
+	uint32_t last_keyframe;
+	int need_keyframe;
+
+	/* Damage of dropped frames, added to the next frame read back */
+	pixman_region32_t dropped_damage;
+	int dropped;
+
+	/* Owned by the writer thread while it runs */
+	uint32_t *frame, *outbuf;
+	size_t outbuf_size;
+	void *zbuf;
+	size_t zbuf_size;
+	uint64_t total;
+	int count;
+	int failed;
+	int write_error;
+	int index_failed;
+	struct wcap_index_entry *index;
+	uint32_t index_alloc;
+	uint32_t keyframe;
+
+	pthread_t writer_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct weston_recorder_frame slots[RECORDER_SLOTS];
+	int head, queued;	/* protected by mutex */
+	int quit;		/* protected by mutex */
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static int
+weston_recorder_reserve(struct weston_recorder *recorder, size_t size)
 {
-	int i;
+	uint32_t *outbuf;
+#ifdef HAVE_ZLIB
+	size_t zbuf_size;
+	void *zbuf;
+#endif
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
+	if (size <= recorder->outbuf_size)
+		return 0;
+
+	outbuf = realloc(recorder->outbuf, size);
+	if (outbuf == NULL)
+		return -1;
+	recorder->outbuf = outbuf;
+	recorder->outbuf_size = size;
+
+#ifdef HAVE_ZLIB
+	if (recorder->compression == WCAP_COMPRESSION_ZLIB) {
+		zbuf_size = compressBound(size);
+		zbuf = realloc(recorder->zbuf, zbuf_size);
+		if (zbuf == NULL)
+			return -1;
+		recorder->zbuf = zbuf;
+		recorder->zbuf_size = zbuf_size;
+	}
+#endif
+
+	return 0;
+}
+
+static void
+weston_recorder_add_index_entry(struct weston_recorder *recorder,
+				uint32_t msecs)
+{
+	struct wcap_index_entry *index, *entry;
+	uint32_t alloc;
+
+	if (recorder->index_failed)
+		return;
+
+	if (recorder->count == (int) recorder->index_alloc) {
+		alloc = recorder->index_alloc ? recorder->index_alloc * 2 : 1024;
+		index = realloc(recorder->index, alloc * sizeof *index);
+		if (index == NULL) {
+			/* The decoder rebuilds a missing index */
+			recorder->index_failed = 1;
+			return;
 		}
+		recorder->index = index;
+		recorder->index_alloc = alloc;
+	}
+
+	entry = &recorder->index[recorder->count];
+	entry->offset = recorder->total;
+	entry->msecs = msecs;
+	entry->keyframe = recorder->keyframe;
+}
+
+/* Appends to the file. After a short write the following frames and the
+ * index would point into the middle of a frame, so recording stops. */
+static int
+weston_recorder_writev(struct weston_recorder *recorder,
+		       const struct iovec *v, int n)
+{
+	size_t size = 0;
+	ssize_t written;
+	int i;
+
+	for (i = 0; i < n; i++)
+		size += v[i].iov_len;
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+	written = writev(recorder->fd, v, n);
+	if (written < 0 || (size_t) written != size) {
+		recorder->write_error = written < 0 ? errno : ENOSPC;
+		recorder->failed = 1;
+		return -1;
 	}
 
-	return p;
+	recorder->total += size;
+
+	return 0;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+/* Runs on the writer thread: delta and run length encode a frame against
+ * the previous one, or a black frame for keyframes, and append it to the
+ * file. The payload is the damage rectangles followed by their runs. */
+static void
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
 {
-	unsigned char dr, dg, db;
+	static const uint8_t padding[8];
+	pixman_box32_t *r;
+	int i, j, n, width, height, y_orig;
+	uint32_t *d, *s, *p, *rect;
+	struct wcap_rle_encoder encoder;
+	struct wcap_frame_header header;
+	struct wcap_frame_header_v2 header_v2;
+	struct iovec v[3];
+	size_t raw_size;
+	void *data;
+	uint32_t size;
+#ifdef HAVE_ZLIB
+	uLongf zsize;
+#endif
+
+	/* Frames after a lost one would decode to garbage. */
+	if (recorder->failed)
+		return;
+
+	r = pixman_region32_rectangles(&frame->damage, &n);
+
+	/* Damage rectangles don't overlap, so there is at most a run
+	 * per pixel of the output. */
+	if (weston_recorder_reserve(recorder, n * sizeof *r +
+				    recorder->width * recorder->height * 4) < 0) {
+		recorder->failed = 1;
+		return;
+	}
+
+	if (frame->keyframe) {
+		memset(recorder->frame, 0,
+		       recorder->width * recorder->height * 4);
+		recorder->keyframe = recorder->count;
+	}
+
+	memcpy(recorder->outbuf, r, n * sizeof *r);
+	p = recorder->outbuf + n * sizeof *r / 4;
+
+	rect = frame->pixels;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		wcap_rle_encoder_init(&encoder, p);
+		for (j = 0; j < height; j++) {
+			if (recorder->do_yflip)
+				s = rect + width * j;
+			else
+				s = rect + width * (height - j - 1);
+			y_orig = r[i].y2 - j - 1;
+			d = recorder->frame + recorder->width * y_orig + r[i].x1;
+
+			wcap_rle_encode(&encoder, s, d, width);
+		}
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+		p = wcap_rle_encoder_finish(&encoder);
+		rect += width * height;
+	}
+
+	raw_size = (p - recorder->outbuf) * 4;
+
+	if (recorder->version == 1) {
+		header.msecs = frame->msecs;
+		header.nrects = n;
+		v[0].iov_base = &header;
+		v[0].iov_len = sizeof header;
+		v[1].iov_base = recorder->outbuf;
+		v[1].iov_len = raw_size;
+		if (weston_recorder_writev(recorder, v, 2) == 0)
+			recorder->count++;
+		return;
+	}
+
+	data = recorder->outbuf;
+	size = raw_size;
+	header_v2.flags = frame->keyframe ? WCAP_FRAME_KEYFRAME : 0;
+#ifdef HAVE_ZLIB
+	if (recorder->compression == WCAP_COMPRESSION_ZLIB) {
+		zsize = recorder->zbuf_size;
+		if (compress2(recorder->zbuf, &zsize,
+			      (Bytef *) recorder->outbuf, raw_size,
+			      Z_BEST_SPEED) == Z_OK && zsize < raw_size) {
+			data = recorder->zbuf;
+			size = zsize;
+			header_v2.flags |= WCAP_FRAME_COMPRESSED;
+		}
+	}
+#endif
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	header_v2.msecs = frame->msecs;
+	header_v2.nrects = n;
+	header_v2.size = size;
+	header_v2.raw_size = raw_size;
+	header_v2.reserved = 0;
+
+	/* The entry only counts once the frame is written. */
+	weston_recorder_add_index_entry(recorder, frame->msecs);
+
+	v[0].iov_base = &header_v2;
+	v[0].iov_len = sizeof header_v2;
+	v[1].iov_base = data;
+	v[1].iov_len = size;
+	v[2].iov_base = (void *) padding;
+	v[2].iov_len = WCAP_ALIGN(size) - size;
+	if (weston_recorder_writev(recorder, v, 3) == 0)
+		recorder->count++;
 }
 
+/* Appends the frame index and points the file header at it. Files
+ * without one, say from a crash, are still readable front to back. */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_index_header header;
+	uint64_t offset = recorder->total;
+	struct iovec v[2];
+
+	/* After a failed write the end of the file is not known. */
+	if (recorder->index_failed || recorder->failed)
+		return;
+
+	header.magic = WCAP_INDEX_MAGIC;
+	header.count = recorder->count;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = recorder->index;
+	v[1].iov_len = recorder->count * sizeof *recorder->index;
+	if (weston_recorder_writev(recorder, v, 2) < 0)
+		return;
+
+	if (pwrite(recorder->fd, &offset, sizeof offset,
+		   offsetof(struct wcap_header_v2, index_offset)) !=
+	    sizeof offset)
+		weston_log("failed to write the recording index: %m\n");
+}
+
+static void *
+weston_recorder_writer(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+	int tail;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (recorder->queued == 0 && !recorder->quit)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+		if (recorder->queued == 0)
+			break;
+
+		tail = (recorder->head + RECORDER_SLOTS - recorder->queued) %
+			RECORDER_SLOTS;
+		frame = &recorder->slots[tail];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		weston_recorder_write_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queued--;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
 
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
@@ -359,25 +956,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	int i, n, width, height, y_orig, queued, keyframe;
+	uint32_t *rect;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -389,76 +972,79 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	pthread_mutex_lock(&recorder->mutex);
+	queued = recorder->queued;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	/* The writer thread is behind. Drop the frame, but remember its
+	 * damage so the next frame still encodes against the right
+	 * contents. */
+	if (queued == RECORDER_SLOTS) {
+		if (pixman_region32_not_empty(&transformed_damage))
+			recorder->dropped++;
+		pixman_region32_union(&recorder->dropped_damage,
+				      &recorder->dropped_damage,
+				      &transformed_damage);
+		pixman_region32_fini(&transformed_damage);
+		goto out;
+	}
+
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->dropped_damage);
+	pixman_region32_clear(&recorder->dropped_damage);
+
+	/* Keyframes are read back whole, so decoding can start there. */
+	keyframe = recorder->version == 2 &&
+		(recorder->need_keyframe ||
+		 (recorder->keyframe_interval &&
+		  output->frame_time - recorder->last_keyframe >=
+		  recorder->keyframe_interval));
+	if (keyframe) {
+		pixman_region32_fini(&transformed_damage);
+		pixman_region32_init_rect(&transformed_damage, 0, 0,
+					  recorder->width, recorder->height);
+		recorder->need_keyframe = 0;
+		recorder->last_keyframe = output->frame_time;
+	}
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
 	if (n == 0) {
 		pixman_region32_fini(&transformed_damage);
-		return;
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	/* Only the writer thread takes slots off the queue, so the slot
+	 * at head stays ours until it is queued. */
+	frame = &recorder->slots[recorder->head];
+	frame->msecs = output->frame_time;
+	frame->keyframe = keyframe;
+	pixman_region32_copy(&frame->damage, &transformed_damage);
 
+	rect = frame->pixels;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, rect,
 				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
-
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+		rect += width * height;
 	}
 
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->head = (recorder->head + 1) % RECORDER_SLOTS;
+	recorder->queued++;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+out:
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
@@ -466,11 +1052,19 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_SLOTS; i++) {
+		pixman_region32_fini(&recorder->slots[i].damage);
+		free(recorder->slots[i].pixels);
+	}
+	pixman_region32_fini(&recorder->dropped_damage);
+	free(recorder->index);
+	free(recorder->zbuf);
+	free(recorder->outbuf);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -480,11 +1074,13 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	struct weston_config_section *section;
+	int i, size;
+	struct wcap_header_v2 header;
+	struct iovec v;
+	uint32_t keyframe_interval;
+	char *compression;
+	sigset_t mask, old_mask;
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -492,20 +1088,56 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
-	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	pixman_region32_init(&recorder->dropped_damage);
+	for (i = 0; i < RECORDER_SLOTS; i++)
+		pixman_region32_init(&recorder->slots[i].damage);
+
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	section = weston_config_get_section(compositor->config,
+					    "recorder", NULL, NULL);
+	weston_config_section_get_int(section, "version",
+				      &recorder->version, 1);
+	weston_config_section_get_uint(section, "keyframe-interval",
+				       &keyframe_interval, 10);
+	weston_config_section_get_string(section, "compression",
+					 &compression, "zlib");
+	if (recorder->version != 1 && recorder->version != 2) {
+		weston_log("unknown wcap version %d, using 1\n",
+			   recorder->version);
+		recorder->version = 1;
+	}
+	recorder->keyframe_interval = keyframe_interval * 1000;
+	recorder->need_keyframe = 1;
+	recorder->compression = WCAP_COMPRESSION_NONE;
+	if (strcmp(compression, "zlib") == 0) {
+#ifdef HAVE_ZLIB
+		recorder->compression = WCAP_COMPRESSION_ZLIB;
+#else
+		if (recorder->version == 2)
+			weston_log("built without zlib, "
+				   "recording uncompressed\n");
+#endif
+	} else if (strcmp(compression, "none") != 0) {
+		weston_log("unknown recorder compression %s\n", compression);
+	}
+	free(compression);
+
+	size = recorder->width * 4 * recorder->height;
+	recorder->frame = zalloc(size);
+	if (recorder->frame == NULL ||
+	    weston_recorder_reserve(recorder, size) < 0) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	for (i = 0; i < RECORDER_SLOTS; i++) {
+		recorder->slots[i].pixels = malloc(size);
+		if (recorder->slots[i].pixels == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
@@ -534,9 +1166,43 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	header.width = output->current_mode->width;
-	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	header.width = recorder->width;
+	header.height = recorder->height;
+	if (recorder->version == 2) {
+		header.magic = WCAP_HEADER_MAGIC_V2;
+		header.compression = recorder->compression;
+		header.keyframe_interval = recorder->keyframe_interval;
+		header.index_offset = 0;
+		v.iov_len = sizeof header;
+	} else {
+		v.iov_len = sizeof(struct wcap_header);
+	}
+
+	v.iov_base = &header;
+	if (weston_recorder_writev(recorder, &v, 1) < 0) {
+		weston_log("failed to write the recording header to %s: %s\n",
+			   filename, strerror(recorder->write_error));
+		close(recorder->fd);
+		goto err_recorder;
+	}
+
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+
+	/* Signals are for the compositor thread to handle. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	i = pthread_create(&recorder->writer_thread, NULL,
+			   weston_recorder_writer, recorder);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (i != 0) {
+		weston_log("failed to start the recorder thread\n");
+		pthread_mutex_destroy(&recorder->mutex);
+		pthread_cond_destroy(&recorder->queue_cond);
+		close(recorder->fd);
+		goto err_recorder;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -554,8 +1220,32 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
+
+	/* Let the writer thread finish the queued frames. */
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->writer_thread, NULL);
+
+	if (recorder->version == 2)
+		weston_recorder_write_index(recorder);
+
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->queue_cond);
+	close(recorder->fd);
+
+	if (recorder->write_error)
+		weston_log("failed to write the recording, it is cut short: "
+			   "%s\n", strerror(recorder->write_error));
+	else if (recorder->failed)
+		weston_log("recorder ran out of memory, "
+			   "the recording is cut short\n");
+	weston_log("stopped recorder, total file size %dM, %d frames, "
+		   "%d dropped\n", (int) (recorder->total / (1024 * 1024)),
+		   recorder->count, recorder->dropped);
+
 	weston_recorder_free(recorder);
 }
 
@@ -580,9 +1270,7 @@ recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+		weston_log("stopping recorder\n");
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
@@ -622,7 +1310,7 @@ screenshooter_create(struct weston_compositor *ec)
 	shooter->client = NULL;
 
 	shooter->global = wl_global_create(ec->wl_display,
-					   &weston_screenshooter_interface, 1,
+					   &weston_screenshooter_interface, 2,
 					   shooter, bind_shooter);
 	weston_compositor_add_key_binding(ec, KEY_S, MODIFIER_SUPER,
 					  screenshooter_binding, shooter);
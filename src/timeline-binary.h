@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_BINARY_H
+#define WESTON_TIMELINE_BINARY_H
+
+#include <stdint.h>
+
+/*
+ * The binary timeline log is a file holding this header followed by a
+ * ring buffer of records, written through a shared mapping. When the
+ * ring is full the oldest records are dropped. The records between tail
+ * and head, tail first and following pad records back to the start of
+ * the ring, are the log; weston-timeline-convert turns them into the
+ * JSON the text log has.
+ *
+ * Records are 8 byte aligned and never wrap around the end of the ring.
+ * Strings and object descriptions are written once and referred to by
+ * id, and written again whenever half of the ring has been filled since,
+ * so that the records still in the ring can be resolved.
+ */
+
+#define TIMELINE_BINARY_MAGIC		0x57544c42
+#define TIMELINE_BINARY_VERSION		1
+
+struct timeline_binary_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;		/* the ring starts here */
+	uint32_t clock_id;
+	uint64_t ring_size;
+	uint64_t head;			/* offset of the next record */
+	uint64_t tail;			/* offset of the oldest record */
+	uint64_t used;			/* bytes from tail to head */
+	uint64_t written;		/* bytes ever written */
+	uint64_t dropped;		/* records overwritten */
+};
+
+enum timeline_record_type {
+	TLR_PAD = 0,		/* skip to the start of the ring */
+	TLR_STRING,		/* string id, the string */
+	TLR_OUTPUT,		/* object id, name if any */
+	TLR_SURFACE,		/* object id, uint32_t main surface id and
+				 * padding, description if any */
+	TLR_POINT,		/* name string id, timestamp, arguments */
+};
+
+struct timeline_record {
+	uint16_t type;
+	uint16_t size;		/* including this header and padding */
+	uint32_t id;
+};
+
+struct timeline_point_record {
+	struct timeline_record base;
+	int64_t tv_sec;
+	int64_t tv_nsec;
+	/* followed by struct timeline_point_arg until the end */
+};
+
+/* TLT_OUTPUT and TLT_SURFACE: object id in a.
+ * TLT_VBLANK: tv_nsec in a, tv_sec in b.
+ * TLT_INT: key string id in a, value in b. */
+struct timeline_point_arg {
+	uint32_t type;		/* enum timeline_type */
+	uint32_t a;
+	int64_t b;
+};
+
+#define TIMELINE_RECORD_ALIGN(size)	(((size) + 7) & ~7)
+
+#endif /* WESTON_TIMELINE_BINARY_H */
@@ -50,6 +50,12 @@ struct weston_timeline_object {
 	 * events.
 	 */
 	unsigned force_refresh;
+
+	/*
+	 * Binary log generation the description was last written in,
+	 * it is written again in each new one.
+	 */
+	unsigned generation;
 };
 
 #endif /* WESTON_TIMELINE_OBJECT_H */
@@ -27,35 +27,64 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
+#include "timeline-binary.h"
 #include "compositor.h"
 #include "file-util.h"
 
+/* Arguments of a timeline point beyond this are left out of the
+ * binary log. */
+#define TIMELINE_MAX_ARGS	16
+
+/* Longer strings are cut short in the binary log. */
+#define TIMELINE_MAX_STRING	1024
+
+struct timeline_string {
+	const char *str;
+	uint32_t id;
+	unsigned generation;
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+
+	/* The binary log, when header is not NULL */
+	struct timeline_binary_header *header;
+	uint8_t *ring;
+	size_t map_size;
+	unsigned generation;
+	uint64_t next_generation;
+
+	/* Strings by address, they are all literals */
+	struct timeline_string *strings;
+	uint32_t strings_size;
+	uint32_t strings_count;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
-static int
-weston_timeline_do_open(void)
+static FILE *
+timeline_create_file(const char *suffix)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
 	char fname[1000];
+	FILE *file;
 
-	timeline_.file = file_create_dated(prefix, suffix,
-					   fname, sizeof(fname));
-	if (!timeline_.file) {
+	file = file_create_dated(prefix, suffix, fname, sizeof(fname));
+	if (!file) {
 		const char *msg;
 
 		switch (errno) {
@@ -68,11 +97,78 @@ weston_timeline_do_open(void)
 
 		weston_log("Cannot open '%s*%s' for writing: %s\n",
 			   prefix, suffix, msg);
-		return -1;
+		return NULL;
 	}
 
 	weston_log("Opened timeline file '%s'\n", fname);
 
+	return file;
+}
+
+static int
+weston_timeline_do_open(void)
+{
+	timeline_.file = timeline_create_file(".log");
+	if (!timeline_.file)
+		return -1;
+
+	return 0;
+}
+
+static void
+timeline_next_generation(void)
+{
+	if (++timeline_.generation == 0)
+		++timeline_.generation;
+
+	timeline_.next_generation = timeline_.header->written +
+				    timeline_.header->ring_size / 2;
+}
+
+static int
+weston_timeline_do_open_binary(struct weston_compositor *compositor)
+{
+	struct timeline_binary_header *header;
+	uint64_t ring_size;
+	FILE *file;
+	void *map;
+
+	file = timeline_create_file(".bin");
+	if (!file)
+		return -1;
+
+	ring_size = (uint64_t) compositor->timeline_buffer_size << 20;
+	timeline_.map_size = sizeof *header + ring_size;
+	if (ftruncate(fileno(file), timeline_.map_size) < 0) {
+		weston_log("Cannot size the timeline file: %m\n");
+		fclose(file);
+		return -1;
+	}
+
+	map = mmap(NULL, timeline_.map_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fileno(file), 0);
+	fclose(file);
+	if (map == MAP_FAILED) {
+		weston_log("Cannot map the timeline file: %m\n");
+		return -1;
+	}
+
+	header = map;
+	header->magic = TIMELINE_BINARY_MAGIC;
+	header->version = TIMELINE_BINARY_VERSION;
+	header->header_size = sizeof *header;
+	header->clock_id = timeline_.clk_id;
+	header->ring_size = ring_size;
+	header->head = 0;
+	header->tail = 0;
+	header->used = 0;
+	header->written = 0;
+	header->dropped = 0;
+
+	timeline_.header = header;
+	timeline_.ring = (uint8_t *) map + sizeof *header;
+	timeline_next_generation();
+
 	return 0;
 }
 
@@ -88,8 +184,13 @@ weston_timeline_open(struct weston_compositor *compositor)
 	if (weston_timeline_enabled_)
 		return;
 
-	if (weston_timeline_do_open() < 0)
-		return;
+	if (compositor->timeline_binary) {
+		if (weston_timeline_do_open_binary(compositor) < 0)
+			return;
+	} else {
+		if (weston_timeline_do_open() < 0)
+			return;
+	}
 
 	timeline_.compositor_destroy_listener.notify = timeline_notify_destroy;
 	wl_signal_add(&compositor->destroy_signal,
@@ -111,8 +212,21 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
-	fclose(timeline_.file);
-	timeline_.file = NULL;
+	if (timeline_.header) {
+		munmap(timeline_.header, timeline_.map_size);
+		timeline_.header = NULL;
+		timeline_.ring = NULL;
+	} else {
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+	}
+
+	/* A new binary log starts over with its own string ids. */
+	free(timeline_.strings);
+	timeline_.strings = NULL;
+	timeline_.strings_size = 0;
+	timeline_.strings_count = 0;
+
 	weston_log("Timeline log file closed.\n");
 }
 
@@ -134,11 +248,10 @@ timeline_new_id(void)
 }
 
 static int
-check_series(struct timeline_emit_context *ctx,
-	     struct weston_timeline_object *to)
+check_series(unsigned series, struct weston_timeline_object *to)
 {
-	if (to->series == 0 || to->series != ctx->series) {
-		to->series = ctx->series;
+	if (to->series == 0 || to->series != series) {
+		to->series = series;
 		to->id = timeline_new_id();
 		return 1;
 	}
@@ -167,7 +280,7 @@ emit_weston_output(struct timeline_emit_context *ctx, void *obj)
 {
 	struct weston_output *o = obj;
 
-	if (check_series(ctx, &o->timeline)) {
+	if (check_series(ctx->series, &o->timeline)) {
 		fprintf(ctx->out, "{ \"id\":%u, "
 			"\"type\":\"weston_output\", \"name\":",
 			o->timeline.id);
@@ -188,7 +301,7 @@ check_weston_surface_description(struct timeline_emit_context *ctx,
 	char d[512];
 	char mainstr[32];
 
-	if (!check_series(ctx, &s->timeline))
+	if (!check_series(ctx->series, &s->timeline))
 		return;
 
 	mains = weston_surface_get_main_surface(s);
@@ -240,6 +353,267 @@ static const type_func type_dispatch[] = {
 	[TLT_VBLANK] = emit_vblank_timestamp,
 };
 
+/* Drops the oldest records until size bytes at head are free. */
+static void
+timeline_ring_evict(uint64_t size)
+{
+	struct timeline_binary_header *header = timeline_.header;
+	struct timeline_record *record;
+
+	while (header->used + size > header->ring_size) {
+		record = (void *) (timeline_.ring + header->tail);
+		if (record->type != TLR_PAD)
+			header->dropped++;
+
+		header->used -= record->size;
+		header->tail += record->size;
+		if (header->tail == header->ring_size)
+			header->tail = 0;
+	}
+}
+
+static void *
+timeline_ring_reserve(size_t size)
+{
+	struct timeline_binary_header *header = timeline_.header;
+	struct timeline_record *pad;
+	uint64_t left = header->ring_size - header->head;
+
+	if (left < size) {
+		timeline_ring_evict(left);
+		pad = (void *) (timeline_.ring + header->head);
+		pad->type = TLR_PAD;
+		pad->size = left;
+		pad->id = 0;
+		header->used += left;
+		header->written += left;
+		header->head = 0;
+	}
+
+	timeline_ring_evict(size);
+
+	return timeline_.ring + header->head;
+}
+
+static void
+timeline_ring_commit(size_t size)
+{
+	struct timeline_binary_header *header = timeline_.header;
+
+	header->head += size;
+	if (header->head == header->ring_size)
+		header->head = 0;
+	header->used += size;
+	header->written += size;
+
+	if (header->written >= timeline_.next_generation)
+		timeline_next_generation();
+}
+
+static void
+timeline_write_record(enum timeline_record_type type, uint32_t id,
+		      const void *data, size_t data_size, const char *str)
+{
+	struct timeline_record *record;
+	size_t len = 0, size;
+	char *p;
+
+	if (str) {
+		len = strlen(str);
+		if (len > TIMELINE_MAX_STRING)
+			len = TIMELINE_MAX_STRING;
+	}
+
+	size = TIMELINE_RECORD_ALIGN(sizeof *record + data_size +
+				     (str ? len + 1 : 0));
+	record = timeline_ring_reserve(size);
+	record->type = type;
+	record->size = size;
+	record->id = id;
+
+	p = (char *) (record + 1);
+	if (data_size)
+		memcpy(p, data, data_size);
+	p += data_size;
+	memset(p, 0, size - sizeof *record - data_size);
+	if (str)
+		memcpy(p, str, len);
+
+	timeline_ring_commit(size);
+}
+
+static int
+timeline_strings_grow(void)
+{
+	struct timeline_string *strings, *old = timeline_.strings;
+	uint32_t size = timeline_.strings_size ? timeline_.strings_size * 2 : 64;
+	uint32_t i, j;
+
+	strings = calloc(size, sizeof *strings);
+	if (!strings)
+		return -1;
+
+	for (i = 0; i < timeline_.strings_size; i++) {
+		if (!old[i].str)
+			continue;
+
+		j = ((uintptr_t) old[i].str >> 3) & (size - 1);
+		while (strings[j].str)
+			j = (j + 1) & (size - 1);
+		strings[j] = old[i];
+	}
+
+	free(old);
+	timeline_.strings = strings;
+	timeline_.strings_size = size;
+
+	return 0;
+}
+
+/* Strings are literals, so they are known by their address. */
+static uint32_t
+timeline_binary_string(const char *str)
+{
+	struct timeline_string *entry;
+	uint32_t i;
+
+	if (timeline_.strings_count * 2 >= timeline_.strings_size &&
+	    timeline_strings_grow() < 0)
+		return 0;
+
+	i = ((uintptr_t) str >> 3) & (timeline_.strings_size - 1);
+	while (timeline_.strings[i].str && timeline_.strings[i].str != str)
+		i = (i + 1) & (timeline_.strings_size - 1);
+
+	entry = &timeline_.strings[i];
+	if (!entry->str) {
+		entry->str = str;
+		entry->id = ++timeline_.strings_count;
+	}
+
+	if (entry->generation != timeline_.generation) {
+		entry->generation = timeline_.generation;
+		timeline_write_record(TLR_STRING, entry->id, NULL, 0, str);
+	}
+
+	return entry->id;
+}
+
+static int
+check_binary_object(struct weston_timeline_object *to)
+{
+	int describe;
+
+	describe = check_series(timeline_.series, to);
+	if (to->generation != timeline_.generation) {
+		to->generation = timeline_.generation;
+		describe = 1;
+	}
+
+	return describe;
+}
+
+static uint32_t
+binary_weston_output(struct weston_output *o)
+{
+	if (check_binary_object(&o->timeline))
+		timeline_write_record(TLR_OUTPUT, o->timeline.id,
+				      NULL, 0, o->name);
+
+	return o->timeline.id;
+}
+
+static uint32_t
+binary_weston_surface(struct weston_surface *s)
+{
+	struct weston_surface *mains;
+	uint32_t main_id[2] = { 0, 0 };
+	char d[512];
+
+	if (!check_binary_object(&s->timeline))
+		return s->timeline.id;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s)
+		main_id[0] = binary_weston_surface(mains);
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	timeline_write_record(TLR_SURFACE, s->timeline.id,
+			      main_id, sizeof main_id, d[0] ? d : NULL);
+
+	return s->timeline.id;
+}
+
+static void
+timeline_binary_point(const struct timespec *ts, const char *name,
+		      va_list argp)
+{
+	struct timeline_point_arg args[TIMELINE_MAX_ARGS];
+	struct timeline_point_record *record;
+	const struct timespec *vblank;
+	enum timeline_type otype;
+	uint32_t name_id;
+	size_t size;
+	void *obj;
+	int n = 0;
+
+	name_id = timeline_binary_string(name);
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		if (otype == TLT_INT) {
+			const char *key = va_arg(argp, const char *);
+			int64_t value = va_arg(argp, int64_t);
+
+			if (n == TIMELINE_MAX_ARGS)
+				continue;
+			args[n].type = otype;
+			args[n].a = timeline_binary_string(key);
+			args[n++].b = value;
+			continue;
+		}
+
+		obj = va_arg(argp, void *);
+		if (n == TIMELINE_MAX_ARGS)
+			continue;
+
+		switch (otype) {
+		case TLT_OUTPUT:
+			args[n].a = binary_weston_output(obj);
+			args[n].b = 0;
+			break;
+		case TLT_SURFACE:
+			args[n].a = binary_weston_surface(obj);
+			args[n].b = 0;
+			break;
+		case TLT_VBLANK:
+			vblank = obj;
+			args[n].a = vblank->tv_nsec;
+			args[n].b = vblank->tv_sec;
+			break;
+		default:
+			continue;
+		}
+		args[n++].type = otype;
+	}
+
+	/* Descriptions go before the point, like in the JSON log. */
+	size = sizeof *record + n * sizeof args[0];
+	record = timeline_ring_reserve(size);
+	record->base.type = TLR_POINT;
+	record->base.size = size;
+	record->base.id = name_id;
+	record->tv_sec = ts->tv_sec;
+	record->tv_nsec = ts->tv_nsec;
+	memcpy(record + 1, args, n * sizeof args[0]);
+	timeline_ring_commit(size);
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -252,6 +626,14 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	/* No formatting or stdio, just stores into the shared mapping. */
+	if (timeline_.header) {
+		va_start(argp, name);
+		timeline_binary_point(&ts, name, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
@@ -271,6 +653,14 @@ weston_timeline_point(const char *name, ...)
 		if (otype == TLT_END)
 			break;
 
+		if (otype == TLT_INT) {
+			const char *key = va_arg(argp, const char *);
+			int64_t value = va_arg(argp, int64_t);
+
+			fprintf(ctx.cur, ", \"%s\":%" PRId64, key, value);
+			continue;
+		}
+
 		obj = va_arg(argp, void *);
 		if (type_dispatch[otype]) {
 			fprintf(ctx.cur, ", ");
@@ -42,6 +42,7 @@ enum timeline_type {
 	TLT_OUTPUT,
 	TLT_SURFACE,
 	TLT_VBLANK,
+	TLT_INT,
 };
 
 #define TYPEVERIFY(type, arg) ({			\
@@ -53,6 +54,10 @@ enum timeline_type {
 #define TLP_OUTPUT(o) TLT_OUTPUT, TYPEVERIFY(struct weston_output *, (o))
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
+/* A named integer value; the name must be a valid JSON key. The name is
+ * usually a string literal, which TYPEVERIFY would copy to a temporary
+ * array, so it is only converted. */
+#define TLP_INT(n, v) TLT_INT, (const char *)(n), (int64_t)(v)
 
 #define TL_POINT(...) do { \
 	if (weston_timeline_enabled_) \
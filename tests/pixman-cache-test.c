@@ -0,0 +1,393 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Runs with the pixman renderer and checks through read_pixels() that
+ * the images it caches per wl_shm buffer and the alpha masks it caches
+ * per view follow the buffer contents, the buffer lifetime and the view
+ * alpha. Then many clients reattach translucent buffers every frame of
+ * the 60 Hz headless output and the average repaint time is printed.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+
+#include "weston-test-module-helper.h"
+#include "shared/helpers.h"
+
+#define VIEW_SIZE	64
+
+#define STRESS_CLIENTS	16
+#define STRESS_SURFACES	4	/* per client */
+#define STRESS_SIZE	32
+#define STRESS_FRAMES	120
+
+#define RED	0xffff0000
+#define GREEN	0xff00ff00
+#define BLUE	0xff0000ff
+#define WHITE	0xffffffff
+
+/* A client without a process behind it, so that the test can create
+ * wl_shm buffers the way a client would have them created. */
+struct test_client {
+	struct wl_client *client;
+	int fd;		/* the client end of the connection */
+	uint32_t next_id;
+};
+
+struct stress_surface {
+	struct weston_view *view;
+	struct wl_resource *buffers[2];
+};
+
+struct cache_test {
+	struct module_test base;
+	struct test_client client;
+	struct weston_view *background;
+	struct weston_view *view;
+	struct wl_resource *buffer;
+
+	struct test_client stress_clients[STRESS_CLIENTS];
+	struct stress_surface stress[STRESS_CLIENTS * STRESS_SURFACES];
+	uint64_t stress_usec;		/* repaint time of the stress frames */
+	uint32_t stress_repaints;
+
+	int step;
+};
+
+static void
+test_client_init(struct test_client *client,
+		 struct weston_compositor *compositor)
+{
+	int fds[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+	client->client = wl_client_create(compositor->wl_display, fds[0]);
+	assert(client->client);
+	client->fd = fds[1];
+	client->next_id = 2;
+}
+
+/* Discards the events sent to the client, buffer releases mostly, so
+ * that the connection never fills up. */
+static void
+test_client_drain(struct test_client *client)
+{
+	char buf[4096];
+
+	while (recv(client->fd, buf, sizeof buf, MSG_DONTWAIT) > 0)
+		;
+}
+
+static void
+test_client_fini(struct test_client *client)
+{
+	wl_client_destroy(client->client);
+	close(client->fd);
+}
+
+static void
+buffer_fill(struct wl_resource *resource, uint32_t color)
+{
+	struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(resource);
+	uint32_t *pixels = wl_shm_buffer_get_data(shm_buffer);
+	int n = wl_shm_buffer_get_width(shm_buffer) *
+		wl_shm_buffer_get_height(shm_buffer);
+	int i;
+
+	for (i = 0; i < n; i++)
+		pixels[i] = color;
+}
+
+static struct wl_resource *
+test_client_create_buffer(struct test_client *client, int size,
+			  uint32_t color)
+{
+	struct wl_resource *resource;
+	uint32_t id = client->next_id++;
+
+	assert(wl_shm_buffer_create(client->client, id, size, size, size * 4,
+				    WL_SHM_FORMAT_ARGB8888));
+	resource = wl_client_get_object(client->client, id);
+	assert(resource);
+	buffer_fill(resource, color);
+
+	return resource;
+}
+
+/* What a wl_surface.attach and damage of the whole surface would do. */
+static void
+view_attach(struct weston_view *view, struct wl_resource *resource)
+{
+	struct weston_surface *surface = view->surface;
+	struct weston_buffer *buffer = weston_buffer_from_resource(resource);
+
+	assert(buffer);
+	weston_buffer_reference(&surface->buffer_ref, buffer);
+	surface->compositor->renderer->attach(surface, buffer);
+	weston_surface_damage(surface);
+}
+
+static void
+view_set_alpha(struct weston_view *view, float alpha)
+{
+	view->alpha = alpha;
+	weston_view_geometry_dirty(view);
+	weston_view_update_transform(view);
+	weston_surface_damage(view->surface);
+}
+
+/* Output-local coordinates, read_pixels() counts rows from the bottom. */
+static uint32_t
+read_pixel(struct weston_output *output, int x, int y)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t pixel;
+
+	assert(compositor->renderer->read_pixels(output, PIXMAN_a8r8g8b8,
+						 &pixel, x,
+						 output->current_mode->height -
+						 1 - y, 1, 1) == 0);
+
+	return pixel;
+}
+
+/* An opaque source over an opaque destination through the 8 bit mask
+ * the renderer makes of the view alpha. */
+static uint32_t
+blend(uint32_t src, uint32_t dst, float alpha)
+{
+	uint32_t mask = (uint32_t) (0xffff * alpha) >> 8;
+	uint32_t pixel = 0xff000000;
+	uint32_t s, d;
+	int shift;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		s = (src >> shift) & 0xff;
+		d = (dst >> shift) & 0xff;
+		pixel |= ((s * mask + d * (255 - mask)) / 255) << shift;
+	}
+
+	return pixel;
+}
+
+static void
+check_pixel(struct weston_output *output, int x, int y, uint32_t expected)
+{
+	uint32_t pixel = read_pixel(output, x, y);
+	int shift, diff;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		diff = (int) ((pixel >> shift) & 0xff) -
+		       (int) ((expected >> shift) & 0xff);
+		if (abs(diff) > 2) {
+			fprintf(stderr, "pixel %d,%d is 0x%08x, "
+				"expected 0x%08x\n", x, y, pixel, expected);
+			assert(0);
+		}
+	}
+}
+
+static void
+stress_start(struct cache_test *test, struct weston_output *output)
+{
+	struct test_client *client;
+	struct stress_surface *s;
+	int i, j, x, y;
+
+	for (i = 0; i < STRESS_CLIENTS; i++) {
+		client = &test->stress_clients[i];
+		test_client_init(client, test->base.compositor);
+
+		for (j = 0; j < STRESS_SURFACES; j++) {
+			s = &test->stress[i * STRESS_SURFACES + j];
+			x = output->x + j * STRESS_SIZE;
+			y = output->y + VIEW_SIZE + i * STRESS_SIZE;
+			s->view = module_test_create_view(&test->base, x, y,
+							  STRESS_SIZE,
+							  STRESS_SIZE, false);
+			s->buffers[0] = test_client_create_buffer(client,
+								  STRESS_SIZE,
+								  RED);
+			s->buffers[1] = test_client_create_buffer(client,
+								  STRESS_SIZE,
+								  GREEN);
+			view_attach(s->view, s->buffers[0]);
+			view_set_alpha(s->view, 0.5);
+		}
+	}
+}
+
+/* Every client commits a new buffer for each of its surfaces, like a
+ * client animating at the refresh rate would. */
+static void
+stress_frame(struct cache_test *test, int frame)
+{
+	struct stress_surface *s;
+	int i;
+
+	for (i = 0; i < STRESS_CLIENTS; i++)
+		test_client_drain(&test->stress_clients[i]);
+
+	for (i = 0; i < STRESS_CLIENTS * STRESS_SURFACES; i++) {
+		s = &test->stress[i];
+		view_attach(s->view, s->buffers[frame % 2]);
+	}
+}
+
+static void
+cache_test_frame(struct module_test *base, struct weston_output *output)
+{
+	struct cache_test *test = container_of(base, struct cache_test, base);
+	struct weston_repaint_histogram *hist =
+		&output->repaint_stats.hist[WESTON_REPAINT_STAT_TIME_US];
+	int x = VIEW_SIZE / 2;
+	int y = VIEW_SIZE / 2;
+	int frame, i;
+
+	if (test->step > 0)
+		test_client_drain(&test->client);
+
+	switch (test->step++) {
+	case 0:
+		/* An opaque blue background over the whole output, and a
+		 * red buffer on the view above. */
+		test_client_init(&test->client, base->compositor);
+		test->background =
+			module_test_create_view(base, output->x, output->y,
+						output->width, output->height,
+						true);
+		weston_surface_set_color(test->background->surface,
+					 0.0, 0.0, 1.0, 1.0);
+		weston_surface_damage(test->background->surface);
+
+		test->view = module_test_create_view(base,
+						     output->x, output->y,
+						     VIEW_SIZE, VIEW_SIZE,
+						     false);
+		test->buffer = test_client_create_buffer(&test->client,
+							 VIEW_SIZE, RED);
+		view_attach(test->view, test->buffer);
+		return;
+	case 1:
+		check_pixel(output, x, y, RED);
+
+		/* Attaching the buffer again reuses its cached image, which
+		 * must show the new contents. */
+		buffer_fill(test->buffer, GREEN);
+		view_attach(test->view, test->buffer);
+		return;
+	case 2:
+		check_pixel(output, x, y, GREEN);
+
+		/* The buffer goes away while the renderer caches an image
+		 * of it, leaving the view without contents. */
+		wl_resource_destroy(test->buffer);
+		weston_surface_damage(test->view->surface);
+		return;
+	case 3:
+		check_pixel(output, x, y, BLUE);
+
+		/* A new buffer, maybe at the address of the old one. */
+		test->buffer = test_client_create_buffer(&test->client,
+							 VIEW_SIZE, WHITE);
+		view_attach(test->view, test->buffer);
+		return;
+	case 4:
+		check_pixel(output, x, y, WHITE);
+		view_set_alpha(test->view, 0.5);
+		return;
+	case 5:
+		check_pixel(output, x, y, blend(WHITE, BLUE, 0.5));
+
+		/* The cached mask of the view must follow a new alpha. */
+		view_set_alpha(test->view, 0.25);
+		return;
+	case 6:
+		check_pixel(output, x, y, blend(WHITE, BLUE, 0.25));
+		view_set_alpha(test->view, 1.0);
+		return;
+	case 7:
+		check_pixel(output, x, y, WHITE);
+
+		stress_start(test, output);
+		return;
+	}
+
+	/* Average over the repaints of the stress frame commits. */
+	frame = test->step - 9;
+	if (frame == 0) {
+		test->stress_usec = hist->sum;
+		test->stress_repaints = hist->count;
+	}
+
+	if (frame < STRESS_FRAMES) {
+		stress_frame(test, frame);
+		return;
+	}
+
+	test->stress_usec = hist->sum - test->stress_usec;
+	test->stress_repaints = hist->count - test->stress_repaints;
+
+	/* The last commit of the first surface was its green buffer. */
+	check_pixel(output, STRESS_SIZE / 2, VIEW_SIZE + STRESS_SIZE / 2,
+		    blend(GREEN, BLUE, 0.5));
+
+	fprintf(stderr, "%d clients, %d translucent surfaces: "
+		"%.1f us per repaint\n", STRESS_CLIENTS,
+		STRESS_CLIENTS * STRESS_SURFACES,
+		(double) test->stress_usec / test->stress_repaints);
+
+	for (i = 0; i < STRESS_CLIENTS; i++)
+		test_client_fini(&test->stress_clients[i]);
+	test_client_fini(&test->client);
+
+	for (i = 0; i < STRESS_CLIENTS * STRESS_SURFACES; i++)
+		weston_surface_destroy(test->stress[i].view->surface);
+	weston_surface_destroy(test->view->surface);
+	weston_surface_destroy(test->background->surface);
+	module_test_finish(&test->base);
+	free(test);
+}
+
+struct module_test *
+module_test_create(struct weston_compositor *compositor)
+{
+	struct cache_test *test;
+
+	test = zalloc(sizeof *test);
+	if (!test)
+		return NULL;
+
+	test->base.frame_func = cache_test_frame;
+
+	return &test->base;
+}
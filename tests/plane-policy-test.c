@@ -0,0 +1,210 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "src/plane-policy.h"
+
+#define REFRESH_MHZ	60000
+#define FRAME_MSEC	16
+
+/* A made up view: period is how often it updates, 0 for never. */
+struct fake_view {
+	uint32_t width, height;
+	int period;
+	int content;
+	bool on_overlay;
+};
+
+/* Runs one frame of the policy over the views, placing every allowed
+ * view, the way the DRM backend does when the kernel accepts them. */
+static void
+run_frame(struct plane_policy *policy, int64_t now,
+	  struct fake_view *views, int count, int planes)
+{
+	int handles[8];
+	int i;
+
+	assert(count <= (int)ARRAY_LENGTH(handles));
+
+	plane_policy_begin(policy, now, REFRESH_MHZ);
+	for (i = 0; i < count; i++) {
+		if (views[i].period && now % views[i].period < FRAME_MSEC)
+			views[i].content++;
+
+		handles[i] = plane_policy_add(policy, &views[i],
+					      (void *)(intptr_t)views[i].content,
+					      false,
+					      views[i].width * views[i].height,
+					      views[i].width * views[i].height);
+	}
+
+	plane_policy_choose(policy, planes);
+
+	for (i = 0; i < count; i++) {
+		views[i].on_overlay = plane_policy_allowed(policy, handles[i]);
+		if (views[i].on_overlay)
+			plane_policy_placed(policy, handles[i]);
+	}
+	plane_policy_end(policy);
+}
+
+static int64_t
+run_frames(struct plane_policy *policy, int64_t now, int frames,
+	   struct fake_view *views, int count, int planes)
+{
+	int i;
+
+	for (i = 0; i < frames; i++, now += FRAME_MSEC)
+		run_frame(policy, now, views, count, planes);
+
+	return now;
+}
+
+TEST(static_view_stays_on_primary)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view view = { 1920, 1080, 0, 0, false };
+
+	run_frames(policy, 0, 120, &view, 1, 1);
+	assert(!view.on_overlay);
+
+	plane_policy_destroy(policy);
+}
+
+TEST(video_goes_to_overlay)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view view = { 1280, 720, 32, 0, false };
+
+	run_frames(policy, 0, 60, &view, 1, 1);
+	assert(view.on_overlay);
+
+	plane_policy_destroy(policy);
+}
+
+TEST(busiest_view_wins_the_plane)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view views[] = {
+		{ 320, 240, 32, 0, false },
+		{ 1280, 720, 32, 0, false },
+		{ 640, 480, 16, 0, false },
+	};
+	int64_t now;
+
+	now = run_frames(policy, 0, 60, views, ARRAY_LENGTH(views), 1);
+	assert(!views[0].on_overlay);
+	assert(views[1].on_overlay);
+	assert(!views[2].on_overlay);
+
+	run_frames(policy, now, 60, views, ARRAY_LENGTH(views), 2);
+	assert(!views[0].on_overlay);
+	assert(views[1].on_overlay);
+	assert(views[2].on_overlay);
+
+	plane_policy_destroy(policy);
+}
+
+TEST(incumbent_keeps_the_plane)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view views[] = {
+		{ 1280, 720, 32, 0, false },
+		{ 1280, 760, 32, 0, false },
+	};
+	int64_t now;
+
+	/* The first view gets the plane before the second shows up... */
+	now = run_frames(policy, 0, 60, views, 1, 1);
+	assert(views[0].on_overlay);
+
+	/* ...and keeps it, the second is not better by enough. */
+	now = run_frames(policy, now, 120, views, 2, 1);
+	assert(views[0].on_overlay);
+	assert(!views[1].on_overlay);
+
+	/* A much busier view takes it over. */
+	views[1].period = FRAME_MSEC;
+	run_frames(policy, now, 60, views, 2, 1);
+	assert(!views[0].on_overlay);
+	assert(views[1].on_overlay);
+
+	plane_policy_destroy(policy);
+}
+
+TEST(idle_view_leaves_the_overlay)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view view = { 1280, 720, 32, 0, false };
+	int64_t now;
+	int i;
+
+	now = run_frames(policy, 0, 60, &view, 1, 1);
+	assert(view.on_overlay);
+
+	/* Slowing down to where it saves less than a promotion costs
+	 * does not move it back yet. */
+	view.period = 200;
+	now = run_frames(policy, now, 60, &view, 1, 1);
+	assert(view.on_overlay);
+
+	view.period = 0;
+	for (i = 0; i < 120 && view.on_overlay; i++, now += FRAME_MSEC)
+		run_frame(policy, now, &view, 1, 1);
+	assert(!view.on_overlay);
+
+	/* Never bounces back while idle. */
+	run_frames(policy, now, 120, &view, 1, 1);
+	assert(!view.on_overlay);
+
+	plane_policy_destroy(policy);
+}
+
+TEST(forgotten_view_starts_over)
+{
+	struct plane_policy *policy = plane_policy_create();
+	struct fake_view view = { 1280, 720, 32, 0, false };
+	int64_t now;
+
+	now = run_frames(policy, 0, 60, &view, 1, 1);
+	assert(view.on_overlay);
+
+	/* Gone for longer than the policy remembers. */
+	plane_policy_begin(policy, now + 2000, REFRESH_MHZ);
+	plane_policy_end(policy);
+
+	run_frame(policy, now + 2000 + FRAME_MSEC, &view, 1, 1);
+	assert(!view.on_overlay);
+
+	plane_policy_destroy(policy);
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks compress_bands() against the quadratic merge it replaced, and
+ * prints the cost of both over fragmented damage: the lines a terminal
+ * redraws, cut by the windows stacked above it.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "src/region-bands.h"
+
+#define LINE_HEIGHT	16
+#define CELL_WIDTH	8
+#define ROUNDS		200
+
+static bool
+merge_down(const pixman_box32_t *a, const pixman_box32_t *b,
+	   pixman_box32_t *merge)
+{
+	if (a->x1 == b->x1 && a->x2 == b->x2 && a->y1 == b->y2) {
+		merge->x1 = a->x1;
+		merge->x2 = a->x2;
+		merge->y1 = b->y1;
+		merge->y2 = a->y2;
+		return true;
+	}
+	return false;
+}
+
+/* The previous implementation, comparing every rectangle against every
+ * rectangle merged so far. */
+static int
+reference_compress_bands(const pixman_box32_t *inrects, int nrects,
+			 pixman_box32_t **outrects)
+{
+	bool merged = false;
+	pixman_box32_t *out, merge_rect;
+	int i, j, nout;
+
+	if (!nrects) {
+		*outrects = NULL;
+		return 0;
+	}
+
+	out = malloc(sizeof(pixman_box32_t) * nrects);
+	assert(out);
+	out[0] = inrects[0];
+	nout = 1;
+	for (i = 1; i < nrects; i++) {
+		merged = false;
+		for (j = 0; j < nout; j++) {
+			merged = merge_down(&inrects[i], &out[j], &merge_rect);
+			if (merged) {
+				out[j] = merge_rect;
+				break;
+			}
+		}
+		if (!merged) {
+			out[nout] = inrects[i];
+			nout++;
+		}
+	}
+	*outrects = out;
+	return nout;
+}
+
+static void
+check_region(pixman_region32_t *region)
+{
+	pixman_box32_t *rects, *out, *ref;
+	int nrects, nout, nref;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	nout = compress_bands(rects, nrects, &out);
+	nref = reference_compress_bands(rects, nrects, &ref);
+
+	assert(nout == nref);
+	assert(nout == 0 || memcmp(out, ref, nout * sizeof *out) == 0);
+
+	free(out);
+	free(ref);
+}
+
+/* Damage of a terminal of the given size in cells at x, y: each damaged
+ * line is redrawn up to its last changed cell. */
+static void
+terminal_damage(pixman_region32_t *region, int x, int y,
+		int columns, int lines, int damaged)
+{
+	int i, line;
+
+	pixman_region32_init(region);
+	for (i = 0; i < damaged; i++) {
+		line = rand() % lines;
+		pixman_region32_union_rect(region, region,
+					   x, y + line * LINE_HEIGHT,
+					   (1 + rand() % columns) * CELL_WIDTH,
+					   LINE_HEIGHT);
+	}
+}
+
+/* Cuts the region with a few windows stacked above it, the way the
+ * clip of a view does. */
+static void
+subtract_windows(pixman_region32_t *region, int windows,
+		 int width, int height)
+{
+	pixman_region32_t window;
+	int i;
+
+	for (i = 0; i < windows; i++) {
+		pixman_region32_init_rect(&window,
+					  rand() % width, rand() % height,
+					  50 + rand() % (width / 3),
+					  50 + rand() % (height / 3));
+		pixman_region32_subtract(region, region, &window);
+		pixman_region32_fini(&window);
+	}
+}
+
+static double
+elapsed_nsec(const struct timespec *begin)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - begin->tv_sec) * 1e9 + (t.tv_nsec - begin->tv_nsec);
+}
+
+TEST(empty_region)
+{
+	pixman_box32_t dummy, *out = &dummy;
+
+	assert(compress_bands(NULL, 0, &out) == 0);
+	assert(out == NULL);
+}
+
+TEST(column_cut_into_bands_is_merged)
+{
+	/* A tall rectangle on the left, cut into bands by short
+	 * rectangles of different widths on the right. */
+	static const pixman_box32_t rects[] = {
+		{ 0, 0, 10, 10 }, { 20, 0, 30, 10 },
+		{ 0, 10, 10, 20 }, { 20, 10, 40, 20 },
+		{ 0, 20, 10, 30 },
+	};
+	pixman_box32_t *out;
+	int n;
+
+	n = compress_bands(rects, ARRAY_LENGTH(rects), &out);
+	assert(n == 3);
+	assert(out[0].x1 == 0 && out[0].y1 == 0);
+	assert(out[0].x2 == 10 && out[0].y2 == 30);
+	assert(out[1].x1 == 20 && out[1].x2 == 30 && out[1].y2 == 10);
+	assert(out[2].x1 == 20 && out[2].x2 == 40 && out[2].y1 == 10);
+	free(out);
+}
+
+TEST(gaps_and_other_widths_are_kept)
+{
+	static const pixman_box32_t rects[] = {
+		{ 0, 0, 10, 10 },
+		{ 0, 12, 10, 20 },
+		{ 0, 20, 12, 30 },
+	};
+	pixman_box32_t *out;
+	int n;
+
+	n = compress_bands(rects, ARRAY_LENGTH(rects), &out);
+	assert(n == 3);
+	assert(memcmp(out, rects, sizeof rects) == 0);
+	free(out);
+}
+
+TEST(matches_reference_on_random_regions)
+{
+	pixman_region32_t region;
+	int i;
+
+	srand(1);
+	for (i = 0; i < 500; i++) {
+		terminal_damage(&region, rand() % 100, rand() % 100,
+				20 + rand() % 100, 10 + rand() % 50,
+				rand() % 60);
+		subtract_windows(&region, rand() % 8, 1920, 1080);
+		check_region(&region);
+		pixman_region32_fini(&region);
+	}
+}
+
+TEST(benchmark_terminal_damage)
+{
+	static const int windows[] = { 0, 4, 16, 64 };
+	pixman_region32_t region;
+	pixman_box32_t *rects, *out;
+	struct timespec begin;
+	double linear, quadratic;
+	unsigned int i;
+	int j, nrects, nout;
+
+	srand(2);
+	for (i = 0; i < ARRAY_LENGTH(windows); i++) {
+		/* A 160x60 terminal redrawing most of its lines. */
+		terminal_damage(&region, 0, 0, 160, 60, 200);
+		subtract_windows(&region, windows[i], 160 * CELL_WIDTH,
+				 60 * LINE_HEIGHT);
+		check_region(&region);
+		rects = pixman_region32_rectangles(&region, &nrects);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (j = 0; j < ROUNDS; j++) {
+			nout = compress_bands(rects, nrects, &out);
+			free(out);
+		}
+		linear = elapsed_nsec(&begin) / ROUNDS;
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (j = 0; j < ROUNDS; j++) {
+			reference_compress_bands(rects, nrects, &out);
+			free(out);
+		}
+		quadratic = elapsed_nsec(&begin) / ROUNDS;
+
+		fprintf(stderr, "%2d windows, %5d rects -> %5d: "
+			"linear %9.1f ns, quadratic %9.1f ns\n",
+			windows[i], nrects, nout, linear, quadratic);
+
+		pixman_region32_fini(&region);
+	}
+}
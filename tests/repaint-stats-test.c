@@ -0,0 +1,269 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Repaints the whole output over a known stack of views a few times and
+ * checks what weston_output_write_repaint_stats() reports for it, then
+ * has the compositor write the repaint-stats file.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "weston-test-module-helper.h"
+#include "shared/helpers.h"
+
+#define FRAMES 16
+#define VIEWS 4
+/* How many more repaints to wait for the repaint-stats file */
+#define FILE_FRAMES 600
+
+struct stats_test {
+	struct module_test base;
+	struct weston_view *views[VIEWS];
+	int step;
+	char dir[64];
+	char *path;
+};
+
+struct stat_line {
+	unsigned count;
+	uint64_t sum, max, p50, p90, p99;
+	unsigned buckets;
+};
+
+static void
+read_stat(FILE *fp, const char *stat, struct stat_line *line)
+{
+	char buf[1024], name[64], key[64];
+	unsigned v;
+	int off, n;
+	char *p;
+
+	rewind(fp);
+	while (fgets(buf, sizeof buf, fp)) {
+		if (sscanf(buf, "%*s %63s count %u sum %" SCNu64 " max %" SCNu64
+			   " p50 %" SCNu64 " p90 %" SCNu64 " p99 %" SCNu64
+			   " %63s%n", name, &line->count, &line->sum,
+			   &line->max, &line->p50, &line->p90, &line->p99,
+			   key, &off) != 8 ||
+		    strcmp(name, stat) != 0)
+			continue;
+
+		assert(strcmp(key, "buckets") == 0);
+
+		/* The buckets add up to the count. */
+		line->buckets = 0;
+		for (p = buf + off; sscanf(p, "%u%n", &v, &n) == 1; p += n)
+			line->buckets += v;
+		assert(line->buckets == line->count);
+		return;
+	}
+
+	assert(!"statistic not found");
+}
+
+static void
+read_totals(FILE *fp, struct weston_output *output,
+	    uint64_t *frames, uint64_t *missed)
+{
+	char buf[1024], name[64];
+
+	rewind(fp);
+	while (fgets(buf, sizeof buf, fp)) {
+		if (sscanf(buf, "output %63s frames %" SCNu64
+			   " missed-vblanks %" SCNu64, name, frames,
+			   missed) == 3 &&
+		    strcmp(name, output->name) == 0)
+			return;
+	}
+
+	assert(!"output totals not found");
+}
+
+static void
+reset_stats(struct weston_output *output)
+{
+	memset(output->repaint_stats.hist, 0,
+	       sizeof output->repaint_stats.hist);
+	output->repaint_stats.frames = 0;
+	output->repaint_stats.missed_vblanks = 0;
+	output->repaint_stats.last_stamp_valid = false;
+}
+
+/* The statistics were reset after the first repaint. Since then the
+ * output was fully repainted FRAMES + 1 times, and as many frames were
+ * presented: the first repaint's but not yet the last one's. Nothing but
+ * the views of the test shows, and no surface has an shm buffer to
+ * upload. */
+static void
+check_stats(struct weston_output *output)
+{
+	const uint64_t repaints = FRAMES + 1;
+	const uint64_t pixels = (uint64_t) output->width * output->height;
+	struct stat_line line;
+	uint64_t frames, missed;
+	FILE *fp;
+
+	fp = tmpfile();
+	assert(fp);
+	weston_output_write_repaint_stats(output, fp);
+	fflush(fp);
+
+	read_totals(fp, output, &frames, &missed);
+	assert(frames == repaints);
+	assert(missed == 0);
+
+	read_stat(fp, "repaint-us", &line);
+	assert(line.count == repaints);
+	assert(line.p50 <= line.p90 && line.p90 <= line.p99);
+	assert(line.p99 <= line.max);
+
+	read_stat(fp, "damage-pixels", &line);
+	assert(line.count == repaints);
+	assert(line.max == pixels);
+	assert(line.sum == repaints * pixels);
+
+	read_stat(fp, "views", &line);
+	assert(line.count == repaints);
+	assert(line.max == VIEWS);
+	assert(line.sum == repaints * VIEWS);
+
+	read_stat(fp, "uploads", &line);
+	assert(line.count == repaints);
+	assert(line.sum == 0);
+
+	read_stat(fp, "missed-vblanks", &line);
+	assert(line.count == frames);
+	assert(line.sum == 0);
+
+	fclose(fp);
+}
+
+static void
+start_file(struct stats_test *test)
+{
+	strcpy(test->dir, "/tmp/weston-repaint-stats-XXXXXX");
+	assert(mkdtemp(test->dir));
+	assert(asprintf(&test->path, "%s/stats", test->dir) > 0);
+
+	assert(weston_compositor_set_repaint_stats(test->base.compositor,
+						   test->path, 1) == 0);
+}
+
+/* Returns false until the compositor has written the file. */
+static bool
+check_file(struct stats_test *test, struct weston_output *output)
+{
+	struct stat_line line;
+	uint64_t frames, missed;
+	unsigned interval;
+	char *tmp;
+	FILE *fp;
+
+	fp = fopen(test->path, "r");
+	if (!fp)
+		return false;
+
+	assert(fscanf(fp, "interval-ms %u", &interval) == 1);
+	assert(interval == 1);
+	read_totals(fp, output, &frames, &missed);
+	assert(frames >= FRAMES + 1);
+	read_stat(fp, "views", &line);
+	read_stat(fp, "missed-vblanks", &line);
+	fclose(fp);
+
+	/* Written to the temporary file and renamed over the path. */
+	assert(asprintf(&tmp, "%s.tmp", test->path) > 0);
+	assert(access(tmp, F_OK) < 0);
+	free(tmp);
+
+	assert(weston_compositor_set_repaint_stats(test->base.compositor,
+						   NULL, 0) == 0);
+	assert(unlink(test->path) == 0);
+	assert(rmdir(test->dir) == 0);
+
+	return true;
+}
+
+static void
+stats_test_frame(struct module_test *base, struct weston_output *output)
+{
+	struct stats_test *test = container_of(base, struct stats_test, base);
+	int i, step = test->step++;
+
+	if (step == 0) {
+		/* An opaque view hiding everything else, with the others
+		 * on top of it. */
+		test->views[0] =
+			module_test_create_view(&test->base,
+						output->x, output->y,
+						output->width, output->height,
+						true);
+		for (i = 1; i < VIEWS; i++)
+			test->views[i] =
+				module_test_create_view(&test->base,
+							output->x + 20 * i,
+							output->y + 20 * i,
+							100, 100, false);
+		reset_stats(output);
+	} else if (step == FRAMES + 1) {
+		check_stats(output);
+		start_file(test);
+	} else if (step > FRAMES + 1) {
+		if (check_file(test, output)) {
+			for (i = 0; i < VIEWS; i++)
+				weston_surface_destroy(test->views[i]->surface);
+			module_test_finish(&test->base);
+			free(test->path);
+			free(test);
+			return;
+		}
+
+		assert(step < FRAMES + 1 + FILE_FRAMES);
+	}
+
+	weston_output_damage(output);
+}
+
+struct module_test *
+module_test_create(struct weston_compositor *compositor)
+{
+	struct stats_test *test;
+
+	test = zalloc(sizeof *test);
+	if (!test)
+		return NULL;
+
+	test->base.frame_func = stats_test_frame;
+
+	return &test->base;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks that views hidden by an opaque view above are marked occluded
+ * after a repaint, and that views peeking out are not.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "weston-test-module-helper.h"
+#include "shared/helpers.h"
+
+#define BACKGROUND_VIEWS	8
+
+struct occlusion_test {
+	struct module_test base;
+	struct weston_view *cover;
+	struct weston_view *peek;
+	struct weston_view *background[BACKGROUND_VIEWS];
+	int step;
+};
+
+static void
+occlusion_test_frame(struct module_test *base, struct weston_output *output)
+{
+	struct occlusion_test *test =
+		container_of(base, struct occlusion_test, base);
+	int i;
+
+	switch (test->step++) {
+	case 0:
+		/* Background views stacked below a covering opaque view,
+		 * plus one view sticking out of the cover. */
+		for (i = 0; i < BACKGROUND_VIEWS; i++)
+			test->background[i] =
+				module_test_create_view(&test->base,
+							output->x + 10 * i,
+							output->y + 10 * i,
+							100, 100, i % 2);
+		test->peek = module_test_create_view(&test->base,
+						     output->x + 200,
+						     output->y + 200,
+						     100, 100, true);
+		test->cover = module_test_create_view(&test->base,
+						      output->x, output->y,
+						      250, 250, true);
+		weston_output_schedule_repaint(output);
+		return;
+	case 1:
+		for (i = 0; i < BACKGROUND_VIEWS; i++)
+			assert(weston_view_is_occluded(test->background[i],
+						       output));
+		assert(!weston_view_is_occluded(test->peek, output));
+		assert(!weston_view_is_occluded(test->cover, output));
+		assert(output->occluded_views >= BACKGROUND_VIEWS);
+
+		/* A translucent cover hides nothing. */
+		pixman_region32_clear(&test->cover->surface->opaque);
+		weston_view_geometry_dirty(test->cover);
+		weston_view_update_transform(test->cover);
+		weston_view_schedule_repaint(test->cover);
+		return;
+	case 2:
+		for (i = 0; i < BACKGROUND_VIEWS; i++)
+			assert(!weston_view_is_occluded(test->background[i],
+							output));
+		break;
+	}
+
+	for (i = 0; i < BACKGROUND_VIEWS; i++)
+		weston_surface_destroy(test->background[i]->surface);
+	weston_surface_destroy(test->peek->surface);
+	weston_surface_destroy(test->cover->surface);
+	module_test_finish(&test->base);
+	free(test);
+}
+
+struct module_test *
+module_test_create(struct weston_compositor *compositor)
+{
+	struct occlusion_test *test;
+
+	test = zalloc(sizeof *test);
+	if (!test)
+		return NULL;
+
+	test->base.frame_func = occlusion_test_frame;
+
+	return &test->base;
+}
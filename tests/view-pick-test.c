@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks weston_compositor_pick_view() against a linear walk of the view
+ * list and prints the cost of both for a growing number of views.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include "weston-test-module-helper.h"
+#include "shared/helpers.h"
+
+#define VIEW_SIZE	64
+#define PICKS		20000
+
+static const int view_counts[] = { 16, 64, 256, 1024 };
+
+struct pick_test {
+	struct module_test base;
+	struct weston_surface **surfaces;
+	int count;
+	unsigned int step;
+	wl_fixed_t *points;
+};
+
+static double
+elapsed_nsec(const struct timespec *begin)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - begin->tv_sec) * 1e9 + (t.tv_nsec - begin->tv_nsec);
+}
+
+static struct weston_view *
+linear_pick(struct weston_compositor *compositor, wl_fixed_t x, wl_fixed_t y)
+{
+	struct weston_view *view;
+	wl_fixed_t vx, vy;
+	int ix, iy;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!pixman_region32_contains_point(&view->transform.boundingbox,
+						    wl_fixed_to_int(x),
+						    wl_fixed_to_int(y), NULL))
+			continue;
+
+		weston_view_from_global_fixed(view, x, y, &vx, &vy);
+		ix = wl_fixed_to_int(vx);
+		iy = wl_fixed_to_int(vy);
+
+		if (!pixman_region32_contains_point(&view->surface->input,
+						    ix, iy, NULL))
+			continue;
+
+		if (view->geometry.scissor_enabled &&
+		    !pixman_region32_contains_point(&view->geometry.scissor,
+						    ix, iy, NULL))
+			continue;
+
+		return view;
+	}
+
+	return NULL;
+}
+
+static void
+check_picks(struct pick_test *test)
+{
+	wl_fixed_t vx, vy;
+	int i;
+
+	for (i = 0; i < PICKS; i++) {
+		wl_fixed_t x = test->points[2 * i];
+		wl_fixed_t y = test->points[2 * i + 1];
+
+		assert(weston_compositor_pick_view(test->base.compositor,
+						   x, y, &vx, &vy) ==
+		       linear_pick(test->base.compositor, x, y));
+	}
+}
+
+static void
+create_views(struct pick_test *test, struct weston_output *output, int count)
+{
+	struct weston_view *view;
+	int i, x, y;
+
+	test->surfaces = zalloc(count * sizeof *test->surfaces);
+	assert(test->surfaces);
+	test->count = count;
+
+	for (i = 0; i < count; i++) {
+		x = output->x + rand() % output->width;
+		y = output->y + rand() % output->height;
+		view = module_test_create_view(&test->base, x, y,
+					       VIEW_SIZE, VIEW_SIZE, false);
+		test->surfaces[i] = view->surface;
+	}
+}
+
+static void
+destroy_views(struct pick_test *test)
+{
+	int i;
+
+	for (i = 0; i < test->count; i++)
+		weston_surface_destroy(test->surfaces[i]);
+
+	free(test->surfaces);
+	test->surfaces = NULL;
+	test->count = 0;
+}
+
+/* Moves some views without a view list rebuild, so the grid has to
+ * follow the geometry changes on its own. */
+static void
+move_views(struct pick_test *test, struct weston_output *output)
+{
+	struct weston_view *view;
+	int i;
+
+	for (i = 0; i < test->count; i += 3) {
+		view = container_of(test->surfaces[i]->views.next,
+				    struct weston_view, surface_link);
+		weston_view_set_position(view,
+					 output->x + rand() % output->width,
+					 output->y + rand() % output->height);
+		weston_view_update_transform(view);
+	}
+}
+
+static void
+benchmark(struct pick_test *test)
+{
+	struct timespec begin;
+	wl_fixed_t vx, vy;
+	double grid, linear;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < PICKS; i++)
+		weston_compositor_pick_view(test->base.compositor,
+					    test->points[2 * i],
+					    test->points[2 * i + 1],
+					    &vx, &vy);
+	grid = elapsed_nsec(&begin) / PICKS;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < PICKS; i++)
+		linear_pick(test->base.compositor,
+			    test->points[2 * i], test->points[2 * i + 1]);
+	linear = elapsed_nsec(&begin) / PICKS;
+
+	fprintf(stderr, "%5d views: pick %8.1f ns, linear walk %8.1f ns\n",
+		test->count, grid, linear);
+}
+
+static void
+create_points(struct pick_test *test, struct weston_output *output)
+{
+	int i;
+
+	test->points = malloc(PICKS * 2 * sizeof *test->points);
+	assert(test->points);
+	for (i = 0; i < PICKS; i++) {
+		test->points[2 * i] =
+			wl_fixed_from_int(output->x + rand() % output->width);
+		test->points[2 * i + 1] =
+			wl_fixed_from_int(output->y + rand() % output->height);
+	}
+}
+
+static void
+pick_test_frame(struct module_test *base, struct weston_output *output)
+{
+	struct pick_test *test = container_of(base, struct pick_test, base);
+
+	if (!test->points)
+		create_points(test, output);
+
+	/* The views created in the previous step are in the view list now. */
+	if (test->count > 0) {
+		check_picks(test);
+		benchmark(test);
+
+		move_views(test, output);
+		check_picks(test);
+
+		destroy_views(test);
+		check_picks(test);
+	}
+
+	if (test->step == ARRAY_LENGTH(view_counts)) {
+		module_test_finish(&test->base);
+		free(test->points);
+		free(test);
+		return;
+	}
+
+	create_views(test, output, view_counts[test->step++]);
+	weston_output_schedule_repaint(output);
+}
+
+struct module_test *
+module_test_create(struct weston_compositor *compositor)
+{
+	struct pick_test *test;
+
+	test = zalloc(sizeof *test);
+	if (!test)
+		return NULL;
+
+	test->base.frame_func = pick_test_frame;
+	srand(1);
+
+	return &test->base;
+}
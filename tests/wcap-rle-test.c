@@ -0,0 +1,302 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Encodes a frame sequence with every run length coding kernel the CPU
+ * supports, checks they all produce the same bytes and decode back to
+ * the input, and reports their throughput.
+ *
+ * Usage: wcap-rle-test [capture.wcap]
+ *
+ * Without a file a synthetic sequence of a moving window over a static
+ * background is used.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "wcap/wcap-decode.h"
+#include "wcap/wcap-rle.h"
+
+#define MAX_FRAMES	64
+#define SYNTH_WIDTH	1280
+#define SYNTH_HEIGHT	720
+#define SYNTH_FRAMES	32
+#define ROUNDS		4
+
+struct sequence {
+	int width, height;
+	int count;
+	uint32_t *frames[MAX_FRAMES];
+};
+
+static const struct {
+	enum wcap_rle_impl impl;
+	const char *name;
+} impls[] = {
+	{ WCAP_RLE_SCALAR, "scalar" },
+	{ WCAP_RLE_SSE2, "sse2" },
+	{ WCAP_RLE_AVX2, "avx2" },
+};
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static uint32_t *
+alloc_frame(int width, int height)
+{
+	uint32_t *frame;
+
+	frame = calloc(width * height, sizeof *frame);
+	assert(frame);
+
+	return frame;
+}
+
+static void
+load_sequence(struct sequence *seq, const char *filename)
+{
+	struct wcap_decoder *decoder;
+	int size;
+
+	decoder = wcap_decoder_create(filename);
+	if (!decoder) {
+		fprintf(stderr, "failed to open %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	seq->width = decoder->width;
+	seq->height = decoder->height;
+	size = seq->width * seq->height * 4;
+	seq->count = 0;
+	while (seq->count < MAX_FRAMES && wcap_decoder_get_frame(decoder)) {
+		seq->frames[seq->count] = alloc_frame(seq->width, seq->height);
+		memcpy(seq->frames[seq->count++], decoder->frame, size);
+	}
+
+	wcap_decoder_destroy(decoder);
+}
+
+static void
+synthesize_sequence(struct sequence *seq)
+{
+	uint32_t *f;
+	int i, x, y, wx, wy;
+
+	seq->width = SYNTH_WIDTH;
+	seq->height = SYNTH_HEIGHT;
+	seq->count = SYNTH_FRAMES;
+
+	srand(1);
+	for (i = 0; i < seq->count; i++) {
+		f = alloc_frame(seq->width, seq->height);
+		seq->frames[i] = f;
+
+		/* A vertical gradient, long runs of the same delta. */
+		for (y = 0; y < seq->height; y++)
+			for (x = 0; x < seq->width; x++)
+				f[y * seq->width + x] =
+					0xff000000 | (y * 255 / seq->height);
+
+		/* A window with text-like noise moving across it. */
+		wx = i * 24;
+		wy = i * 12;
+		for (y = wy; y < wy + 300 && y < seq->height; y++)
+			for (x = wx; x < wx + 400 && x < seq->width; x++)
+				f[y * seq->width + x] = (rand() % 8) ?
+					0xffeeeeee : 0xff202020;
+	}
+}
+
+static uint32_t *
+encode_frame(const struct sequence *seq, const uint32_t *next,
+	     uint32_t *frame, uint32_t *out)
+{
+	struct wcap_rle_encoder encoder;
+	int y;
+
+	wcap_rle_encoder_init(&encoder, out);
+	for (y = 0; y < seq->height; y++)
+		wcap_rle_encode(&encoder, next + y * seq->width,
+				frame + y * seq->width, seq->width);
+
+	return wcap_rle_encoder_finish(&encoder);
+}
+
+static void
+decode_frame(const struct sequence *seq, const uint32_t *p,
+	     const uint32_t *end, uint32_t *frame)
+{
+	int x = 0, j, n, l;
+	uint32_t *d = frame;
+
+	while (p < end) {
+		l = *p >> 24;
+		if (l < 0xe0)
+			j = l + 1;
+		else
+			j = 1 << (l - 0xe0 + 7);
+
+		for (; j > 0; j -= n) {
+			n = j;
+			if (n > seq->width - x)
+				n = seq->width - x;
+			wcap_rle_apply(d + x, *p, n);
+			x += n;
+			if (x == seq->width) {
+				x = 0;
+				d += seq->width;
+			}
+		}
+		p++;
+	}
+
+	assert(d == frame + seq->width * seq->height && x == 0);
+}
+
+static void
+check_impl(const struct sequence *seq, enum wcap_rle_impl impl,
+	   uint32_t *out, uint32_t *ref_out)
+{
+	uint32_t *frame, *ref_frame, *decoded, *end, *ref_end;
+	int i, size = seq->width * seq->height;
+
+	frame = alloc_frame(seq->width, seq->height);
+	ref_frame = alloc_frame(seq->width, seq->height);
+	decoded = alloc_frame(seq->width, seq->height);
+
+	for (i = 0; i < seq->count; i++) {
+		wcap_rle_set_impl(WCAP_RLE_SCALAR);
+		ref_end = encode_frame(seq, seq->frames[i], ref_frame, ref_out);
+
+		wcap_rle_set_impl(impl);
+		end = encode_frame(seq, seq->frames[i], frame, out);
+		assert(end - out == ref_end - ref_out);
+		assert(memcmp(out, ref_out, (end - out) * 4) == 0);
+
+		decode_frame(seq, out, end, decoded);
+		assert(memcmp(decoded, seq->frames[i], size * 4) == 0);
+	}
+
+	free(frame);
+	free(ref_frame);
+	free(decoded);
+}
+
+static void
+benchmark_impl(const struct sequence *seq, const char *name,
+	       uint32_t *out)
+{
+	uint32_t *frame, *decoded, *end;
+	double encode_time = 0, decode_time = 0, mb;
+	size_t encoded = 0;
+	int i, r;
+
+	frame = alloc_frame(seq->width, seq->height);
+	decoded = alloc_frame(seq->width, seq->height);
+
+	for (r = 0; r < ROUNDS; r++) {
+		memset(frame, 0, seq->width * seq->height * 4);
+		memset(decoded, 0, seq->width * seq->height * 4);
+		for (i = 0; i < seq->count; i++) {
+			reset_timer();
+			end = encode_frame(seq, seq->frames[i], frame, out);
+			encode_time += read_timer();
+
+			reset_timer();
+			decode_frame(seq, out, end, decoded);
+			decode_time += read_timer();
+
+			encoded += (end - out) * 4;
+		}
+	}
+
+	mb = (double) seq->width * seq->height * 4 *
+		seq->count * ROUNDS / (1024 * 1024);
+	printf("%-8s encode %8.1f MB/s, decode %8.1f MB/s, "
+	       "ratio %5.1f:1\n", name, mb / encode_time, mb / decode_time,
+	       mb * 1024 * 1024 / encoded);
+
+	free(frame);
+	free(decoded);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sequence seq;
+	uint32_t *out, *ref_out;
+	unsigned int i;
+	int j;
+
+	if (argc > 1)
+		load_sequence(&seq, argv[1]);
+	else
+		synthesize_sequence(&seq);
+
+	printf("%d frames of %dx%d\n", seq.count, seq.width, seq.height);
+
+	/* A run never takes more than one word per pixel. */
+	out = alloc_frame(seq.width, seq.height);
+	ref_out = alloc_frame(seq.width, seq.height);
+
+	for (i = 0; i < sizeof impls / sizeof impls[0]; i++) {
+		if (wcap_rle_set_impl(impls[i].impl) < 0) {
+			printf("%-8s not supported\n", impls[i].name);
+			continue;
+		}
+
+		check_impl(&seq, impls[i].impl, out, ref_out);
+		wcap_rle_set_impl(impls[i].impl);
+		benchmark_impl(&seq, impls[i].name, out);
+	}
+
+	free(out);
+	free(ref_out);
+	for (j = 0; j < seq.count; j++)
+		free(seq.frames[j]);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include "weston-test-module-helper.h"
+#include "shared/helpers.h"
+
+static void
+module_test_frame(struct weston_animation *frame,
+		  struct weston_output *output, uint32_t msecs)
+{
+	struct module_test *test =
+		container_of(frame, struct module_test, frame);
+
+	test->frame_func(test, output);
+}
+
+static void
+module_test_start(void *data)
+{
+	struct module_test *test = data;
+	struct weston_output *output;
+
+	assert(!wl_list_empty(&test->compositor->output_list));
+	output = container_of(test->compositor->output_list.next,
+			      struct weston_output, link);
+
+	test->frame.frame = module_test_frame;
+	wl_list_insert(&output->animation_list, &test->frame.link);
+	weston_output_schedule_repaint(output);
+}
+
+struct weston_view *
+module_test_create_view(struct module_test *test, int x, int y,
+			int width, int height, bool opaque)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(test->compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+
+	surface->width = width;
+	surface->height = height;
+	if (opaque)
+		pixman_region32_union_rect(&surface->opaque, &surface->opaque,
+					   0, 0, width, height);
+
+	weston_view_set_position(view, x, y);
+	weston_layer_entry_insert(&test->layer.view_list, &view->layer_link);
+	weston_view_update_transform(view);
+
+	return view;
+}
+
+void
+module_test_finish(struct module_test *test)
+{
+	wl_list_remove(&test->frame.link);
+	wl_list_remove(&test->layer.link);
+	wl_display_terminate(test->compositor->wl_display);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct module_test *test;
+
+	test = module_test_create(compositor);
+	if (!test)
+		return -1;
+
+	test->compositor = compositor;
+	weston_layer_init(&test->layer, &compositor->cursor_layer.link);
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, module_test_start, test);
+
+	return 0;
+}
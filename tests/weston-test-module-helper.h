@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WESTON_TEST_MODULE_HELPER_H_
+#define _WESTON_TEST_MODULE_HELPER_H_
+
+#include <stdbool.h>
+
+#include "src/compositor.h"
+
+/*
+ * Fixture of the tests that run as a compositor module. The helper
+ * provides module_init(), which creates the test with
+ * module_test_create() and a layer for its views right below the cursor
+ * layer. Once the compositor is idle, the frame function of the test is
+ * called after every repaint of the first output.
+ */
+
+struct module_test;
+
+typedef void (*module_test_frame_func_t)(struct module_test *test,
+					  struct weston_output *output);
+
+struct module_test {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct weston_animation frame;
+	module_test_frame_func_t frame_func;
+};
+
+/* Implemented by each test: allocate the test, which embeds a struct
+ * module_test, and set its frame_func. */
+struct module_test *
+module_test_create(struct weston_compositor *compositor);
+
+struct weston_view *
+module_test_create_view(struct module_test *test, int x, int y,
+			int width, int height, bool opaque);
+
+/* Stops the frame function and the compositor. The views of the test
+ * must be destroyed before, the test itself can be freed after. */
+void
+module_test_finish(struct module_test *test);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Converts a binary timeline log to the JSON the text log has, for the
+ * tools that read that.
+ *
+ * Usage: weston-timeline-convert weston-timeline-<date>.bin > out.log
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/timeline.h"
+#include "src/timeline-binary.h"
+
+/* Things seen so far, by id. Descriptions are kept so the copies the
+ * compositor writes again for each part of the ring are printed once. */
+struct table {
+	char **entries;
+	uint32_t size;
+};
+
+static const char *
+table_get(struct table *table, uint32_t id)
+{
+	if (id >= table->size)
+		return NULL;
+
+	return table->entries[id];
+}
+
+/* Returns 1 if the entry changed. */
+static int
+table_set(struct table *table, uint32_t id, const char *value)
+{
+	char **entries;
+	uint32_t size;
+
+	if (id >= table->size) {
+		size = table->size ? table->size : 64;
+		while (size <= id)
+			size *= 2;
+		entries = realloc(table->entries, size * sizeof *entries);
+		if (!entries) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(entries + table->size, 0,
+		       (size - table->size) * sizeof *entries);
+		table->entries = entries;
+		table->size = size;
+	}
+
+	if (table->entries[id] && strcmp(table->entries[id], value) == 0)
+		return 0;
+
+	free(table->entries[id]);
+	table->entries[id] = strdup(value);
+
+	return 1;
+}
+
+static void
+table_fini(struct table *table)
+{
+	uint32_t i;
+
+	for (i = 0; i < table->size; i++)
+		free(table->entries[i]);
+	free(table->entries);
+}
+
+/* The first description of each object found in the ring, for the
+ * records older than it, and the main surface of each surface. */
+struct description {
+	char *line;
+	uint32_t main_id;
+};
+
+static struct table strings;
+static struct table objects;
+static struct description *found;
+static uint32_t found_size;
+
+/* The string after the fixed part of a record, NULL if there is none. */
+static const char *
+record_string(const struct timeline_record *record, size_t offset)
+{
+	const char *str = (const char *) record + offset;
+	size_t max = record->size - offset;
+
+	if (offset >= record->size || strnlen(str, max) == max)
+		return NULL;
+
+	return str;
+}
+
+static const char *
+string_or_id(uint32_t id)
+{
+	static char buf[32];
+	const char *str = table_get(&strings, id);
+
+	if (str)
+		return str;
+
+	/* Written before the oldest record still in the ring. */
+	snprintf(buf, sizeof buf, "string-%u", id);
+
+	return buf;
+}
+
+static void
+quoted(char *buf, size_t len, const char *str)
+{
+	if (str)
+		snprintf(buf, len, "\"%s\"", str);
+	else
+		snprintf(buf, len, "null");
+}
+
+static void
+print_description(uint32_t id, const char *line)
+{
+	if (table_set(&objects, id, line))
+		printf("%s", line);
+}
+
+static void
+find_description(uint32_t id, const char *line, uint32_t main_id)
+{
+	struct description *tmp;
+	uint32_t size;
+
+	if (id >= found_size) {
+		size = found_size ? found_size : 64;
+		while (size <= id)
+			size *= 2;
+		tmp = realloc(found, size * sizeof *found);
+		if (!tmp) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(tmp + found_size, 0,
+		       (size - found_size) * sizeof *found);
+		found = tmp;
+		found_size = size;
+	}
+
+	if (!found[id].line) {
+		found[id].line = strdup(line);
+		found[id].main_id = main_id;
+	}
+}
+
+/* Objects whose description was overwritten before their use, but that
+ * are described again later in the ring. */
+static void
+ensure_description(uint32_t id)
+{
+	if (table_get(&objects, id) || id >= found_size || !found[id].line)
+		return;
+
+	if (found[id].main_id)
+		ensure_description(found[id].main_id);
+	print_description(id, found[id].line);
+}
+
+static void
+convert_output(const struct timeline_record *record, int print)
+{
+	char name[1100], line[1200];
+
+	quoted(name, sizeof name,
+	       record_string(record, sizeof *record));
+	snprintf(line, sizeof line, "{ \"id\":%u, "
+		 "\"type\":\"weston_output\", \"name\":%s }\n",
+		 record->id, name);
+	if (print)
+		print_description(record->id, line);
+	else
+		find_description(record->id, line, 0);
+}
+
+static void
+convert_surface(const struct timeline_record *record, int print)
+{
+	const uint32_t *main_id = (const uint32_t *) (record + 1);
+	char desc[1100], mainstr[32], line[1200];
+
+	if (record->size < sizeof *record + 8)
+		return;
+
+	if (main_id[0])
+		snprintf(mainstr, sizeof mainstr,
+			 ", \"main_surface\":%u", main_id[0]);
+	else
+		mainstr[0] = '\0';
+
+	quoted(desc, sizeof desc,
+	       record_string(record, sizeof *record + 8));
+	snprintf(line, sizeof line, "{ \"id\":%u, "
+		 "\"type\":\"weston_surface\", \"desc\":%s%s }\n",
+		 record->id, desc, mainstr);
+	if (print)
+		print_description(record->id, line);
+	else
+		find_description(record->id, line, main_id[0]);
+}
+
+static void
+convert_point(const struct timeline_record *record)
+{
+	const struct timeline_point_record *point = (const void *) record;
+	const struct timeline_point_arg *arg;
+	int i, n;
+
+	if (record->size < sizeof *point)
+		return;
+
+	n = (record->size - sizeof *point) / sizeof *arg;
+	arg = (const struct timeline_point_arg *) (point + 1);
+	for (i = 0; i < n; i++)
+		if (arg[i].type == TLT_OUTPUT || arg[i].type == TLT_SURFACE)
+			ensure_description(arg[i].a);
+
+	printf("{ \"T\":[%" PRId64 ", %" PRId64 "], \"N\":\"%s\"",
+	       point->tv_sec, point->tv_nsec, string_or_id(record->id));
+
+	n = (record->size - sizeof *point) / sizeof *arg;
+	arg = (const struct timeline_point_arg *) (point + 1);
+	for (i = 0; i < n; i++, arg++) {
+		switch (arg->type) {
+		case TLT_OUTPUT:
+			printf(", \"wo\":%u", arg->a);
+			break;
+		case TLT_SURFACE:
+			printf(", \"ws\":%u", arg->a);
+			break;
+		case TLT_VBLANK:
+			printf(", \"vblank\":[%" PRId64 ", %u]", arg->b, arg->a);
+			break;
+		case TLT_INT:
+			printf(", \"%s\":%" PRId64, string_or_id(arg->a), arg->b);
+			break;
+		}
+	}
+
+	printf(" }\n");
+}
+
+/* Strings and descriptions are collected in a first pass, and the
+ * records printed in a second. */
+static int
+convert(const struct timeline_binary_header *header, const uint8_t *ring,
+	int print)
+{
+	const struct timeline_record *record;
+	uint64_t offset = header->tail, left = header->used;
+	const char *str;
+
+	while (left > 0) {
+		if (offset + sizeof *record > header->ring_size)
+			return -1;
+
+		record = (const void *) (ring + offset);
+		if (record->size < sizeof *record || record->size % 8 ||
+		    record->size > left ||
+		    offset + record->size > header->ring_size)
+			return -1;
+
+		switch (record->type) {
+		case TLR_STRING:
+			str = record_string(record, sizeof *record);
+			if (str && !print)
+				table_set(&strings, record->id, str);
+			break;
+		case TLR_OUTPUT:
+			convert_output(record, print);
+			break;
+		case TLR_SURFACE:
+			convert_surface(record, print);
+			break;
+		case TLR_POINT:
+			if (print)
+				convert_point(record);
+			break;
+		}
+
+		left -= record->size;
+		offset += record->size;
+		if (offset == header->ring_size)
+			offset = 0;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct timeline_binary_header *header;
+	struct stat st;
+	void *map;
+	int fd, ret;
+	uint32_t i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <binary timeline log>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	header = map;
+	if ((size_t) st.st_size < sizeof *header ||
+	    header->magic != TIMELINE_BINARY_MAGIC ||
+	    header->version != TIMELINE_BINARY_VERSION ||
+	    header->header_size + header->ring_size > (uint64_t) st.st_size ||
+	    header->tail >= header->ring_size ||
+	    header->used > header->ring_size) {
+		fprintf(stderr, "%s is not a binary timeline log\n", argv[1]);
+		munmap(map, st.st_size);
+		return EXIT_FAILURE;
+	}
+
+	ret = convert(header, (const uint8_t *) map + header->header_size, 0);
+	if (ret == 0)
+		ret = convert(header,
+			      (const uint8_t *) map + header->header_size, 1);
+	if (ret < 0)
+		fprintf(stderr, "%s is corrupt\n", argv[1]);
+	if (header->dropped > 0)
+		fprintf(stderr, "%" PRIu64 " older records were overwritten\n",
+			header->dropped);
+
+	munmap(map, st.st_size);
+	table_fini(&strings);
+	table_fini(&objects);
+	for (i = 0; i < found_size; i++)
+		free(found[i].line);
+	free(found);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -36,6 +36,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cairo.h>
 
@@ -98,6 +103,108 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+#ifdef __SSE2__
+/* Y, and the U and V contributions of four pixels, computed exactly like
+ * rgb_to_yuv(). The coefficients above 32767 don't fit the 16 bit
+ * multiplies, so they are split into 32768 and the rest. */
+static inline __m128i
+rgb_to_yuv_sse2(__m128i p, int rshift, int bshift, __m128i *u, __m128i *v)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i low = _mm_set1_epi32(0xffff);
+	__m128i r, g, b, y, ry, by;
+
+	r = _mm_and_si128(_mm_srli_epi32(p, rshift), mask);
+	g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+	b = _mm_and_si128(_mm_srli_epi32(p, bshift), mask);
+
+	/* 19595 * r + 38469 * g + 7472 * b */
+	y = _mm_madd_epi16(_mm_or_si128(r, _mm_slli_epi32(g, 16)),
+			   _mm_set1_epi32(19595 | (5701 << 16)));
+	y = _mm_add_epi32(y, _mm_slli_epi32(g, 15));
+	y = _mm_add_epi32(y, _mm_madd_epi16(b, _mm_set1_epi32(7472)));
+	y = _mm_srli_epi32(y, 16);
+
+	/* 46727 * (r - y) and 36962 * (b - y) */
+	ry = _mm_sub_epi32(r, y);
+	*u = _mm_add_epi32(_mm_slli_epi32(ry, 15),
+			   _mm_madd_epi16(_mm_and_si128(ry, low),
+					  _mm_set1_epi32(13959)));
+	by = _mm_sub_epi32(b, y);
+	*v = _mm_add_epi32(_mm_slli_epi32(by, 15),
+			   _mm_madd_epi16(_mm_and_si128(by, low),
+					  _mm_set1_epi32(4194)));
+
+	return y;
+}
+
+/* Sums the contributions of horizontal pixel pairs and clamps them like
+ * clamp_uv(), giving four chroma samples. */
+static inline __m128i
+clamp_uv_sse2(__m128i a, __m128i b)
+{
+	__m128i even, odd;
+
+	even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+					       _mm_castsi128_ps(b),
+					       _MM_SHUFFLE(2, 0, 2, 0)));
+	odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+					      _mm_castsi128_ps(b),
+					      _MM_SHUFFLE(3, 1, 3, 1)));
+	a = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(even, odd), 18),
+			  _mm_set1_epi32(128));
+	a = _mm_packs_epi32(a, a);
+
+	return _mm_packus_epi16(a, a);
+}
+
+/* Converts eight pixels of two rows, returns the number converted. */
+static int
+convert_to_yv12_sse2(uint32_t format, const uint32_t *p1, const uint32_t *p2,
+		     unsigned char *y1, unsigned char *y2,
+		     unsigned char *u, unsigned char *v, int width)
+{
+	__m128i ya, yb, ua, ub, uc, ud, va, vb, vc, vd, t;
+	int rshift, bshift, x;
+	uint32_t uv;
+
+	if (format == WCAP_FORMAT_XRGB8888) {
+		rshift = 16;
+		bshift = 0;
+	} else if (format == WCAP_FORMAT_XBGR8888) {
+		rshift = 0;
+		bshift = 16;
+	} else {
+		return 0;
+	}
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		ya = rgb_to_yuv_sse2(_mm_loadu_si128((const __m128i *) (p1 + x)),
+				     rshift, bshift, &ua, &va);
+		yb = rgb_to_yuv_sse2(_mm_loadu_si128((const __m128i *) (p1 + x + 4)),
+				     rshift, bshift, &ub, &vb);
+		t = _mm_packs_epi32(ya, yb);
+		_mm_storel_epi64((__m128i *) (y1 + x), _mm_packus_epi16(t, t));
+
+		ya = rgb_to_yuv_sse2(_mm_loadu_si128((const __m128i *) (p2 + x)),
+				     rshift, bshift, &uc, &vc);
+		yb = rgb_to_yuv_sse2(_mm_loadu_si128((const __m128i *) (p2 + x + 4)),
+				     rshift, bshift, &ud, &vd);
+		t = _mm_packs_epi32(ya, yb);
+		_mm_storel_epi64((__m128i *) (y2 + x), _mm_packus_epi16(t, t));
+
+		uv = _mm_cvtsi128_si32(clamp_uv_sse2(_mm_add_epi32(ua, uc),
+						     _mm_add_epi32(ub, ud)));
+		memcpy(u + x / 2, &uv, 4);
+		uv = _mm_cvtsi128_si32(clamp_uv_sse2(_mm_add_epi32(va, vc),
+						     _mm_add_epi32(vb, vd)));
+		memcpy(v + x / 2, &uv, 4);
+	}
+
+	return x;
+}
+#endif
+
 static void
 convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 {
@@ -105,6 +212,9 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 	uint32_t *p1, *p2, *end;
 	int i, u_accum, v_accum, stride0, stride1;
 	uint32_t format = decoder->format;
+#ifdef __SSE2__
+	int n;
+#endif
 
 	stride0 = decoder->width;
 	stride1 = decoder->width / 2;
@@ -117,6 +227,17 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 		p2 = p1 + decoder->width;
 		end = p1 + decoder->width;
 
+#ifdef __SSE2__
+		n = convert_to_yv12_sse2(format, p1, p2, y1, y2, u, v,
+					 decoder->width);
+		p1 += n;
+		p2 += n;
+		y1 += n;
+		y2 += n;
+		u += n / 2;
+		v += n / 2;
+#endif
+
 		while (p1 < end) {
 			u_accum = 0;
 			v_accum = 0;
@@ -169,43 +290,265 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 	}
 }
 
+static int
+yuv_frame_size(struct wcap_decoder *decoder, int depth)
+{
+	if (depth == 444)
+		return decoder->width * decoder->height * 3;
+	else
+		return decoder->width * decoder->height * 3 / 2;
+}
+
+static void
+convert_yuv_frame(struct wcap_decoder *decoder, int depth, unsigned char *out)
+{
+	if (depth == 444) {
+		convert_to_yuv444(decoder, out);
+	} else {
+		convert_to_yv12(decoder, out);
+	}
+}
+
 static void
 output_yuv_frame(struct wcap_decoder *decoder, int depth)
 {
 	static unsigned char *out;
 	int size;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
-	}
+	size = yuv_frame_size(decoder, depth);
 	if (out == NULL)
 		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
-	}
+	convert_yuv_frame(decoder, depth, out);
 
 	printf("FRAME\n");
 	fwrite(out, 1, size, stdout);
 }
 
+/* Output frames handed out to a decoder thread at a time. */
+#define BLOCK_FRAMES	4
+
+struct output_slot {
+	unsigned char *data;
+	int ready;
+};
+
+/* Decodes and converts frames for a yuv4mpeg2 stream on several threads,
+ * each with its own decoder. Threads take blocks of output frames in
+ * order and seek to them through the index, restarting from a keyframe
+ * when there is one between their previous block and the next. The
+ * converted frames go to a ring of slots the main thread writes out in
+ * order, which bounds the memory used to a few frames per thread. */
+struct parallel_decode {
+	const char *filename;
+	int depth;
+	int size;
+
+	uint32_t *sources;		/* source frame of each output frame */
+	int count;
+
+	struct output_slot *slots;
+	int nslots;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int next_block;			/* protected by mutex */
+	int written;			/* protected by mutex */
+	int failed;			/* protected by mutex */
+};
+
+/* The same frames the sequential loop in main() picks: for each step of
+ * the output frame rate, the first frame at or after that time. */
+static uint32_t *
+map_output_frames(struct wcap_decoder *decoder, uint32_t frame_time,
+		  int *count)
+{
+	struct wcap_index_entry *index = decoder->index;
+	uint32_t *sources = NULL, *tmp, msecs, j = 0;
+	int n = 0, alloc = 0;
+
+	if (decoder->index_count == 0) {
+		*count = 0;
+		return NULL;
+	}
+
+	msecs = index[0].msecs;
+	for (;;) {
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			tmp = realloc(sources, alloc * sizeof *sources);
+			if (tmp == NULL) {
+				free(sources);
+				return NULL;
+			}
+			sources = tmp;
+		}
+		sources[n++] = j;
+
+		msecs += frame_time;
+		while (index[j].msecs < msecs) {
+			if (j + 1 == decoder->index_count) {
+				*count = n;
+				return sources;
+			}
+			j++;
+		}
+	}
+}
+
+static void *
+decode_thread(void *data)
+{
+	struct parallel_decode *pd = data;
+	struct wcap_decoder *decoder;
+	struct output_slot *slot;
+	int k, first, last, ok;
+
+	decoder = wcap_decoder_create(pd->filename);
+
+	pthread_mutex_lock(&pd->mutex);
+	if (decoder == NULL)
+		pd->failed = 1;
+
+	while (!pd->failed && pd->next_block * BLOCK_FRAMES < pd->count) {
+		first = pd->next_block++ * BLOCK_FRAMES;
+		last = first + BLOCK_FRAMES;
+		if (last > pd->count)
+			last = pd->count;
+
+		for (k = first; k < last; k++) {
+			while (k >= pd->written + pd->nslots && !pd->failed)
+				pthread_cond_wait(&pd->cond, &pd->mutex);
+			if (pd->failed)
+				break;
+			pthread_mutex_unlock(&pd->mutex);
+
+			slot = &pd->slots[k % pd->nslots];
+			ok = wcap_decoder_seek_frame(decoder, pd->sources[k]);
+			if (ok)
+				convert_yuv_frame(decoder, pd->depth,
+						  slot->data);
+
+			pthread_mutex_lock(&pd->mutex);
+			if (ok)
+				slot->ready = 1;
+			else
+				pd->failed = 1;
+			pthread_cond_broadcast(&pd->cond);
+		}
+	}
+	pthread_cond_broadcast(&pd->cond);
+	pthread_mutex_unlock(&pd->mutex);
+
+	if (decoder)
+		wcap_decoder_destroy(decoder);
+
+	return NULL;
+}
+
+/* Returns the number of frames written, or -1 if threads can't be used
+ * and the caller should decode sequentially. */
+static int
+output_yuv_parallel(struct wcap_decoder *decoder, const char *filename,
+		    int depth, uint32_t frame_time, int nthreads)
+{
+	struct parallel_decode pd;
+	struct output_slot *slot;
+	pthread_t *threads;
+	int i, k, started = 0;
+
+	memset(&pd, 0, sizeof pd);
+	pd.filename = filename;
+	pd.depth = depth;
+	pd.size = yuv_frame_size(decoder, depth);
+	pd.sources = map_output_frames(decoder, frame_time, &pd.count);
+	if (pd.sources == NULL)
+		return -1;
+
+	pd.nslots = 2 * nthreads * BLOCK_FRAMES;
+	pd.slots = calloc(pd.nslots, sizeof *pd.slots);
+	threads = calloc(nthreads, sizeof *threads);
+	if (pd.slots == NULL || threads == NULL)
+		goto out;
+	for (i = 0; i < pd.nslots; i++) {
+		pd.slots[i].data = malloc(pd.size);
+		if (pd.slots[i].data == NULL)
+			goto out;
+	}
+
+	pthread_mutex_init(&pd.mutex, NULL);
+	pthread_cond_init(&pd.cond, NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, decode_thread, &pd) != 0)
+			break;
+		started++;
+	}
+
+	k = 0;
+	if (started > 0) {
+		for (k = 0; k < pd.count; k++) {
+			slot = &pd.slots[k % pd.nslots];
+
+			pthread_mutex_lock(&pd.mutex);
+			while (!slot->ready && !pd.failed)
+				pthread_cond_wait(&pd.cond, &pd.mutex);
+			pthread_mutex_unlock(&pd.mutex);
+			if (!slot->ready)
+				break;
+
+			printf("FRAME\n");
+			fwrite(slot->data, 1, pd.size, stdout);
+
+			pthread_mutex_lock(&pd.mutex);
+			slot->ready = 0;
+			pd.written++;
+			pthread_cond_broadcast(&pd.cond);
+			pthread_mutex_unlock(&pd.mutex);
+		}
+	}
+
+	/* Stop the threads if we bailed out early. */
+	pthread_mutex_lock(&pd.mutex);
+	pd.failed = 1;
+	pthread_cond_broadcast(&pd.cond);
+	pthread_mutex_unlock(&pd.mutex);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pd.mutex);
+	pthread_cond_destroy(&pd.cond);
+
+	if (k < pd.count)
+		fprintf(stderr, "decoding failed after %d frames\n", k);
+
+out:
+	if (pd.slots)
+		for (i = 0; i < pd.nslots; i++)
+			free(pd.slots[i].data);
+	free(pd.slots);
+	free(threads);
+	free(pd.sources);
+
+	return started > 0 ? k : -1;
+}
+
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
-		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--time=<msecs>]\n"
+		"\t[--all] [--rate=<num:denom>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
+		"\t--time=<msecs>\t\twrite out the frame shown at the given\n"
+		"\t\t\t\ttime from the start as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tdecode threads for yuv4mpeg2 output of\n"
+		"\t\t\t\tversion 2 files, default one per cpu\n\n");
 
 	exit(exit_code);
 }
@@ -214,6 +557,7 @@ int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
+	int output_time = -1, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 	int num = 30, denom = 1;
 	char filename[200];
 	char *mode;
@@ -230,6 +574,10 @@ int main(int argc, char *argv[])
 			all = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
+		} else if (sscanf(argv[i], "--time=%d", &output_time) == 1) {
+			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
@@ -268,6 +616,32 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* A single frame, v2 files with an index decode it from the
+	 * keyframe before it instead of from the start. */
+	if (!all && !yuv4mpeg2 && (output_frame >= 0 || output_time >= 0)) {
+		if (output_frame >= 0)
+			has_frame = wcap_decoder_seek_frame(decoder,
+							    output_frame);
+		else if (wcap_decoder_seek_frame(decoder, 0))
+			has_frame = wcap_decoder_seek_time(decoder,
+						decoder->msecs + output_time);
+		else
+			has_frame = 0;
+
+		if (has_frame) {
+			snprintf(filename, sizeof filename,
+				 "wcap-frame-%d.png", decoder->count - 1);
+			write_png(decoder, filename);
+			fprintf(stderr, "wrote %s\n", filename);
+		} else {
+			fprintf(stderr, "no such frame\n");
+		}
+
+		wcap_decoder_destroy(decoder);
+
+		return has_frame ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	if (yuv4mpeg2) {
 		if (yuv4mpeg2 == 444) {
 			mode = "C444";
@@ -279,10 +653,23 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
-	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
 	frame_time = 1000 * denom / num;
+
+	/* Only version 2 files have the index and keyframes needed to
+	 * split the work. Frames still come out in order on stdout. */
+	i = -1;
+	if (yuv4mpeg2 && !all && output_frame < 0 && nthreads > 1 &&
+	    decoder->index && frame_time > 0)
+		i = output_yuv_parallel(decoder, argv[1], yuv4mpeg2,
+					frame_time, nthreads);
+	if (i >= 0)
+		has_frame = 0;
+	else
+		has_frame = wcap_decoder_get_frame(decoder);
+
+	if (has_frame)
+		i = 0;
+	msecs = decoder->msecs;
 	while (has_frame) {
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
@@ -36,18 +36,23 @@
 #include <string.h>
 #include <fcntl.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-rle.h"
+#include "shared/zalloc.h"
 
-static void
+static const uint32_t *
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
-			      struct wcap_rectangle *rect)
+			      struct wcap_rectangle *rect, const uint32_t *p)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, k, l, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
@@ -61,15 +66,14 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* Runs wrap from one row to the next, apply them a row
+		 * segment at a time. */
+		for (k = 0; k < j; k += n) {
+			n = j - k;
+			if (n > rect->x2 - x)
+				n = rect->x2 - x;
+			wcap_rle_apply(d + x, v, n);
+			x += n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
@@ -82,40 +86,307 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 		printf("rle encoding longer than expected (%d expected %d)\n",
 		       i, count);
 
-	decoder->p = p;
+	return p;
 }
 
-int
-wcap_decoder_get_frame(struct wcap_decoder *decoder)
+static int
+wcap_decoder_get_frame_v1(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
+	const uint32_t *p;
 	uint32_t i;
 
-	if (decoder->p == decoder->end)
-		return 0;
-
 	header = decoder->p;
 	decoder->msecs = header->msecs;
 	decoder->count++;
 
 	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
+	p = (uint32_t *) (rects + header->nrects);
+	for (i = 0; i < header->nrects; i++)
+		p = wcap_decoder_decode_rectangle(decoder, &rects[i], p);
+	decoder->p = (void *) p;
+
+	return 1;
+}
+
+static int
+wcap_decoder_get_frame_v2(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header_v2 *header = decoder->p;
+	struct wcap_rectangle *rects;
+	void *payload = header + 1;
+	const uint32_t *p;
+	uint32_t i;
+
+	if (header->flags & WCAP_FRAME_COMPRESSED) {
+#ifdef HAVE_ZLIB
+		uLongf size = header->raw_size;
+		void *scratch;
+
+		if (decoder->scratch_size < header->raw_size) {
+			scratch = realloc(decoder->scratch, header->raw_size);
+			if (scratch == NULL) {
+				fprintf(stderr, "out of memory\n");
+				return 0;
+			}
+			decoder->scratch = scratch;
+			decoder->scratch_size = header->raw_size;
+		}
+
+		if (uncompress(decoder->scratch, &size,
+			       payload, header->size) != Z_OK ||
+		    size != header->raw_size) {
+			fprintf(stderr, "frame %d is corrupt\n",
+				decoder->count);
+			return 0;
+		}
+		payload = decoder->scratch;
+#else
+		fprintf(stderr, "wcap-decode was built without zlib, "
+			"can not decode compressed frames\n");
+		return 0;
+#endif
+	}
+
+	/* Keyframes are encoded against a black frame. */
+	if (header->flags & WCAP_FRAME_KEYFRAME)
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
+	decoder->msecs = header->msecs;
+	decoder->count++;
+	decoder->p = (char *) (header + 1) + WCAP_ALIGN(header->size);
+
+	rects = payload;
+	p = (uint32_t *) (rects + header->nrects);
 	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+		p = wcap_decoder_decode_rectangle(decoder, &rects[i], p);
+
+	return 1;
+}
+
+int
+wcap_decoder_get_frame(struct wcap_decoder *decoder)
+{
+	if (decoder->p == decoder->end)
+		return 0;
+
+	if (decoder->version == 2)
+		return wcap_decoder_get_frame_v2(decoder);
+	else
+		return wcap_decoder_get_frame_v1(decoder);
+}
+
+/** Decode the given frame
+ *
+ * \param decoder The decoder.
+ * \param frame The frame number, counting from 0.
+ * \return 1 on success, 0 if there is no such frame.
+ *
+ * With an index, decoding starts from the keyframe before the frame, or
+ * continues from the current frame if that is closer. Without one, it
+ * starts over from the first frame when seeking backwards.
+ */
+int
+wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame)
+{
+	struct wcap_index_entry *entry;
+
+	if (decoder->index) {
+		if (frame >= decoder->index_count)
+			return 0;
+
+		entry = &decoder->index[frame];
+		if (decoder->count == 0 ||
+		    decoder->count - 1 > frame ||
+		    decoder->count - 1 < entry->keyframe) {
+			decoder->p = (char *) decoder->map +
+				decoder->index[entry->keyframe].offset;
+			decoder->count = entry->keyframe;
+		}
+	} else if (decoder->count > frame) {
+		decoder->p = decoder->first;
+		decoder->count = 0;
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+	}
+
+	while (decoder->count <= frame)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
 
 	return 1;
 }
 
+/** Decode the last frame shown at the given time
+ *
+ * \param decoder The decoder.
+ * \param msecs The time, in the clock of the frame timestamps.
+ * \return 1 on success, 0 if the file has no frames.
+ *
+ * Times before the first frame give the first frame.
+ */
+int
+wcap_decoder_seek_time(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	struct wcap_frame_header *next;
+	uint32_t lo, hi, mid;
+
+	if (decoder->index == NULL) {
+		if (!wcap_decoder_seek_frame(decoder, 0))
+			return 0;
+
+		/* Both frame header versions start with the timestamp. */
+		while (decoder->p != decoder->end) {
+			next = decoder->p;
+			if (next->msecs > msecs ||
+			    !wcap_decoder_get_frame(decoder))
+				break;
+		}
+
+		return 1;
+	}
+
+	/* The last entry at or before msecs. */
+	lo = 0;
+	hi = decoder->index_count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (decoder->index[mid].msecs <= msecs)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return wcap_decoder_seek_frame(decoder, lo);
+}
+
+static int
+wcap_decoder_map_index(struct wcap_decoder *decoder, uint64_t offset)
+{
+	struct wcap_index_header *header;
+
+	if (offset == 0 || offset % 8 != 0 ||
+	    decoder->size < sizeof *header ||
+	    offset > decoder->size - sizeof *header)
+		return -1;
+
+	header = (void *) ((char *) decoder->map + offset);
+	if (header->magic != WCAP_INDEX_MAGIC ||
+	    header->count > (decoder->size - offset - sizeof *header) /
+			    sizeof *decoder->index)
+		return -1;
+
+	decoder->index = (void *) (header + 1);
+	decoder->index_count = header->count;
+	decoder->own_index = 0;
+	decoder->end = header;
+
+	return 0;
+}
+
+/* Recordings that were cut short have no index, walk the frame headers
+ * to build one, and stop at the first incomplete frame. */
+static int
+wcap_decoder_scan_index(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header_v2 *header;
+	struct wcap_index_entry *index = NULL, *entry;
+	uint32_t count = 0, alloc = 0, keyframe = 0;
+	char *p = decoder->first;
+	char *end = (char *) decoder->map + decoder->size;
+	size_t size;
+
+	while ((size_t) (end - p) >= sizeof *header) {
+		header = (void *) p;
+		size = sizeof *header + WCAP_ALIGN((size_t) header->size);
+		if ((size_t) (end - p) < size)
+			break;
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			entry = realloc(index, alloc * sizeof *index);
+			if (entry == NULL) {
+				free(index);
+				return -1;
+			}
+			index = entry;
+		}
+
+		if (header->flags & WCAP_FRAME_KEYFRAME)
+			keyframe = count;
+
+		entry = &index[count++];
+		entry->offset = p - (char *) decoder->map;
+		entry->msecs = header->msecs;
+		entry->keyframe = keyframe;
+
+		p += size;
+	}
+
+	fprintf(stderr, "wcap file has no index, %d complete frames\n", count);
+
+	decoder->index = index;
+	decoder->index_count = count;
+	decoder->own_index = 1;
+	decoder->end = p;
+
+	return 0;
+}
+
+static int
+wcap_decoder_read_header(struct wcap_decoder *decoder)
+{
+	struct wcap_header *header = decoder->map;
+	struct wcap_header_v2 *header_v2 = decoder->map;
+
+	if (decoder->size < sizeof *header)
+		return -1;
+
+	decoder->format = header->format;
+	decoder->width = header->width;
+	decoder->height = header->height;
+	decoder->end = (char *) decoder->map + decoder->size;
+
+	switch (header->magic) {
+	case WCAP_HEADER_MAGIC:
+		decoder->version = 1;
+		decoder->compression = WCAP_COMPRESSION_NONE;
+		decoder->first = header + 1;
+		return 0;
+	case WCAP_HEADER_MAGIC_V2:
+		if (decoder->size < sizeof *header_v2)
+			return -1;
+
+		decoder->version = 2;
+		decoder->compression = header_v2->compression;
+		decoder->first = header_v2 + 1;
+		if (decoder->compression != WCAP_COMPRESSION_NONE &&
+		    decoder->compression != WCAP_COMPRESSION_ZLIB) {
+			fprintf(stderr, "unknown wcap compression %d\n",
+				decoder->compression);
+			return -1;
+		}
+
+		if (wcap_decoder_map_index(decoder,
+					   header_v2->index_offset) < 0)
+			return wcap_decoder_scan_index(decoder);
+		return 0;
+	default:
+		fprintf(stderr, "not a wcap file\n");
+		return -1;
+	}
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
 	struct wcap_decoder *decoder;
-	struct wcap_header *header;
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = zalloc(sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -131,27 +402,32 @@ wcap_decoder_create(const char *filename)
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
+		close(decoder->fd);
 		free(decoder);
 		return NULL;
 	}
 
-	header = decoder->map;
-	decoder->format = header->format;
+	if (wcap_decoder_read_header(decoder) < 0)
+		goto err;
+
 	decoder->count = 0;
-	decoder->width = header->width;
-	decoder->height = header->height;
-	decoder->p = header + 1;
-	decoder->end = decoder->map + decoder->size;
+	decoder->p = decoder->first;
 
-	frame_size = header->width * header->height * 4;
+	frame_size = decoder->width * decoder->height * 4;
 	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		free(decoder);
-		return NULL;
-	}
+	if (decoder->frame == NULL)
+		goto err;
 	memset(decoder->frame, 0, frame_size);
 
 	return decoder;
+
+err:
+	if (decoder->own_index)
+		free(decoder->index);
+	munmap(decoder->map, decoder->size);
+	close(decoder->fd);
+	free(decoder);
+	return NULL;
 }
 
 void
@@ -159,6 +435,9 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	if (decoder->own_index)
+		free(decoder->index);
+	free(decoder->scratch);
 	free(decoder->frame);
 	free(decoder);
 }
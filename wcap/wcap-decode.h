@@ -27,23 +27,63 @@
 #define _WCAP_DECODE_
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_INDEX_MAGIC	0x57434958
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
 #define WCAP_FORMAT_RGBX8888	0x34325852
 #define WCAP_FORMAT_BGRX8888	0x34325842
 
+#define WCAP_COMPRESSION_NONE	0
+#define WCAP_COMPRESSION_ZLIB	1
+
+#define WCAP_FRAME_KEYFRAME	(1 << 0)
+#define WCAP_FRAME_COMPRESSED	(1 << 1)
+
+/* Frames, the index and the index header are all 8 byte aligned. */
+#define WCAP_ALIGN(size)	(((size) + 7) & ~7)
+
 struct wcap_header {
 	uint32_t magic;
 	uint32_t format;
 	uint32_t width, height;
 };
 
+struct wcap_header_v2 {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t width, height;
+	uint32_t compression;
+	uint32_t keyframe_interval;	/* msecs, 0 for only the first */
+	uint64_t index_offset;		/* 0 if the recording was cut short */
+};
+
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
 };
 
+struct wcap_frame_header_v2 {
+	uint32_t msecs;
+	uint32_t flags;
+	uint32_t nrects;
+	uint32_t size;			/* of the payload in the file */
+	uint32_t raw_size;		/* of the uncompressed payload */
+	uint32_t reserved;
+};
+
+struct wcap_index_header {
+	uint32_t magic;
+	uint32_t count;
+};
+
+struct wcap_index_entry {
+	uint64_t offset;		/* of the frame header */
+	uint32_t msecs;
+	uint32_t keyframe;		/* frame to start decoding from */
+};
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
@@ -57,9 +97,20 @@ struct wcap_decoder {
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+
+	uint32_t version;
+	uint32_t compression;
+	void *first;
+	struct wcap_index_entry *index;
+	uint32_t index_count;
+	int own_index;
+	void *scratch;
+	size_t scratch_size;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame);
+int wcap_decoder_seek_time(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The delta and run length coding of wcap rectangles, with SSE2 and
+ * AVX2 versions of the inner loops. All versions produce the same bytes:
+ * the vector loops only take the common case of a whole vector extending
+ * the current run, and hand anything else to the scalar code.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#include "wcap-rle.h"
+
+#define DELTA_MASK	0x00ffffff
+#define ALPHA_MASK	0xff000000
+
+static enum wcap_rle_impl forced_impl = WCAP_RLE_AUTO;
+
+static int
+impl_supported(enum wcap_rle_impl impl)
+{
+	switch (impl) {
+	case WCAP_RLE_AUTO:
+	case WCAP_RLE_SCALAR:
+		return 1;
+#ifdef HAVE_SSE2
+	case WCAP_RLE_SSE2:
+		return 1;
+#endif
+#ifdef HAVE_AVX2
+	case WCAP_RLE_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+/** Force the kernels to use
+ *
+ * \param impl The kernels, or WCAP_RLE_AUTO to pick the best available.
+ * \return 0 on success, -1 if this build or CPU lacks them.
+ *
+ * Not thread-safe, meant to be called before any coding starts.
+ */
+int
+wcap_rle_set_impl(enum wcap_rle_impl impl)
+{
+	if (!impl_supported(impl))
+		return -1;
+
+	forced_impl = impl;
+
+	return 0;
+}
+
+enum wcap_rle_impl
+wcap_rle_get_impl(void)
+{
+	if (forced_impl != WCAP_RLE_AUTO)
+		return forced_impl;
+
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return WCAP_RLE_AVX2;
+#endif
+#ifdef HAVE_SSE2
+	return WCAP_RLE_SSE2;
+#else
+	return WCAP_RLE_SCALAR;
+#endif
+}
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static inline void
+encode_delta(struct wcap_rle_encoder *encoder, uint32_t delta)
+{
+	if (encoder->run == 0 || delta == encoder->prev) {
+		encoder->run++;
+	} else {
+		encoder->p = output_run(encoder->p, encoder->prev,
+					encoder->run);
+		encoder->run = 1;
+	}
+	encoder->prev = delta;
+}
+
+static void
+encode_scalar(struct wcap_rle_encoder *encoder,
+	      const uint32_t *next, uint32_t *frame, int count)
+{
+	int k;
+
+	for (k = 0; k < count; k++) {
+		encode_delta(encoder, component_delta(next[k], frame[k]));
+		frame[k] = next[k];
+	}
+}
+
+static void
+apply_scalar(uint32_t *d, uint32_t delta, int count)
+{
+	unsigned char r, g, b, dr, dg, db;
+	int k;
+
+	dr = (delta >> 16);
+	dg = (delta >>  8);
+	db = (delta >>  0);
+	for (k = 0; k < count; k++) {
+		r = (d[k] >> 16) + dr;
+		g = (d[k] >>  8) + dg;
+		b = (d[k] >>  0) + db;
+		d[k] = ALPHA_MASK | (r << 16) | (g << 8) | b;
+	}
+}
+
+#ifdef HAVE_SSE2
+/* The per component delta is a byte-wise subtraction with the top byte
+ * cleared, and applying it a byte-wise addition with the top byte set. */
+static void
+encode_sse2(struct wcap_rle_encoder *encoder,
+	    const uint32_t *next, uint32_t *frame, int count)
+{
+	const __m128i mask = _mm_set1_epi32(DELTA_MASK);
+	uint32_t deltas[4];
+	__m128i n, f, d;
+	int k, i;
+
+	for (k = 0; k + 4 <= count; k += 4) {
+		n = _mm_loadu_si128((const __m128i *) (next + k));
+		f = _mm_loadu_si128((const __m128i *) (frame + k));
+		d = _mm_and_si128(_mm_sub_epi8(n, f), mask);
+		_mm_storeu_si128((__m128i *) (frame + k), n);
+
+		if (encoder->run > 0 &&
+		    _mm_movemask_epi8(_mm_cmpeq_epi32(d,
+				_mm_set1_epi32(encoder->prev))) == 0xffff) {
+			encoder->run += 4;
+			continue;
+		}
+
+		_mm_storeu_si128((__m128i *) deltas, d);
+		for (i = 0; i < 4; i++)
+			encode_delta(encoder, deltas[i]);
+	}
+
+	encode_scalar(encoder, next + k, frame + k, count - k);
+}
+
+static void
+apply_sse2(uint32_t *d, uint32_t delta, int count)
+{
+	const __m128i v = _mm_set1_epi32(delta & DELTA_MASK);
+	const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+	__m128i p;
+	int k;
+
+	for (k = 0; k + 4 <= count; k += 4) {
+		p = _mm_loadu_si128((const __m128i *) (d + k));
+		p = _mm_or_si128(_mm_add_epi8(p, v), alpha);
+		_mm_storeu_si128((__m128i *) (d + k), p);
+	}
+
+	apply_scalar(d + k, delta, count - k);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void
+encode_avx2(struct wcap_rle_encoder *encoder,
+	    const uint32_t *next, uint32_t *frame, int count)
+{
+	const __m256i mask = _mm256_set1_epi32(DELTA_MASK);
+	uint32_t deltas[8];
+	__m256i n, f, d;
+	int k, i;
+
+	for (k = 0; k + 8 <= count; k += 8) {
+		n = _mm256_loadu_si256((const __m256i *) (next + k));
+		f = _mm256_loadu_si256((const __m256i *) (frame + k));
+		d = _mm256_and_si256(_mm256_sub_epi8(n, f), mask);
+		_mm256_storeu_si256((__m256i *) (frame + k), n);
+
+		if (encoder->run > 0 &&
+		    _mm256_movemask_epi8(_mm256_cmpeq_epi32(d,
+				_mm256_set1_epi32(encoder->prev))) == -1) {
+			encoder->run += 8;
+			continue;
+		}
+
+		_mm256_storeu_si256((__m256i *) deltas, d);
+		for (i = 0; i < 8; i++)
+			encode_delta(encoder, deltas[i]);
+	}
+
+	encode_scalar(encoder, next + k, frame + k, count - k);
+}
+
+__attribute__((target("avx2")))
+static void
+apply_avx2(uint32_t *d, uint32_t delta, int count)
+{
+	const __m256i v = _mm256_set1_epi32(delta & DELTA_MASK);
+	const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+	__m256i p;
+	int k;
+
+	for (k = 0; k + 8 <= count; k += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (d + k));
+		p = _mm256_or_si256(_mm256_add_epi8(p, v), alpha);
+		_mm256_storeu_si256((__m256i *) (d + k), p);
+	}
+
+	apply_scalar(d + k, delta, count - k);
+}
+#endif
+
+void
+wcap_rle_encoder_init(struct wcap_rle_encoder *encoder, uint32_t *out)
+{
+	encoder->p = out;
+	encoder->prev = 0;
+	encoder->run = 0;
+}
+
+/** Encode pixels against the previous frame
+ *
+ * \param encoder The encoder of the current rectangle.
+ * \param next The new pixels.
+ * \param frame The same pixels in the previous frame, replaced by next.
+ * \param count The number of pixels.
+ */
+void
+wcap_rle_encode(struct wcap_rle_encoder *encoder,
+		const uint32_t *next, uint32_t *frame, int count)
+{
+	switch (wcap_rle_get_impl()) {
+#ifdef HAVE_AVX2
+	case WCAP_RLE_AVX2:
+		encode_avx2(encoder, next, frame, count);
+		break;
+#endif
+#ifdef HAVE_SSE2
+	case WCAP_RLE_SSE2:
+		encode_sse2(encoder, next, frame, count);
+		break;
+#endif
+	default:
+		encode_scalar(encoder, next, frame, count);
+		break;
+	}
+}
+
+/** Flush the last run of a rectangle
+ *
+ * \return The end of the encoded rectangle.
+ */
+uint32_t *
+wcap_rle_encoder_finish(struct wcap_rle_encoder *encoder)
+{
+	encoder->p = output_run(encoder->p, encoder->prev, encoder->run);
+	encoder->run = 0;
+
+	return encoder->p;
+}
+
+/** Apply one run to decoded pixels
+ *
+ * \param d The pixels of the previous frame, updated in place.
+ * \param delta The run value, its length byte is ignored.
+ * \param count The number of pixels, all within one row.
+ */
+void
+wcap_rle_apply(uint32_t *d, uint32_t delta, int count)
+{
+	switch (wcap_rle_get_impl()) {
+#ifdef HAVE_AVX2
+	case WCAP_RLE_AVX2:
+		apply_avx2(d, delta, count);
+		break;
+#endif
+#ifdef HAVE_SSE2
+	case WCAP_RLE_SSE2:
+		apply_sse2(d, delta, count);
+		break;
+#endif
+	default:
+		apply_scalar(d, delta, count);
+		break;
+	}
+}
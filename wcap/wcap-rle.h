@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WCAP_RLE_
+#define _WCAP_RLE_
+
+#include <stdint.h>
+
+/* Which kernels encode and decode runs. AUTO picks the fastest one
+ * the CPU supports, the others are there for tests and benchmarks. */
+enum wcap_rle_impl {
+	WCAP_RLE_AUTO = 0,
+	WCAP_RLE_SCALAR,
+	WCAP_RLE_SSE2,
+	WCAP_RLE_AVX2,
+};
+
+/* Encoding state of one rectangle, runs continue from row to row. */
+struct wcap_rle_encoder {
+	uint32_t *p;
+	uint32_t prev;
+	int run;
+};
+
+int wcap_rle_set_impl(enum wcap_rle_impl impl);
+enum wcap_rle_impl wcap_rle_get_impl(void);
+
+void wcap_rle_encoder_init(struct wcap_rle_encoder *encoder, uint32_t *out);
+void wcap_rle_encode(struct wcap_rle_encoder *encoder,
+		     const uint32_t *next, uint32_t *frame, int count);
+uint32_t *wcap_rle_encoder_finish(struct wcap_rle_encoder *encoder);
+
+void wcap_rle_apply(uint32_t *d, uint32_t delta, int count);
+
+#endif